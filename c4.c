@@ -31,6 +31,9 @@ char *p, *lp, // current position in source code
 int *e, *le,  // current position in emitted code
     *id,      // currently parsed identifier
     *sym,     // symbol table (simple list of identifiers)
+    *symend,  // next free symbol table entry
+    *symhash, // open addressed index of sym entries, by identifier hash
+    symmask,  // symhash size - 1
     tk,       // current token
     ival,     // current token value
     ty,       // current expression type
@@ -60,6 +63,7 @@ enum { Tk, Hash, Name, Class, Type, Val, HClass, HType, HVal, Idsz };
 void next()
 {
   char *pp;
+  int hs;
 
   while (tk = *p) {
     ++p;
@@ -84,11 +88,13 @@ void next()
       while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')
         tk = tk * 147 + *p++;
       tk = (tk << 6) + (p - pp);
-      id = sym;
-      while (id[Tk]) {
+      hs = ((tk >> 6) * 40503) & symmask;
+      while ((id = (int *)symhash[hs])) {
         if (tk == id[Hash] && !memcmp((char *)id[Name], pp, p - pp)) { tk = id[Tk]; return; }
-        id = id + Idsz;
+        hs = (hs + 1) & symmask;
       }
+      symhash[hs] = (int)(id = symend);
+      symend = symend + Idsz;
       id[Name] = (int)pp;
       id[Hash] = tk;
       tk = id[Tk] = Id;
@@ -364,11 +370,15 @@ int main(int argc, char **argv)
 
   poolsz = 256*1024; // arbitrary size
   if (!(sym = _sym = malloc(poolsz))) { printf("could not malloc(%d) symbol area\n", poolsz); return -1; }
+  if (!(symhash = malloc(poolsz))) { printf("could not malloc(%d) symbol index\n", poolsz); return -1; }
   if (!(le = e = _e = malloc(poolsz))) { printf("could not malloc(%d) text area\n", poolsz); return -1; }
   if (!(data = _data = malloc(poolsz))) { printf("could not malloc(%d) data area\n", poolsz); return -1; }
   if (!(sp = _sp = malloc(poolsz))) { printf("could not malloc(%d) stack area\n", poolsz); return -1; }
 
   memset(sym,  0, poolsz);
+  memset(symhash, 0, poolsz);
+  symmask = poolsz / sizeof(int) - 1; // more slots than sym has entries
+  symend = sym;
   memset(e,    0, poolsz);
   memset(data, 0, poolsz);
 
@@ -554,6 +564,7 @@ int main(int argc, char **argv)
 
   // free memory
   free(_sym);
+  free(symhash);
   free(_e);
   free(_data);
   free(_sp);
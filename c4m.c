@@ -11,6 +11,12 @@
 //  -s           Print the source and exit (memory leaks)
 //  -S           Print source symbol listing
 //  -d           Enable debug output during execution
+//  -T           Disable the threaded dispatch engine (native builds only)
+//  -f           Fuse common instruction sequences into superinstructions
+//  -j           Enable the x86-64 template JIT (native builds only)
+//  -x <module>  Select a native extension module, may be repeated (native builds only)
+//  -b           Bounds checked safe mode, raising TRAP_SEGV (native builds only)
+//  -r <cycles>  Sample a profile about every given cycles, printed at exit (native builds only)
 //  -p           (Currently nonfunctional) Decrease pool size
 //  -P           (Currently nonfunctional)
 // TODO: Fix the above two parameters.
@@ -35,6 +41,22 @@
 //       CONF_CYCLE_INTERRUPT_HANDLER   The function address of the handler.
 //       The cycle handler signature is:
 //       void handler(int type, int ins, int *a, int *bp, int *sp, int *returnpc) {}
+//     And one that registers fast opcodes:
+//       CONF_FAST_OPCODES              A table of FAST_OPCODES_MAX function addresses,
+//                                      indexed by opcode. 0 disables the table.
+//       An unknown opcode with a non-zero entry is executed as a plain call to
+//       that function, without a trap: no trap frame is built, the cycle
+//       interrupt stays enabled, and the handler's return value is written to
+//       register A. The handler receives the __c4_opcode arguments in place,
+//       so its signature mirrors the call with the opcode last:
+//         __c4_opcode(x, OP_FOO)  ->  int handler(int x, int op) {}
+//       Only handlers that are quick and safe to interrupt should be registered,
+//       everything else should remain on the trap handler path.
+//     And one that binds opcodes to native handlers, see c4m_native.c:
+//       CONF_NATIVE_OPCODE             A NATIVE_REQ_* request naming a handler provided
+//                                      by a module selected with -x, the opcode to bind
+//                                      it to, and a context pointer for the handler.
+//                                      Returns 1 if bound. 0 unbinds all opcodes.
 //
 // - void stacktrace();            Print a stacktrace
 // - void install_trap_handler(void (*handler)(int trap, int ins, int *a, int *bp, int *sp, int *returnpc));
@@ -52,7 +74,16 @@
 // - void __c4_jmp (int address);  Jump directly to a given function address.
 // - void __c4_adjust (int offset);Adjust the stack. Negative offset grows stack.
 // - int __opcode (char *name);    Request the integer value of an opcode.
-// - int __builtin (char *name);   Request the opcode for a builtin.
+// - int __builtin (char *name);   Request the opcode for a builtin, or -1.
+//                                 Includes the string intrinsics below.
+// - String and memory intrinsics, implemented natively when c4m is compiled.
+//   The compilers do not emit these, so they are reached with __c4_opcode,
+//   using an opcode number found with __opcode or __builtin:
+//     SLEN  int strlen (char *s)                 __c4_opcode(s, op)
+//     SCMP  int strcmp (char *a, char *b)        __c4_opcode(b, a, op)
+//     SCHR  char *strchr (char *s, int c)        __c4_opcode(c, s, op)
+//     MMOV  void *memmove (void *d, void *s, n)  __c4_opcode(n, s, d, op)
+//     SCPY  char *strcpy (char *d, char *s)      __c4_opcode(s, d, op)
 // - Adds JSRI: Jump to SubRoutine Indirect
 // - Adds JSRS: Jump to SubRoutine on Stack
 // - Adds &function to get function address. Can be called if stored in an int*.
@@ -85,6 +116,9 @@ char *p, *lp, // current position in source code
 int *e, *le,  // current position in emitted code
     *id,      // currently parsed identifier
     *sym,     // symbol table (simple list of identifiers)
+    *symend,  // next free symbol table entry
+    *symhash, // open addressed index of sym entries, by identifier hash
+    symmask,  // symhash size - 1
     tk,       // current token
     ival,     // current token value
     ty,       // current expression type
@@ -106,7 +140,14 @@ enum {
 };
 
 // Configure codes, for use with C4CF/__c4_configure
-enum { CONF_CYCLE_INTERRUPT_INTERVAL, CONF_CYCLE_INTERRUPT_HANDLER, CONF_PRIVS };
+enum { CONF_CYCLE_INTERRUPT_INTERVAL, CONF_CYCLE_INTERRUPT_HANDLER, CONF_PRIVS, CONF_FAST_OPCODES, CONF_NATIVE_OPCODE };
+// Size of the table given to CONF_FAST_OPCODES
+enum { FAST_OPCODES_MAX = 256 };
+// Request given to CONF_NATIVE_OPCODE
+enum { NATIVE_REQ_NAME, NATIVE_REQ_OPCODE, NATIVE_REQ_CONTEXT, NATIVE_REQ__Sz };
+// Register frame given to native handlers, and their results
+enum { NREG_A, NREG_SP, NREG_BP, NREG_PC, NREG__Sz };
+enum { NATIVE_DONE, NATIVE_TRAP };
 enum { PRIV_KERNEL, PRIV_USER };
 
 // C4INFO state
@@ -146,7 +187,12 @@ enum { LEA ,IMM ,JMP ,JSR ,JSRI,JSRS,BZ  ,BNZ ,ENT ,ADJ ,LEV ,LI  ,LC  ,SI  ,SC
        OR  ,XOR ,AND ,EQ  ,NE  ,LT  ,GT  ,LE  ,GE  ,SHL ,SHR ,ADD ,SUB ,MUL ,DIV ,MOD ,
        OPEN,READ,CLOS,PRTF,MALC,RALC,FREE,MSET,MCMP,MCPY,STRC,ITH ,_OPC,_BLT,_TRP,
 	   OPCD,_JMP,_ADJ,C4CF,C4CY,TIME,SIGH,SIGI,USLP,INFO,OPSL,
-	   EXIT };
+	   EXIT,
+	   // Superinstructions, never emitted by the compiler. See c4m_fuse().
+	   LLI ,LLC ,PSHL,PSHI,ADDI,SUBI,MULI,
+	   // String intrinsics, only reached through OPCD
+	   SLEN,SCMP,SCHR,MMOV,SCPY,
+	   OP__Sz };
 char *c4m_opcodes;
 void c4m_setup_opcodes () {
 	c4m_opcodes =
@@ -155,7 +201,9 @@ void c4m_setup_opcodes () {
 	   "OR  ,XOR ,AND ,EQ  ,NE  ,LT  ,GT  ,LE  ,GE  ,SHL ,SHR ,ADD ,SUB ,MUL ,DIV ,MOD ,"
 	   "OPEN,READ,CLOS,PRTF,MALC,RALC,FREE,MSET,MCMP,MCPY,STRC,ITH ,_OPC,_BLT,_TRP,"
 	   "OPCD,_JMP,_ADJ,C4CF,C4CY,TIME,SIGH,SIGI,USLP,INFO,OPSL,"
-	   "EXIT,";
+	   "EXIT,"
+	   "LLI ,LLC ,PSHL,PSHI,ADDI,SUBI,MULI,"
+	   "SLEN,SCMP,SCHR,MMOV,SCPY,";
 }
 char *c4m_builtins;
 void c4m_setup_builtins () {
@@ -173,15 +221,16 @@ char __toupper (char ch) {
     return ch;
 }
 // Match up to 4 characters, stopping on space or end of string
+// Both names must end together, so that "ADDI" does not match "ADD".
 // @return 0 on no match, 1 on match
 int __opcode_match (char *op_a, char *op_b) {
-    int m;
+    int m, end_a, end_b;
     m = 0;
     while(m < 4) {
-        if (*op_a == 0 || *op_a == ' ')
-            return 1;
-        else if(*op_b == 0 || *op_b == ' ')
-            return 1;
+        end_a = *op_a == 0 || *op_a == ' ';
+        end_b = *op_b == 0 || *op_b == ' ' || *op_b == ',';
+        if (end_a || end_b)
+            return end_a && end_b;
 
         // convert to uppercase for comparison
         if(__toupper(*op_a++) != __toupper(*op_b++))
@@ -203,7 +252,7 @@ int __opcode (char *name) {
 		return -1;
 	}
     r = 0;
-    while(r <= EXIT) {
+    while(r < OP__Sz) {
         if (__opcode_match(name, ops))
             return r;
         ++r;
@@ -211,8 +260,33 @@ int __opcode (char *name) {
     }
     return -1;
 }
+// Find name in a list of words separated by spaces.
+// @return index of the word, or -1
+int __word_index (char *list, char *name) {
+    char *n;
+    int r;
+    r = 0;
+    while (*list) {
+        n = name;
+        while (*n && *n == *list) { ++n; ++list; }
+        if (!*n && (*list == ' ' || !*list)) return r;
+        while (*list && *list != ' ') ++list;
+        while (*list == ' ') ++list;
+        ++r;
+    }
+    return -1;
+}
+// Builtin functions follow the keywords in c4m_builtins, starting with open,
+// and map to the opcodes OPEN .. EXIT in order. The string intrinsics are
+// not compiler builtins, but are found by their C names too.
 int __builtin (char *name) {
-    // TODO
+    int r, open;
+
+    open = __word_index(c4m_builtins, "open");
+    if ((r = __word_index(c4m_builtins, name)) >= open && r - open + OPEN <= EXIT)
+        return r - open + OPEN;
+    if ((r = __word_index("strlen strcmp strchr memmove strcpy", name)) >= 0)
+        return SLEN + r;
     return -1;
 }
 
@@ -230,6 +304,7 @@ void dump_exit (int code) {
 void next()
 {
   char *pp;
+  int hs;
 
   while (tk = *p) {
     ++p;
@@ -252,11 +327,13 @@ void next()
       while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')
         tk = tk * 147 + *p++;
       tk = (tk << 6) + (p - pp);
-      id = sym;
-      while (id[Tk]) {
+      hs = ((tk >> 6) * 40503) & symmask;
+      while ((id = (int *)symhash[hs])) {
         if (tk == id[Hash] && !memcmp((char *)id[Name], pp, p - pp)) { tk = id[Tk]; return; }
-        id = id + Idsz;
+        hs = (hs + 1) & symmask;
       }
+      symhash[hs] = (int)(id = symend);
+      symend = symend + Idsz;
       id[Name] = (int)pp;
       id[Hash] = tk;
       tk = id[Tk] = Id;
@@ -630,6 +707,31 @@ int *__c4_signal (int sig, int *handler) {
 }
 void __c4_signal_shutdown () { }
 int __c4_sigint () { return 0; }
+// Threaded dispatch engine, see c4m_dispatch.c. Never called under c4.
+int c4m_fast_run (int **_pc, int **_sp, int **_bp, int *_a, int *_countdown, int next_event) { return 0; }
+// Template JIT, see c4m_jit.c. Never called under c4.
+int c4m_jit_init () { return 1; }
+void c4m_jit_shutdown (int verbose) { }
+void c4m_jit_free (void *ptr) { }
+int c4m_jit_run (int **_pc, int **_sp, int **_bp, int *_a, int *_countdown, int next_event) { return 0; }
+// Native extension modules, see c4m_native.c. None are linked under c4.
+int c4m_native_bound;
+int c4m_native_select (char *name) { printf("c4m: native modules require a native build\n"); return 0; }
+int c4m_native_bind (int *request) { return 0; }
+int c4m_native_run (int op, int **_pc, int **_sp, int **_bp, int *_a) { return 0; }
+// Safe mode, see c4m_safe.c. Never enabled under c4.
+int c4m_safe_init () { printf("c4m: safe mode requires a native build\n"); return 1; }
+void c4m_safe_shutdown (int verbose) { }
+void c4m_safe_add (char *p, int len) { }
+void c4m_safe_alloc (char *p) { }
+void c4m_safe_release (char *p) { }
+int c4m_safe_fault (int i, int a, int *sp, int *addr) { return 0; }
+int c4m_safe_run (int **_pc, int **_sp, int **_bp, int *_a, int *_countdown, int next_event) { return 0; }
+// Profiler, see c4m_prof.c. Never enabled under c4.
+int c4m_prof_init (int interval, int *sym, int *code, int *code_end) { printf("c4m: profiling requires a native build\n"); return 1; }
+int c4m_prof_next () { return 0; }
+void c4m_prof_sample (int *pc, int *sp, int *bp) { }
+void c4m_prof_shutdown () { }
 void spin (int cycles) {
 	while (cycles-- > 0)
 		// random instructions that don't modify cycles value
@@ -676,13 +778,17 @@ void *c4_memcpy(void *dst, void *src, int len) {
     // Word copy
     di = (int*)dst; si = (int*)src; i = 0;
     max = len / sizeof(int);
-    while(i++ < max)
+    while(i < max) {
       di[i] = si[i];
+      ++i;
+    }
   } else {
     // Byte copy
     dc = (char*)dst; sc = (char*)src;
-    while(i++ < len)
+    while(i < len) {
       dc[i] = sc[i];
+      ++i;
+    }
   }
   return dst;
 }
@@ -776,6 +882,19 @@ int c4_time () {
 		++buf;
 	}
 }
+// C4 versions of the string intrinsics
+int c4_strlen (char *s) { char *t; t = s; while (*t) ++t; return t - s; }
+int c4_strcmp (char *a, char *b) { while (*a && *a == *b) { ++a; ++b; } return *a - *b; }
+char *c4_strchr (char *s, int c) {
+	while (*s != c) if (!*s++) return 0;
+	return s;
+}
+void *c4_memmove (char *dst, char *src, int len) {
+	if (dst <= src || dst >= src + len) return c4_memcpy(dst, src, len);
+	while (len-- > 0) dst[len] = src[len];
+	return dst;
+}
+char *c4_strcpy (char *dst, char *src) { char *d; d = dst; while ((*d++ = *src++)) ; return dst; }
 // Plain C4 (not compiled natively)
 int c4_plain () { return 1; }
 int c4_info  () {
@@ -788,14 +907,60 @@ int c4_info  () {
 //#define c4_free(p)         free(p)
 //#define c4_realloc(p,ns)   realloc(p, ns)
 #define c4_memcpy(d,s,n)   memcpy(d, s, n)
+#define c4_strlen(s)       strlen(s)
+#define c4_strcmp(a,b)     strcmp(a, b)
+#define c4_strchr(s,c)     strchr(s, c)
+#define c4_memmove(d,s,n)  memmove(d, s, n)
+#define c4_strcpy(d,s)     strcpy(d, s)
 #define c4_time()          c4m_time()
 #define c4_plain()         0 /* Plain C4 or compiled c4m natively? */
 #define c4_info()          (C4I_C4M | C4I_HRT | C4I_SIG)
 #define c4_usleep(usec)    usleep(usec)
 #endif
 
+// Rewrite common instruction sequences between pc and end into
+// superinstructions, returning the number rewritten.
+// Only the first opcode word of a sequence is replaced; the remaining words
+// are left as they were and skipped over by the superinstruction. Code
+// addresses therefore do not move, and a branch into the middle of a
+// sequence still executes the original instructions.
+// The same pass is done by c4r_fuse() in load-c4r.c.
+int c4m_fuse (int *pc, int *end) {
+	int i, n;
+	n = 0;
+	while (pc + 3 < end) {
+		i = *pc;
+		if (i == LEA) {
+			if      (pc[2] == LI)  { *pc = LLI;  ++n; }
+			else if (pc[2] == LC)  { *pc = LLC;  ++n; }
+			else if (pc[2] == PSH) { *pc = PSHL; ++n; }
+		} else if (i == IMM) {
+			if (pc[2] == PSH) { *pc = PSHI; ++n; }
+		} else if (i == PSH && pc[1] == IMM) {
+			if      (pc[3] == ADD) { *pc = ADDI; ++n; }
+			else if (pc[3] == SUB) { *pc = SUBI; ++n; }
+			else if (pc[3] == MUL) { *pc = MULI; ++n; }
+		}
+		// Step over the original instruction and its operand
+		if (i <= ADJ) pc = pc + 2; else pc = pc + 1;
+	}
+	return n;
+}
+
 int  tlev_instruction;
 
+// The run loop counts down to the next event instead of testing for the cycle
+// interrupt and signals on every cycle.
+//   EVENT_IDLE_CYCLES   Countdown used when no cycle interrupt is configured.
+//   SIGNAL_POLL_CYCLES  Once a signal handler is installed, pending signals are
+//                       checked at least this often.
+//   IRQ_SHADOW_CYCLES   Asynchronous traps are held for this many cycles after
+//                       the interrupt interval is configured, so that a trap
+//                       handler re-enabling interrupts can return through TLEV
+//                       before the next one is delivered. One that comes
+//                       due meanwhile is delivered when the window ends.
+enum { EVENT_IDLE_CYCLES = 0x7FFFFFFF, SIGNAL_POLL_CYCLES = 1000, IRQ_SHADOW_CYCLES = 8 };
+
 // Cause a trap to occur and update stack and registers so that the given
 // handler is executed.
 // This is intended to be used by illegal opcode traps, irq handlers, and
@@ -875,6 +1040,12 @@ void trap (int type, int parameter, int *handler, int **_sp, int **_bp, int **_p
 	//trap_bp = bp;
 }
 
+#include "c4m_dispatch.c"
+#include "c4m_safe.c"
+#include "c4m_jit.c"
+#include "c4m_native.c"
+#include "c4m_prof.c"
+
 int c4m_main(int argc, char **argv)
 {
   int fd, bt, ty, poolsz, printsyms;
@@ -883,9 +1054,13 @@ int c4m_main(int argc, char **argv)
   char*_p, *_data;       // initial pointer locations
   int *_sym, *_e, *_sp;  // initial pointer locations
   int  verb;
-  int cycle, run;
+  int cycle, run, fast, fuse, jit, safe;
+  int prof, prof_next; // profiler sample interval, and the cycle of the next sample
+  int countdown, next_event; // cycles until the next event, and its cycle number
+  int signal_poll, trap_pending, trap_type, trap_param;
   int cycle_interrupt_interval, *cycle_interrupt_handler;
-  int *trap_handler, padding;
+  int irq_due, irq_shadow; // cycle interrupt is pending, and no async trap before this cycle
+  int *trap_handler, *fast_opcodes, padding;
   int status, *idmain, *idmax;
 
 
@@ -893,6 +1068,7 @@ int c4m_main(int argc, char **argv)
   debug = 0;
   verb = 0;
   trap_handler = (int *)0;
+  fast_opcodes = (int *)0;
   a = 0;
   time_altmode =0 ;
   // Used to protect traps from just returning instead of using TLEV.
@@ -908,13 +1084,32 @@ int c4m_main(int argc, char **argv)
   if (argc > 0 && **argv == '-' && (*argv)[1] == 'd') { debug = 1; --argc; ++argv; }
   if (argc > 0 && **argv == '-' && (*argv)[1] == 'S') { printsyms = 1; --argc; ++argv; }
   if (argc > 0 && **argv == '-' && (*argv)[1] == 'a') { time_altmode = 1; --argc; ++argv; }
+  fast = !c4_plain();
+  if (argc > 0 && **argv == '-' && (*argv)[1] == 'T') { fast = 0; --argc; ++argv; }
+  fuse = 0;
+  if (argc > 0 && **argv == '-' && (*argv)[1] == 'f') { fuse = 1; --argc; ++argv; }
+  jit = 0;
+  if (argc > 0 && **argv == '-' && (*argv)[1] == 'j') { jit = 1; --argc; ++argv; }
+  safe = 0;
+  if (argc > 0 && **argv == '-' && (*argv)[1] == 'b') { safe = 1; --argc; ++argv; }
+  prof = 0;
+  if (argc > 1 && **argv == '-' && (*argv)[1] == 'r') {
+    _p = argv[1]; while (*_p >= '0' && *_p <= '9') prof = prof * 10 + *_p++ - '0';
+    if (prof < 1) { printf("c4m: -r requires a sample interval in cycles\n"); return -1; }
+    argc = argc - 2; argv = argv + 2;
+  }
+  while (argc > 1 && **argv == '-' && (*argv)[1] == 'x') {
+    if (c4m_native_select(argv[1])) return -1;
+    argc = argc - 2; argv = argv + 2;
+  }
   // TODO: these options broken
   if (argc > 0 && **argv == '-' && (*argv)[1] == 'p') { i = 1; while((*argv)[1 + i++]) poolsz = poolsz / 2; --argc; ++argv; }
   if (argc > 0 && **argv == '-' && (*argv)[1] == 'P') { i = 1; while((*argv)[1 + i++]) poolsz = poolsz * 2; --argc; ++argv; }
-  if (argc < 1) { printf("usage: c4_multiload [-v] [-s] [-d] [-p] [-P] file1 [files...] -- args ...\n"); return -1; }
+  if (argc < 1) { printf("usage: c4_multiload [-v] [-s] [-d] [-S] [-a] [-T] [-f] [-j] [-b] [-r cycles] [-x module] [-p] [-P] file1 [files...] -- args ...\n"); return -1; }
 
   if (verb) printf("c4m: init...\n");
   if (!(sym = _sym = malloc(poolsz))) { printf("could not malloc(%d) symbol area\n", poolsz); return -1; }
+  if (!(symhash = malloc(poolsz))) { printf("could not malloc(%d) symbol index\n", poolsz); return -1; }
   idmax = sym + (poolsz / sizeof(int)); // end of symbol table
   idmax = idmax - Idsz;                 // minus one element
   if (!(le = e = _e = malloc(poolsz))) { printf("could not malloc(%d) text area\n", poolsz); return -1; }
@@ -924,6 +1119,9 @@ int c4m_main(int argc, char **argv)
   if ((i = __c4_signal_init())) { printf("c4m: signal init failed with reason %d\n", i); return -1; }
 
   memset(sym,  0, poolsz);
+  memset(symhash, 0, poolsz);
+  symmask = poolsz / sizeof(int) - 1; // more slots than sym has entries
+  symend = sym;
   memset(e,    0, poolsz);
   memset(data, 0, poolsz);
 
@@ -933,6 +1131,13 @@ int c4m_main(int argc, char **argv)
 
   c4m_setup_opcodes();
   c4m_setup_builtins();
+  if (safe && c4m_safe_init()) safe = 0;
+  if (safe) {
+    c4m_safe_add((char *)_e, poolsz);
+    c4m_safe_add(_data, poolsz);
+    c4m_safe_add((char *)_sp, poolsz);
+    c4m_safe_add(c4m_opcodes, OP__Sz * 5);
+  }
 
   p = c4m_builtins;
   i = Static; while (i <= While) { next(); id[Tk] = i++; } // add keywords to symbol table
@@ -1095,6 +1300,12 @@ int c4m_main(int argc, char **argv)
   }
   if (src) return 0;
   if (!(pc = (int *)idmain[Val])) { printf("main() not defined\n"); return -1; }
+  if (fuse) {
+    i = c4m_fuse(_e + 1, e + 1);
+    if (verb) printf("c4m: fused %d instruction sequences\n", i);
+  }
+  // Before the source goes, the profiler copies the function names out of it
+  if (prof && c4m_prof_init(prof, sym, _e, e + 1)) prof = 0;
 
   if (verb) printf("c4m: prepare...\n");
   // setup stack
@@ -1104,6 +1315,10 @@ int c4m_main(int argc, char **argv)
   *--sp = PSH; t = sp; // printf("//sp(0x%X) = PSH (0x%X)\n", sp, *sp);
   *--sp = argc; // printf("//sp(0x%X) = argc (0x%X)\n", sp, *sp);
   *--sp = (int)argv; // printf("//sp(0x%X) = argv (0x%X)\n", sp, *sp);
+  if (safe) {
+    c4m_safe_add((char *)argv, (argc + 1) * sizeof(char *));
+    i = 0; while (i < argc) { c4m_safe_add(argv[i], c4_strlen(argv[i]) + 1); ++i; }
+  }
   *--sp = (int)t; // printf("//sp(0x%X) = t (0x%X)\n", sp, t);
   // setup trap stack
   // trap_bp = trap_sp = (int *)((int)trap_sp + poolsz);
@@ -1123,27 +1338,76 @@ int c4m_main(int argc, char **argv)
 
   cycle_interrupt_interval = 0;
   cycle_interrupt_handler = 0;
+  irq_due = irq_shadow = 0;
+  // The current cycle is always next_event - countdown. C4CF, SIGH and _TRP
+  // force an event on the next cycle by setting countdown to 1.
+  countdown = next_event = EVENT_IDLE_CYCLES;
+  prof_next = 0;
+  if (prof) countdown = next_event = prof_next = c4m_prof_next();
+  signal_poll = trap_pending = 0;
+  // Debug output is only produced by the chain below
+  if (debug) fast = 0;
+  // Safe mode runs the checked threaded engine
+  if (safe) jit = 0;
+  // The JIT falls back on the threaded engine near events
+  if (!fast) jit = 0;
+  if (jit && c4m_jit_init()) jit = 0;
 
   while (run) {
-	++cycle;
-
-	// Allow a cycle interrupt. Since cycle is incremented above, this will
-	// not interrupt the first cycle.
-	if (cycle_interrupt_interval && !(cycle % cycle_interrupt_interval)) {
-		//printf("!trap_hard_irq %d using handler 0x%X\n", cycle_interrupt_interval, cycle_interrupt_handler);
-		trap(TRAP_HARD_IRQ, HIRQ_CYCLE, cycle_interrupt_handler, &sp, &bp, &pc, a);
-	// Check for pending signals from the signal handler
-	} else if (pending_signal) {
-		// printf("c4m: trapping pending signal %d\n", pending_signal);
-		trap(TRAP_SIGNAL, pending_signal, (int *)signal_handlers[pending_signal], &sp, &bp, &pc, a);
-		pending_signal = 0;
+	// When compiled natively, run as far as possible in the threaded engine.
+	// It returns when the next instruction must be executed by the chain.
+	if (jit) c4m_jit_run(&pc, &sp, &bp, &a, &countdown, next_event);
+	else if (fast) {
+		if (safe) c4m_safe_run(&pc, &sp, &bp, &a, &countdown, next_event);
+		else c4m_fast_run(&pc, &sp, &bp, &a, &countdown, next_event);
+	}
+
+	if (--countdown <= 0) {
+		cycle = next_event;
+		// Profile the instruction about to run, before any trap replaces it
+		if (prof && cycle >= prof_next) {
+			c4m_prof_sample(pc, sp, bp);
+			prof_next = cycle + c4m_prof_next();
+		}
+		// A trap requested by __c4_trap on the previous cycle
+		if (trap_pending) {
+			trap(trap_type, trap_param, trap_handler, &sp, &bp, &pc, a);
+			trap_pending = 0;
+		}
+		// Allow a cycle interrupt. The first event is never on cycle 0, so this
+		// will not interrupt the first cycle.
+		if (cycle_interrupt_interval && !(cycle % cycle_interrupt_interval))
+			irq_due = 1;
+		if (cycle < irq_shadow) {
+			// Within the interrupt shadow, deliver nothing yet
+		} else if (irq_due && cycle_interrupt_interval) {
+			//printf("!trap_hard_irq %d using handler 0x%X\n", cycle_interrupt_interval, cycle_interrupt_handler);
+			irq_due = 0;
+			trap(TRAP_HARD_IRQ, HIRQ_CYCLE, cycle_interrupt_handler, &sp, &bp, &pc, a);
+		// Check for pending signals from the signal handler
+		} else if (pending_signal) {
+			// printf("c4m: trapping pending signal %d\n", pending_signal);
+			trap(TRAP_SIGNAL, pending_signal, (int *)signal_handlers[pending_signal], &sp, &bp, &pc, a);
+			pending_signal = 0;
+		}
+		// Schedule the next event
+		countdown = EVENT_IDLE_CYCLES;
+		if (cycle_interrupt_interval > 0)
+			countdown = cycle_interrupt_interval - cycle % cycle_interrupt_interval;
+		if (signal_poll && countdown > SIGNAL_POLL_CYCLES)
+			countdown = SIGNAL_POLL_CYCLES;
+		if ((irq_due || pending_signal) && cycle < irq_shadow)
+			countdown = irq_shadow - cycle;
+		if (prof && countdown > prof_next - cycle)
+			countdown = prof_next - cycle;
+		next_event = cycle + countdown;
 	}
 
     i = *pc++;
     // This opcode is handled here so debug output can show the opcode
     if (i == OPCD) {
         i = *sp;
-        if (i <= ADJ) {
+        if (i <= ADJ || (i >= LLI && i <= MULI)) {
             printf("%.4s does not support opcodes requiring arguments (%.4s given)\n",
                    &c4m_opcodes[OPCD * 5], &c4m_opcodes[i * 5]);
 			// Raise an OPV trap
@@ -1156,9 +1420,9 @@ int c4m_main(int argc, char **argv)
     if (debug) {
       // The output here is split into multiple calls because C4's printf only pushes
       // up to 6 arguments.
-      printf("0x%-*X %-*d ", padding, pc - 1, padding, cycle);
+      printf("0x%-*X %-*d ", padding, pc - 1, padding, next_event - countdown);
       printf("A=0x%-*X> ", padding, a);
-      if (i >= 0 && i <= EXIT) {
+      if (i >= 0 && i < OP__Sz) {
           printf("%.4s", &c4m_opcodes[i * 5]);
       } else {
           printf("unknown %-*d (0x%X)", padding, i, i);
@@ -1166,7 +1430,20 @@ int c4m_main(int argc, char **argv)
       if (i <= ADJ) printf(" %d\n", *pc); else printf("\n");
     }
 
-    if      (i == LEA) a = (int)(bp + *pc++);                             // load local address
+    // Safe mode: the instruction is skipped if it would access memory outside
+    // every known region, see c4m_safe.c
+    if (safe && c4m_safe_fault(i, a, sp, &r)) {
+        if (trap_handler == 0) {
+            printf("c4m: segfault at 0x%lX accessing 0x%lX, cycle = %d\n", pc - 1, r, next_event - countdown);
+            print_stacktrace(pc, idmain, idmax, bp, sp);
+            status = -1; run = 0;
+        } else {
+            // Disable cycle interrupt, as for TRAP_ILLOP
+            cycle_interrupt_interval = 0;
+            trap(TRAP_SEGV, r, trap_handler, &sp, &bp, &pc, a);
+        }
+    }
+    else if (i == LEA) a = (int)(bp + *pc++);                             // load local address
     else if (i == IMM) a = *pc++;                                         // load global address or immediate
     else if (i == JMP) pc = (int *)*pc;                                   // jump
     else if (i == JMPA) pc = (int *)a;                                    // jump using accumulator
@@ -1184,24 +1461,22 @@ int c4m_main(int argc, char **argv)
 		bp = (int *)*sp++; // printf("//LEV: bp = 0x%X loaded from 0x%X\n", bp, sp - 1);
 		pc = (int *)*sp++; // printf("//LEV: pc = 0x%X loaded from 0x%X\n", sp, sp - 1);
 	}
-    //else if (i == LI)  a = *(int *)a;                                     // load int
-    else if (i == LI)  {
-//#ifdef SEGFAULT_TRACING
-//		// Enable segfault tracing for certain problematic values to find out where
-//      // the issue is occurring.
-//		if (a >= 0 && a <= 0xFFFF || a == 0xffffffffffffffff) {
-//			print_stacktrace(pc, idmain, idmax, bp, sp);
-//			cycle_interrupt_interval = 0;
-//			trap(TRAP_SEGV, a, trap_handler, &sp, &bp, &pc, a);
-//		} else
-//#endif
-			a = *(int *)a;                                     // load int
-	}
+    else if (i == LI)  a = *(int *)a;                                     // load int
     else if (i == LC)  a = *(char *)a;                                    // load char
     else if (i == SI)  *(int *)*sp++ = a;                                 // store int
     else if (i == SC)  a = *(char *)*sp++ = a;                            // store char
     else if (i == PSH) *--sp = a;                                         // push
 
+    // Superinstructions. The words of the original sequence follow the opcode
+    // and are skipped over, see c4m_fuse().
+    else if (i == LLI)  { a = *(int *)(bp + *pc); pc = pc + 2; }          // LEA n; LI
+    else if (i == LLC)  { a = *(char *)(bp + *pc); pc = pc + 2; }         // LEA n; LC
+    else if (i == PSHL) { *--sp = a = (int)(bp + *pc); pc = pc + 2; }     // LEA n; PSH
+    else if (i == PSHI) { *--sp = a = *pc; pc = pc + 2; }                 // IMM x; PSH
+    else if (i == ADDI) { a = a + pc[1]; pc = pc + 3; }                   // PSH; IMM k; ADD
+    else if (i == SUBI) { a = a - pc[1]; pc = pc + 3; }                   // PSH; IMM k; SUB
+    else if (i == MULI) { a = a * pc[1]; pc = pc + 3; }                   // PSH; IMM k; MUL
+
     else if (i == OR)  a = *sp++ |  a;
     else if (i == XOR) a = *sp++ ^  a;
     else if (i == AND) a = *sp++ &  a;
@@ -1235,9 +1510,13 @@ int c4m_main(int argc, char **argv)
         else if (r == 7) a = printf((char*)t[-1], t[-2], t[-3], t[-4], t[-5], t[-6], t[-7]);
         else { printf("Too many arguments to printf!\n"); exit(-1); }
     }
-    else if (i == MALC) a = (int)malloc(*sp);
+    else if (i == MALC) { a = (int)malloc(*sp); if (safe && a) c4m_safe_alloc((char *)a); }
     //else if (i == RALC) a = (int)c4_realloc((int*)sp[1], *sp);
-    else if (i == FREE) free((void *)*sp);
+    else if (i == FREE) {
+        if (jit) c4m_jit_free((void *)*sp);
+        if (safe && *sp) c4m_safe_release((char *)*sp);
+        free((void *)*sp);
+    }
     else if (i == MSET) a = (int)memset((char *)sp[2], sp[1], *sp);
     else if (i == MCMP) a = memcmp((char *)sp[2], (char *)sp[1], *sp);
     else if (i == MCPY) a = (int)c4_memcpy((void*)sp[2], (void*)sp[1], *sp);
@@ -1248,6 +1527,8 @@ int c4m_main(int argc, char **argv)
     } else if (i == _OPC) { // return an opcode
       a = __opcode((char *)*sp);
       //printf("_OPCD: got %d (0x%X) from request %s\n", a, a, (char *)*sp);
+    } else if (i == _BLT) { // return a builtin's opcode
+      a = __builtin((char *)*sp);
     } else if (i == OPSL) { // return all opcodes
       a = (int)c4m_opcodes; // TODO: copy?
     } else if (i == TLEV) { // trap leave
@@ -1273,7 +1554,7 @@ int c4m_main(int argc, char **argv)
         a  = (int  )*t++;    // printf("From 0x%X, loaded saved a %d\n", t - 1, a);
         //printf("Resume from pc 0x%X\n", pc);
 	}
-	else if (i == C4CY) a = cycle;
+	else if (i == C4CY) a = next_event - countdown;
 	else if (i == SIGI) a = __c4_sigint();
     else if (i == TIME) a = c4_time();
 	else if (i == USLP) a = c4_usleep(*sp);
@@ -1292,6 +1573,8 @@ int c4m_main(int argc, char **argv)
 		if (sp[1] == CONF_CYCLE_INTERRUPT_INTERVAL) {
 			a = cycle_interrupt_interval;
 			cycle_interrupt_interval = sp[0];
+			irq_due = 0;
+			if (cycle_interrupt_interval) irq_shadow = next_event - countdown + IRQ_SHADOW_CYCLES;
 #if 0
 			// C4/C4CC only
 			// printf("(c4m: cycle interval set to %d\n", sp[0]);
@@ -1300,20 +1583,47 @@ int c4m_main(int argc, char **argv)
 			a = (int)cycle_interrupt_handler;
 			cycle_interrupt_handler = (int *)sp[0];
 			// printf("(c4m: cycle handler set to 0x%lx\n", sp[0]);
+		} else if(sp[1] == CONF_FAST_OPCODES) {
+			a = (int)fast_opcodes;
+			fast_opcodes = (int *)sp[0];
+		} else if(sp[1] == CONF_NATIVE_OPCODE) {
+			a = c4m_native_bind((int *)sp[0]);
 		} else {
 			printf("c4m: C4CF issue\n");
 			return -100;
 		}
+		// Reschedule from the next cycle
+		next_event = next_event - countdown + 1; countdown = 1;
+	}
+	else if (i == SIGH) {
+		a = (int)__c4_signal(sp[1], (int *)sp[0]);
+		// Start polling for signals from the next cycle
+		signal_poll = 1;
+		next_event = next_event - countdown + 1; countdown = 1;
 	}
-	else if (i == SIGH) a = (int)__c4_signal(sp[1], (int *)sp[0]);
 	else if (i == INFO) a = c4_info();
+    // String intrinsics. Only reached through OPCD, so sp[0] is the opcode
+    // and the arguments follow it.
+    else if (i == SLEN) a = c4_strlen((char *)sp[1]);
+    else if (i == SCMP) a = c4_strcmp((char *)sp[1], (char *)sp[2]);
+    else if (i == SCHR) a = (int)c4_strchr((char *)sp[1], sp[2]);
+    else if (i == MMOV) a = (int)c4_memmove((void *)sp[1], (void *)sp[2], sp[3]);
+    else if (i == SCPY) a = (int)c4_strcpy((char *)sp[1], (char *)sp[2]);
     else if (i == _TRP) {
       // __c4_trap(type, signal)
-      // Trigger a trap
-      trap(sp[1], sp[0], trap_handler, &sp, &bp, &pc, a);
+      // Trigger a trap, taken at the start of the next cycle
+      trap_type = sp[1]; trap_param = sp[0]; trap_pending = 1;
+      next_event = next_event - countdown + 1; countdown = 1;
+    } else if (c4m_native_bound && c4m_native_run(i, &pc, &sp, &bp, &a)) {
+		// Native handler: registers updated in place, see c4m_native.c
+    } else if (fast_opcodes && i > 0 && i < FAST_OPCODES_MAX && fast_opcodes[i]) {
+		// Fast opcode: call the handler like JSR, returning after the OPCD.
+		// The caller's ADJ then removes the opcode and its arguments.
+		*--sp = (int)pc;
+		pc = (int *)fast_opcodes[i];
     } else {
         if (trap_handler == 0) {
-            printf("unknown instruction = %d! cycle = %d\n", i, cycle); status = -1; run = 0;
+            printf("unknown instruction = %d! cycle = %d\n", i, next_event - countdown); status = -1; run = 0;
         } else {
 			// printf("c4m: illegal opcode %d, invoking trap handler 0x%X\n", i, trap_handler);
 			// Disable cycle interrupt
@@ -1323,9 +1633,12 @@ int c4m_main(int argc, char **argv)
     }
   }
 
+  // The profile refers to the code, so is printed first
+  if (prof) c4m_prof_shutdown();
   // free memory
   //free(_p);
   free(_sym);
+  free(symhash);
   free(_e);
   free(_data);
   free(_sp);
@@ -1333,6 +1646,8 @@ int c4m_main(int argc, char **argv)
 #if C4_ONLY
   free(c4_time_buf);
 #endif
+  if (jit) c4m_jit_shutdown(verb);
+  if (safe) c4m_safe_shutdown(verb);
   __c4_signal_shutdown();
 
   return status;
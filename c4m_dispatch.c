@@ -0,0 +1,127 @@
+// c4m_dispatch.c - Threaded dispatch engine for natively compiled c4m.
+//
+// Included by c4m.c after the opcode enum and trap(). c4 and c4cc ignore
+// preprocessor lines, so they never see this file; c4m.c provides a stub
+// for them in its C4_ONLY block.
+//
+// c4m_fast_run executes instructions by jumping through a table of label
+// addresses (gcc computed goto) instead of walking the if/else chain in
+// c4m_main. It handles the opcodes that only touch the VM registers and
+// memory. Anything else (builtins, traps, custom opcodes, EXIT) makes it
+// return with pc pointing at that instruction, so that the chain in c4m_main
+// executes exactly one instruction before calling back in.
+//
+// Code is loaded at runtime (by load-c4r.c into ordinary memory, and patched
+// in place), so rather than translating a code segment ahead of time the
+// opcode word itself indexes the label table.
+//
+// Cycle accounting matches the chain: every instruction decrements the
+// countdown to the next event, and the engine returns before executing the
+// instruction on which the countdown expires, so that the chain handles the
+// event (cycle interrupt, trap, signal poll) on exactly the same cycle.
+//
+// c4m_safe.c includes this file a second time to build c4m_safe_run, defining
+// DISPATCH_RUN as the function name and DISPATCH_CHECK(x) to leave any load or
+// store through address x to the chain when x is not accessible.
+
+#ifndef DISPATCH_RUN
+#define DISPATCH_RUN      c4m_fast_run
+#define DISPATCH_CHECK(x)
+#endif
+
+int DISPATCH_RUN (int **_pc, int **_sp, int **_bp, int *_a, int *_countdown, int next_event) {
+	static void *ops[OP__Sz] = {
+		[0 ... OP__Sz - 1] = &&op_slow,
+		[LEA]  = &&op_lea,  [IMM]  = &&op_imm,  [JMP]  = &&op_jmp,  [JSR]  = &&op_jsr,
+		[JSRI] = &&op_jsri, [JSRS] = &&op_jsrs, [BZ]   = &&op_bz,   [BNZ]  = &&op_bnz,
+		[ENT]  = &&op_ent,  [ADJ]  = &&op_adj,  [LEV]  = &&op_lev,  [LI]   = &&op_li,
+		[LC]   = &&op_lc,   [SI]   = &&op_si,   [SC]   = &&op_sc,   [PSH]  = &&op_psh,
+		[JMPA] = &&op_jmpa, [TLEV] = &&op_tlev, [_JMP] = &&op__jmp, [_ADJ] = &&op__adj,
+		[OR]   = &&op_or,   [XOR]  = &&op_xor,  [AND]  = &&op_and,  [EQ]   = &&op_eq,
+		[NE]   = &&op_ne,   [LT]   = &&op_lt,   [GT]   = &&op_gt,   [LE]   = &&op_le,
+		[GE]   = &&op_ge,   [SHL]  = &&op_shl,  [SHR]  = &&op_shr,  [ADD]  = &&op_add,
+		[SUB]  = &&op_sub,  [MUL]  = &&op_mul,  [DIV]  = &&op_div,  [MOD]  = &&op_mod,
+		[C4CY] = &&op_c4cy,
+		[LLI]  = &&op_lli,  [LLC]  = &&op_llc,  [PSHL] = &&op_pshl, [PSHI] = &&op_pshi,
+		[ADDI] = &&op_addi, [SUBI] = &&op_subi, [MULI] = &&op_muli,
+	};
+	int *pc, *sp, *bp, a, countdown, i, *t;
+
+	pc = *_pc; sp = *_sp; bp = *_bp; a = *_a; countdown = *_countdown;
+
+#define NEXT() do { \
+		if (--countdown <= 0) goto op_leave; \
+		i = *pc++; \
+		if ((unsigned long)i >= OP__Sz) goto op_slow; \
+		goto *ops[i]; \
+	} while (0)
+
+	NEXT();
+
+op_lea:  a = (int)(bp + *pc++); NEXT();
+op_imm:  a = *pc++; NEXT();
+op_jmp:  pc = (int *)*pc; NEXT();
+op_jmpa: pc = (int *)a; NEXT();
+op__jmp: pc = (int *)*sp++; NEXT();
+op_jsr:  *--sp = (int)(pc + 1); pc = (int *)*pc; NEXT();
+op_jsri: *--sp = (int)(pc + 1); pc = (int *)*pc; pc = (int *)*pc; NEXT();
+op_jsrs: *--sp = (int)(pc + 1); pc = (int *)*(bp + *pc); NEXT();
+op_bz:   pc = a ? pc + 1 : (int *)*pc; NEXT();
+op_bnz:  pc = a ? (int *)*pc : pc + 1; NEXT();
+op_ent:  *--sp = (int)bp; bp = sp; sp = sp - *pc++; NEXT();
+op_adj:  sp = sp + *pc++; NEXT();
+op__adj: sp = sp + *sp; NEXT();
+op_lev:  sp = bp; bp = (int *)*sp++; pc = (int *)*sp++; NEXT();
+op_li:   DISPATCH_CHECK(a); a = *(int *)a; NEXT();
+op_lc:   DISPATCH_CHECK(a); a = *(char *)a; NEXT();
+op_si:   DISPATCH_CHECK(*sp); *(int *)*sp++ = a; NEXT();
+op_sc:   DISPATCH_CHECK(*sp); a = *(char *)*sp++ = a; NEXT();
+op_psh:  *--sp = a; NEXT();
+op_tlev:
+	// See TLEV in c4m_main
+	t  = bp + 2;
+	pc = (int *)*t++;
+	sp = (int *)*t++;
+	bp = (int *)*t++;
+	a  = (int  )*t++;
+	NEXT();
+
+op_or:   a = *sp++ |  a; NEXT();
+op_xor:  a = *sp++ ^  a; NEXT();
+op_and:  a = *sp++ &  a; NEXT();
+op_eq:   a = *sp++ == a; NEXT();
+op_ne:   a = *sp++ != a; NEXT();
+op_lt:   a = *sp++ <  a; NEXT();
+op_gt:   a = *sp++ >  a; NEXT();
+op_le:   a = *sp++ <= a; NEXT();
+op_ge:   a = *sp++ >= a; NEXT();
+op_shl:  a = *sp++ << a; NEXT();
+op_shr:  a = *sp++ >> a; NEXT();
+op_add:  a = *sp++ +  a; NEXT();
+op_sub:  a = *sp++ -  a; NEXT();
+op_mul:  a = *sp++ *  a; NEXT();
+op_div:  a = *sp++ /  a; NEXT();
+op_mod:  a = *sp++ %  a; NEXT();
+op_c4cy: a = next_event - countdown; NEXT();
+
+// Superinstructions, see c4m_fuse()
+op_lli:  a = *(int *)(bp + *pc); pc = pc + 2; NEXT();
+op_llc:  a = *(char *)(bp + *pc); pc = pc + 2; NEXT();
+op_pshl: *--sp = a = (int)(bp + *pc); pc = pc + 2; NEXT();
+op_pshi: *--sp = a = *pc; pc = pc + 2; NEXT();
+op_addi: a = a + pc[1]; pc = pc + 3; NEXT();
+op_subi: a = a - pc[1]; pc = pc + 3; NEXT();
+op_muli: a = a * pc[1]; pc = pc + 3; NEXT();
+
+#undef NEXT
+
+op_slow:
+	// Leave the instruction for the chain to execute
+	--pc;
+op_leave:
+	++countdown;
+	*_pc = pc; *_sp = sp; *_bp = bp; *_a = a; *_countdown = countdown;
+	return 0;
+}
+#undef DISPATCH_RUN
+#undef DISPATCH_CHECK
@@ -0,0 +1,325 @@
+// c4m_jit.c - Baseline template JIT for natively compiled c4m on x86-64.
+//
+// Included by c4m.c after c4m_dispatch.c. Like that file it is never seen by
+// c4 or c4cc, and c4m.c provides stubs for them in its C4_ONLY block.
+//
+// Enabled with -j. Code is translated one basic block at a time, the first
+// time execution reaches a given pc. Each opcode has a fixed machine code
+// template, with the VM registers held in machine registers while a block
+// runs:
+//   rbx = a, r12 = sp, r13 = bp, r14 = pointer to saved a/sp/bp
+// A block ends after a branch, call or return, or just before an instruction
+// it has no template for, and returns the next VM pc in rax.
+//
+// Blocks never trap. Builtins, TLEV, C4CY, custom opcodes (TRAP_ILLOP) and
+// anything else without a template are left to the chain in c4m_main, so
+// every trap is raised by the interpreter with the usual register state.
+// A block of n instructions is only run when the event countdown has more
+// than n cycles remaining; otherwise the threaded engine runs up to the
+// event, so cycle interrupts and C4CY are exact.
+//
+// Compiled blocks are keyed by VM pc. When memory holding compiled code is
+// freed (a C4R module or task being unloaded), every block is discarded.
+// Code must not otherwise be modified once it has run.
+
+#if defined(__x86_64__)
+#include <sys/mman.h>
+#include <malloc.h>
+
+enum {
+	JIT_CODE_SIZE    = 16 * 1024 * 1024, // executable buffer, in bytes
+	JIT_TABLE_SIZE   = 1 << 16,          // pc -> block entries, power of 2
+	JIT_PAGES_SIZE   = 1 << 14,          // pages holding compiled code, power of 2
+	JIT_PAGE_SHIFT   = 12,
+	JIT_BLOCK_MAX    = 256,              // instructions per block
+	JIT_OP_MAX_BYTES = 96                // largest template plus epilogue
+};
+
+static int   jit_enabled;
+static char *jit_code, *jit_code_pos;
+static int **jit_table_pc;   // VM pc of each block
+static char **jit_table_fn;  // machine code, or 0 if pc cannot be compiled
+static int  *jit_table_len;  // instructions in block
+static int   jit_table_count;
+static int  *jit_pages;      // set of page numbers containing compiled VM code
+static int   jit_pages_count;
+static int   jit_flushes, jit_blocks;
+
+static void jit_flush () {
+	memset(jit_table_pc, 0, sizeof(int *) * JIT_TABLE_SIZE);
+	memset(jit_pages, 0, sizeof(int) * JIT_PAGES_SIZE);
+	jit_table_count = jit_pages_count = 0;
+	jit_code_pos = jit_code;
+	++jit_flushes;
+}
+
+int c4m_jit_init () {
+	jit_code = mmap(0, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+	                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (jit_code == MAP_FAILED) {
+		printf("c4m: jit unable to map %d bytes of executable memory\n", JIT_CODE_SIZE);
+		return 1;
+	}
+	jit_table_pc  = malloc(sizeof(int *) * JIT_TABLE_SIZE);
+	jit_table_fn  = malloc(sizeof(char *) * JIT_TABLE_SIZE);
+	jit_table_len = malloc(sizeof(int) * JIT_TABLE_SIZE);
+	jit_pages     = malloc(sizeof(int) * JIT_PAGES_SIZE);
+	if (!jit_table_pc || !jit_table_fn || !jit_table_len || !jit_pages) {
+		printf("c4m: jit unable to allocate tables\n");
+		return 1;
+	}
+	jit_flush();
+	jit_flushes = 0;
+	jit_enabled = 1;
+	return 0;
+}
+
+void c4m_jit_shutdown (int verbose) {
+	if (!jit_enabled) return;
+	if (verbose) printf("c4m: jit compiled %d blocks, %d flushes\n", jit_blocks, jit_flushes);
+	munmap(jit_code, JIT_CODE_SIZE);
+	free(jit_table_pc); free(jit_table_fn); free(jit_table_len); free(jit_pages);
+	jit_enabled = 0;
+}
+
+static int jit_hash (int v) {
+	v = v ^ (v >> 17);
+	return (v * 0x9E3779B1) & 0x7FFFFFFF;
+}
+
+static int jit_page_has (int page) {
+	int h;
+	h = jit_hash(page) & (JIT_PAGES_SIZE - 1);
+	while (jit_pages[h]) {
+		if (jit_pages[h] == page) return 1;
+		h = (h + 1) & (JIT_PAGES_SIZE - 1);
+	}
+	return 0;
+}
+
+static void jit_page_add (int page) {
+	int h;
+	h = jit_hash(page) & (JIT_PAGES_SIZE - 1);
+	while (jit_pages[h]) {
+		if (jit_pages[h] == page) return;
+		h = (h + 1) & (JIT_PAGES_SIZE - 1);
+	}
+	jit_pages[h] = page;
+	++jit_pages_count;
+}
+
+// Called before the FREE builtin releases memory
+void c4m_jit_free (void *ptr) {
+	int page, last;
+	if (!jit_enabled || !ptr || !jit_pages_count) return;
+	page = (int)ptr >> JIT_PAGE_SHIFT;
+	last = ((int)ptr + malloc_usable_size(ptr) - 1) >> JIT_PAGE_SHIFT;
+	while (page <= last) {
+		if (jit_page_has(page)) {
+			jit_flush();
+			return;
+		}
+		++page;
+	}
+}
+
+//
+// Machine code emission
+//
+static void jit_b (int b) { *jit_code_pos++ = (char)b; }
+static void jit_d (int d) { *(int32_t *)jit_code_pos = (int32_t)d; jit_code_pos = jit_code_pos + 4; }
+static void jit_q (int q) { *(int64_t *)jit_code_pos = (int64_t)q; jit_code_pos = jit_code_pos + 8; }
+static void jit_bytes (char *s, int n) { while (n--) jit_b(*s++); }
+#define JIT(s) jit_bytes(s, sizeof(s) - 1)
+
+static int jit_fits32 (int v) { return v == (int)(int32_t)v; }
+
+static void jit_mov_rax (int v) { JIT("\x48\xB8"); jit_q(v); }       // mov rax, imm64
+static void jit_mov_rcx (int v) { JIT("\x48\xB9"); jit_q(v); }       // mov rcx, imm64
+static void jit_mov_rbx (int v) { JIT("\x48\xBB"); jit_q(v); }       // mov rbx, imm64
+static void jit_pop_rax ()  { JIT("\x49\x8B\x04\x24\x49\x83\xC4\x08"); } // mov rax, [r12]; add r12, 8
+static void jit_drop ()     { JIT("\x49\x83\xC4\x08"); }                 // add r12, 8
+static void jit_push_rbx () { JIT("\x49\x83\xEC\x08\x49\x89\x1C\x24"); } // sub r12, 8; mov [r12], rbx
+static void jit_push_rax () { JIT("\x49\x83\xEC\x08\x49\x89\x04\x24"); } // sub r12, 8; mov [r12], rax
+
+static void jit_prologue () {
+	JIT("\x53\x41\x54\x41\x55\x41\x56"); // push rbx, r12, r13, r14
+	JIT("\x49\x89\xFE");                 // mov r14, rdi
+	JIT("\x49\x8B\x1E");                 // mov rbx, [r14]
+	JIT("\x4D\x8B\x66\x08");             // mov r12, [r14 + 8]
+	JIT("\x4D\x8B\x6E\x10");             // mov r13, [r14 + 16]
+}
+// Next VM pc must be in rax
+static void jit_epilogue () {
+	JIT("\x49\x89\x1E");                 // mov [r14], rbx
+	JIT("\x4D\x89\x66\x08");             // mov [r14 + 8], r12
+	JIT("\x4D\x89\x6E\x10");             // mov [r14 + 16], r13
+	JIT("\x41\x5E\x41\x5D\x41\x5C\x5B"); // pop r14, r13, r12, rbx
+	JIT("\xC3");                         // ret
+}
+// a = *sp++ <cmp> a
+static void jit_compare (int setcc) {
+	jit_pop_rax();
+	JIT("\x48\x39\xD8");                 // cmp rax, rbx
+	jit_b(0x0F); jit_b(setcc); jit_b(0xC0); // setcc al
+	JIT("\x0F\xB6\xD8");                 // movzx ebx, al
+}
+
+// Translate the block starting at pc. Returns 0 if the first instruction has
+// no template. *length is set to the number of instructions in the block.
+static char *jit_compile (int *pc, int *length) {
+	char *fn;
+	int  *start, i, n, v, done;
+
+	if (jit_code_pos + JIT_OP_MAX_BYTES * JIT_BLOCK_MAX > jit_code + JIT_CODE_SIZE ||
+	    jit_table_count >= JIT_TABLE_SIZE / 2)
+		jit_flush();
+
+	fn = jit_code_pos;
+	start = pc;
+	n = done = 0;
+	jit_prologue();
+	while (!done && n < JIT_BLOCK_MAX) {
+		i = *pc;
+		v = pc[1];
+		// Operands that become 32 bit displacements must fit
+		if ((i == LEA || i == LLI || i == LLC || i == PSHL || i == JSRS) && !jit_fits32(v * sizeof(int))) break;
+		if ((i == ENT || i == ADJ) && !jit_fits32(v * sizeof(int))) break;
+
+		if      (i == LEA)  { JIT("\x49\x8D\x9D"); jit_d(v * sizeof(int)); pc = pc + 2; } // lea rbx, [r13 + v]
+		else if (i == IMM)  { jit_mov_rbx(v); pc = pc + 2; }
+		else if (i == LI)   { JIT("\x48\x8B\x1B"); ++pc; }                     // mov rbx, [rbx]
+		else if (i == LC)   { JIT("\x48\x0F\xBE\x1B"); ++pc; }                 // movsx rbx, byte [rbx]
+		else if (i == SI)   { jit_pop_rax(); JIT("\x48\x89\x18"); ++pc; }      // mov [rax], rbx
+		else if (i == SC)   { jit_pop_rax(); JIT("\x88\x18\x48\x0F\xBE\xDB"); ++pc; } // mov [rax], bl; movsx rbx, bl
+		else if (i == PSH)  { jit_push_rbx(); ++pc; }
+		else if (i == OR)   { JIT("\x49\x0B\x1C\x24"); jit_drop(); ++pc; }     // or rbx, [r12]
+		else if (i == XOR)  { JIT("\x49\x33\x1C\x24"); jit_drop(); ++pc; }     // xor rbx, [r12]
+		else if (i == AND)  { JIT("\x49\x23\x1C\x24"); jit_drop(); ++pc; }     // and rbx, [r12]
+		else if (i == ADD)  { JIT("\x49\x03\x1C\x24"); jit_drop(); ++pc; }     // add rbx, [r12]
+		else if (i == MUL)  { JIT("\x49\x0F\xAF\x1C\x24"); jit_drop(); ++pc; } // imul rbx, [r12]
+		else if (i == SUB)  { jit_pop_rax(); JIT("\x48\x29\xD8\x48\x89\xC3"); ++pc; } // sub rax, rbx; mov rbx, rax
+		else if (i == DIV)  { jit_pop_rax(); JIT("\x48\x99\x48\xF7\xFB\x48\x89\xC3"); ++pc; } // cqo; idiv rbx; mov rbx, rax
+		else if (i == MOD)  { jit_pop_rax(); JIT("\x48\x99\x48\xF7\xFB\x48\x89\xD3"); ++pc; } // cqo; idiv rbx; mov rbx, rdx
+		else if (i == EQ)   { jit_compare(0x94); ++pc; }
+		else if (i == NE)   { jit_compare(0x95); ++pc; }
+		else if (i == LT)   { jit_compare(0x9C); ++pc; }
+		else if (i == GT)   { jit_compare(0x9F); ++pc; }
+		else if (i == LE)   { jit_compare(0x9E); ++pc; }
+		else if (i == GE)   { jit_compare(0x9D); ++pc; }
+		else if (i == SHL || i == SHR) {
+			JIT("\x48\x89\xD9\x49\x8B\x1C\x24"); jit_drop();    // mov rcx, rbx; mov rbx, [r12]
+			if (i == SHL) JIT("\x48\xD3\xE3"); else JIT("\x48\xD3\xFB"); // shl/sar rbx, cl
+			++pc;
+		}
+		else if (i == ENT)  {
+			JIT("\x49\x83\xEC\x08\x4D\x89\x2C\x24");            // sub r12, 8; mov [r12], r13
+			JIT("\x4D\x89\xE5");                                // mov r13, r12
+			JIT("\x49\x81\xEC"); jit_d(v * sizeof(int));        // sub r12, v
+			pc = pc + 2;
+		}
+		else if (i == ADJ)  { JIT("\x49\x81\xC4"); jit_d(v * sizeof(int)); pc = pc + 2; } // add r12, v
+		else if (i == _ADJ) { JIT("\x49\x8B\x04\x24\x4D\x8D\x24\xC4"); ++pc; } // mov rax, [r12]; lea r12, [r12 + rax * 8]
+		// Superinstructions, see c4m_fuse()
+		else if (i == LLI)  { JIT("\x49\x8B\x9D"); jit_d(v * sizeof(int)); pc = pc + 3; }     // mov rbx, [r13 + v]
+		else if (i == LLC)  { JIT("\x49\x0F\xBE\x9D"); jit_d(v * sizeof(int)); pc = pc + 3; } // movsx rbx, byte [r13 + v]
+		else if (i == PSHL) { JIT("\x49\x8D\x9D"); jit_d(v * sizeof(int)); jit_push_rbx(); pc = pc + 3; }
+		else if (i == PSHI) { jit_mov_rbx(v); jit_push_rbx(); pc = pc + 3; }
+		else if (i == ADDI) { jit_mov_rax(pc[2]); JIT("\x48\x01\xC3"); pc = pc + 4; }     // add rbx, rax
+		else if (i == SUBI) { jit_mov_rax(pc[2]); JIT("\x48\x29\xC3"); pc = pc + 4; }     // sub rbx, rax
+		else if (i == MULI) { jit_mov_rax(pc[2]); JIT("\x48\x0F\xAF\xD8"); pc = pc + 4; } // imul rbx, rax
+		// Control transfer, ends the block
+		else if (i == JMP)  { jit_mov_rax(v); done = 1; }
+		else if (i == JMPA) { JIT("\x48\x89\xD8"); done = 1; }   // mov rax, rbx
+		else if (i == _JMP) { jit_pop_rax(); done = 1; }
+		else if (i == BZ || i == BNZ) {
+			if (i == BZ) { jit_mov_rax(v); jit_mov_rcx((int)(pc + 2)); }
+			else         { jit_mov_rax((int)(pc + 2)); jit_mov_rcx(v); }
+			JIT("\x48\x85\xDB\x48\x0F\x45\xC1");                // test rbx, rbx; cmovnz rax, rcx
+			done = 1;
+		}
+		else if (i == JSR || i == JSRI || i == JSRS) {
+			jit_mov_rax((int)(pc + 2)); jit_push_rax();
+			if (i == JSR)       jit_mov_rax(v);
+			else if (i == JSRI) { jit_mov_rax(v); JIT("\x48\x8B\x00"); }        // mov rax, [rax]
+			else                { JIT("\x49\x8B\x85"); jit_d(v * sizeof(int)); } // mov rax, [r13 + v]
+			done = 1;
+		}
+		else if (i == LEV)  {
+			JIT("\x4D\x89\xEC\x4D\x8B\x2C\x24");                // mov r12, r13; mov r13, [r12]
+			JIT("\x49\x8B\x44\x24\x08\x49\x83\xC4\x10");        // mov rax, [r12 + 8]; add r12, 16
+			done = 1;
+		}
+		else break; // No template, the block ends before this instruction
+		++n;
+	}
+
+	if (!n) {
+		jit_code_pos = fn;
+		*length = 0;
+		return 0;
+	}
+	if (!done) jit_mov_rax((int)pc);
+	jit_epilogue();
+
+	// Track the pages of VM code the block was translated from
+	v = (int)start >> JIT_PAGE_SHIFT;
+	while (v <= ((int)pc + sizeof(int) - 1) >> JIT_PAGE_SHIFT)
+		jit_page_add(v++);
+	++jit_blocks;
+	*length = n;
+	return fn;
+}
+
+// Same contract as c4m_fast_run: run until the next instruction must be
+// executed by the chain in c4m_main.
+int c4m_jit_run (int **_pc, int **_sp, int **_bp, int *_a, int *_countdown, int next_event) {
+	int  state[3], *pc, h, n;
+	char *fn;
+
+	pc = *_pc;
+	state[0] = *_a; state[1] = (int)*_sp; state[2] = (int)*_bp;
+	while (1) {
+		h = jit_hash((int)pc) & (JIT_TABLE_SIZE - 1);
+		while (jit_table_pc[h] && jit_table_pc[h] != pc)
+			h = (h + 1) & (JIT_TABLE_SIZE - 1);
+		if (jit_table_pc[h]) {
+			fn = jit_table_fn[h];
+			n = jit_table_len[h];
+		} else {
+			fn = jit_compile(pc, &n);
+			// Compiling may have flushed the table
+			h = jit_hash((int)pc) & (JIT_TABLE_SIZE - 1);
+			while (jit_table_pc[h])
+				h = (h + 1) & (JIT_TABLE_SIZE - 1);
+			jit_table_pc[h] = pc;
+			jit_table_fn[h] = fn;
+			jit_table_len[h] = n;
+			++jit_table_count;
+		}
+		if (!fn) break;
+		// Let the threaded engine run up to the event
+		if (*_countdown <= n) {
+			*_pc = pc; *_a = state[0]; *_sp = (int *)state[1]; *_bp = (int *)state[2];
+			return c4m_fast_run(_pc, _sp, _bp, _a, _countdown, next_event);
+		}
+		*_countdown = *_countdown - n;
+		pc = ((int *(*)(int *))fn)(state);
+	}
+	*_pc = pc; *_a = state[0]; *_sp = (int *)state[1]; *_bp = (int *)state[2];
+	return 0;
+}
+#undef JIT
+
+#else
+// No JIT for this architecture
+int c4m_jit_init () {
+	printf("c4m: jit not supported on this architecture\n");
+	return 1;
+}
+void c4m_jit_shutdown (int verbose) { }
+void c4m_jit_free (void *ptr) { }
+int c4m_jit_run (int **_pc, int **_sp, int **_bp, int *_a, int *_countdown, int next_event) {
+	return c4m_fast_run(_pc, _sp, _bp, _a, _countdown, next_event);
+}
+#endif
@@ -0,0 +1,141 @@
+// c4m_native.c - Native extension modules for natively compiled c4m.
+//
+// Included by c4m.c after c4m_jit.c. Like that file it is never seen by c4 or
+// c4cc, and c4m.c provides stubs for them in its C4_ONLY block.
+//
+// A native module is C code statically linked into c4m that provides opcode
+// handlers by name. Modules are listed in c4m_native_modules below and are
+// selected at startup with -x <name>; a selected module's init function calls
+// c4m_native_provide() for each handler it offers, after c4m_native_check()
+// if the handlers depend on the layout of the context they are bound with.
+//
+// Nothing is bound until the running program asks for it:
+//   __c4_configure(CONF_NATIVE_OPCODE, request)
+// where request is an int array laid out as NATIVE_REQ_*. If a selected
+// module provides the named handler it is bound to the given opcode and 1 is
+// returned, otherwise 0. A request of 0 unbinds every opcode.
+//
+// A bound opcode is executed by calling the handler directly: no trap is
+// taken and no VM code runs. The handler receives the register frame as an
+// int array laid out as NREG_*, which it may update, and the context pointer
+// given when it was bound. It returns NATIVE_DONE when it handled the opcode,
+// or NATIVE_TRAP to leave the registers alone and let the opcode continue to
+// the fast opcode table or trap handler as if it were not bound. Handlers
+// should therefore decline anything they cannot finish without the program's
+// help, such as switching tasks.
+
+enum { NATIVE_MODULES_MAX = 8, NATIVE_PROVIDED_MAX = 64 };
+
+static int   native_selected[NATIVE_MODULES_MAX]; // init functions already run
+static int   native_selected_count;
+static char *native_provided_name[NATIVE_PROVIDED_MAX];
+static int   native_provided_handler[NATIVE_PROVIDED_MAX];
+static int   native_provided_check[NATIVE_PROVIDED_MAX];
+static int   native_check;                        // applies to handlers provided next
+static int   native_provided_count;
+static int   native_handler[FAST_OPCODES_MAX];    // by opcode, 0 if not bound
+static int  *native_context[FAST_OPCODES_MAX];
+int          c4m_native_bound;                    // opcodes currently bound
+
+// Called by module init functions.
+// @return 0 on success, 1 if the table is full
+int c4m_native_provide (char *name, int (*handler)(int op, int *regs, int *context)) {
+	if (native_provided_count == NATIVE_PROVIDED_MAX) {
+		printf("c4m: too many native handlers, '%s' not provided\n", name);
+		return 1;
+	}
+	native_provided_name[native_provided_count] = name;
+	native_provided_handler[native_provided_count] = (int)handler;
+	native_provided_check[native_provided_count] = native_check;
+	++native_provided_count;
+	return 0;
+}
+
+// Called by module init functions before c4m_native_provide(). Binding the
+// handlers provided after this fails unless check accepts the context given,
+// so a program built against a different layout is not misread.
+void c4m_native_check (int (*check)(int *context)) {
+	native_check = (int)check;
+}
+
+// Modules, which call c4m_native_provide() from their init function
+#include "c4m_native_c4ke.c"
+
+// Modules linked into c4m: name, init function
+static int c4m_native_modules[] = {
+	(int)"c4ke", (int)&c4m_native_c4ke_init,
+	0
+};
+
+// Select a module given to -x.
+// @return 0 on success, 1 if there is no such module or it failed to start
+int c4m_native_select (char *name) {
+	int *m, i;
+
+	m = c4m_native_modules;
+	while (*m && strcmp((char *)*m, name))
+		m = m + 2;
+	if (!*m) {
+		printf("c4m: no native module '%s'\n", name);
+		return 1;
+	}
+	i = 0;
+	while (i < native_selected_count && native_selected[i] != m[1])
+		++i;
+	if (i < native_selected_count)
+		return 0;
+	if (native_selected_count == NATIVE_MODULES_MAX) {
+		printf("c4m: too many native modules selected\n");
+		return 1;
+	}
+	native_selected[native_selected_count++] = m[1];
+	native_check = 0;
+	if (((int (*)())m[1])()) {
+		printf("c4m: native module '%s' failed to start\n", name);
+		return 1;
+	}
+	return 0;
+}
+
+// Handle CONF_NATIVE_OPCODE.
+// @return 1 if the opcode was bound, 0 otherwise
+int c4m_native_bind (int *request) {
+	int op, i;
+
+	if (!request) {
+		memset(native_handler, 0, sizeof(native_handler));
+		memset(native_context, 0, sizeof(native_context));
+		c4m_native_bound = 0;
+		return 0;
+	}
+	op = request[NATIVE_REQ_OPCODE];
+	if (op <= 0 || op >= FAST_OPCODES_MAX)
+		return 0;
+	i = 0;
+	while (i < native_provided_count && strcmp(native_provided_name[i], (char *)request[NATIVE_REQ_NAME]))
+		++i;
+	if (i == native_provided_count)
+		return 0;
+	if (native_provided_check[i] &&
+	    !((int (*)(int *))native_provided_check[i])((int *)request[NATIVE_REQ_CONTEXT]))
+		return 0;
+	if (!native_handler[op])
+		++c4m_native_bound;
+	native_handler[op] = native_provided_handler[i];
+	native_context[op] = (int *)request[NATIVE_REQ_CONTEXT];
+	return 1;
+}
+
+// Execute opcode op if it is bound and the handler accepts it.
+// @return 1 if handled, 0 if the opcode should take the usual path
+int c4m_native_run (int op, int **_pc, int **_sp, int **_bp, int *_a) {
+	int regs[NREG__Sz];
+
+	if (op <= 0 || op >= FAST_OPCODES_MAX || !native_handler[op])
+		return 0;
+	regs[NREG_A] = *_a; regs[NREG_SP] = (int)*_sp; regs[NREG_BP] = (int)*_bp; regs[NREG_PC] = (int)*_pc;
+	if (((int (*)(int, int *, int *))native_handler[op])(op, regs, native_context[op]) != NATIVE_DONE)
+		return 0;
+	*_a = regs[NREG_A]; *_sp = (int *)regs[NREG_SP]; *_bp = (int *)regs[NREG_BP]; *_pc = (int *)regs[NREG_PC];
+	return 1;
+}
@@ -0,0 +1,112 @@
+// c4m_native_c4ke.c - Native module "c4ke": C versions of hot C4KE opcodes.
+//
+// Included by c4m_native.c, selected with -x c4ke.
+//
+// C4KE binds these with a context describing where its state lives, laid out
+// as KNC_* below: the address of each kernel global used, and the field
+// indices of the structures involved. The layout must match the one in
+// c4ke.c, and binding fails when the size it gives in KNC_SIZE differs. Handlers only read and write the same fields as the kernel's own
+// handlers, and decline (NATIVE_TRAP) anything that needs the kernel to run,
+// so the kernel's handlers remain authoritative.
+
+// C4KE native context, keep up to date with c4ke.c
+enum {
+	KNC_SIZE,           // int, KNC__Sz, checked by nk_context_check
+	KNC_TASK_CURRENT,   // int **, &kernel_task_current
+	KNC_RQ_MASK,        // int *,  &kernel_rq_mask
+	KNC_RQ_HEAD,        // int **, &kernel_rq_head
+	KNC_TIMER_COUNT,    // int *,  &kernel_timer_count
+	KNC_TIMERS,         // int **, &kernel_timers
+	KNC_TASK_ID,        // TASK field indices
+	KNC_TASK_PARENT,
+	KNC_TASK_SIGHANDLERS,
+	KNC_TASK_RQ,
+	KNC_TASK_RQ_NEXT,
+	KNC_TASK_WAITARG,
+	KNC_SIGH_SZ,        // Signal handler structure size,
+	KNC_SIGH_ADDRESS,   // and its handler field index
+	KNC_SIGNAL_MAX,
+	KNC__Sz
+};
+
+// @return 1 if ctx has the layout above
+static int nk_context_check (int *ctx) {
+	static int warned;
+
+	if (ctx && ctx[KNC_SIZE] == KNC__Sz)
+		return 1;
+	if (!warned++)
+		printf("c4m: c4ke native context does not match this c4m, native opcodes not bound\n");
+	return 0;
+}
+
+#define KNC_CURRENT(ctx) (*(int **)(ctx)[KNC_TASK_CURRENT])
+
+// int pid ()
+static int nk_user_pid (int op, int *regs, int *ctx) {
+	regs[NREG_A] = KNC_CURRENT(ctx)[ctx[KNC_TASK_ID]];
+	return NATIVE_DONE;
+}
+
+// int parent ()
+static int nk_user_parent (int op, int *regs, int *ctx) {
+	regs[NREG_A] = KNC_CURRENT(ctx)[ctx[KNC_TASK_PARENT]];
+	return NATIVE_DONE;
+}
+
+// int __time ()
+static int nk_time (int op, int *regs, int *ctx) {
+	regs[NREG_A] = c4m_time();
+	return NATIVE_DONE;
+}
+
+// void signal (int sig, int *handler)
+// An invalid signal is left to the kernel to report.
+static int nk_user_signal (int op, int *regs, int *ctx) {
+	int *sp, *sigh, sig;
+
+	sp = (int *)regs[NREG_SP];
+	sig = sp[1];
+	if (sig < 0 || sig >= ctx[KNC_SIGNAL_MAX])
+		return NATIVE_TRAP;
+	sigh = (int *)KNC_CURRENT(ctx)[ctx[KNC_TASK_SIGHANDLERS]];
+	sigh[sig * ctx[KNC_SIGH_SZ] + ctx[KNC_SIGH_ADDRESS]] = sp[2];
+	return NATIVE_DONE;
+}
+
+// int schedule ()
+// Returns 0 when kernel_task_find() would find nothing to switch to: no timer
+// is due, and no task other than the current one is ready. Everything else,
+// including rotating the current task behind others at its level, is left
+// to the kernel.
+static int nk_schedule (int op, int *regs, int *ctx) {
+	int *cur, *head, m, q;
+
+	if (*(int *)ctx[KNC_TIMER_COUNT] &&
+	    c4m_time() >= (*(int ***)ctx[KNC_TIMERS])[0][ctx[KNC_TASK_WAITARG]])
+		return NATIVE_TRAP;
+	cur = KNC_CURRENT(ctx);
+	head = *(int **)ctx[KNC_RQ_HEAD];
+	m = *(int *)ctx[KNC_RQ_MASK];
+	if ((q = cur[ctx[KNC_TASK_RQ]]) && head[q - 1] == (int)cur) {
+		if (cur[ctx[KNC_TASK_RQ_NEXT]])
+			return NATIVE_TRAP;
+		m = m & ~(1 << (q - 1));
+	}
+	if (m)
+		return NATIVE_TRAP;
+	regs[NREG_A] = 0;
+	return NATIVE_DONE;
+}
+
+#undef KNC_CURRENT
+
+static int c4m_native_c4ke_init () {
+	c4m_native_check(nk_context_check);
+	return c4m_native_provide("OP_USER_PID", nk_user_pid) ||
+	       c4m_native_provide("OP_USER_PARENT", nk_user_parent) ||
+	       c4m_native_provide("OP_KERN_TASK_CURRENT_ID", nk_user_pid) ||
+	       c4m_native_provide("OP_TIME", nk_time) ||
+	       c4m_native_provide("OP_USER_SIGNAL", nk_user_signal) ||
+	       c4m_native_provide("OP_SCHEDULE", nk_schedule);
+}
@@ -0,0 +1,312 @@
+// c4m_prof.c - Sampling profiler for natively compiled c4m.
+//
+// Included by c4m.c after c4m_native.c. Like that file it is never seen by c4
+// or c4cc, and c4m.c provides stubs for them in its C4_ONLY block.
+//
+// Enabled with -r <cycles>. The run loop takes a sample about every given
+// number of cycles, scheduled with the same event countdown as the cycle
+// interrupt, so in between the program runs at full speed in whichever engine
+// is selected. The interval is jittered by up to a quarter either way so that
+// a loop whose length divides it is not always sampled at the same place.
+//
+// A sample counts the instruction about to execute, by address and by opcode,
+// then walks the ENT frames up the stack: every function on the stack is
+// counted once (its total), and so is every caller and callee pair found on
+// the way (an arc). The walk stops at a return address outside the
+// compiled source: where main was called from, the TLEV of a trap handler
+// (shown as [trap]), or code c4m did not compile itself, such as a .c4r
+// program loaded by load-c4r.c. Samples taken in such code are counted as
+// [unknown], so to profile C4KE run c4ke.c from source rather than c4ke.c4r.
+//
+// At exit a flat profile, the hottest instructions and opcodes, and a call
+// graph are printed, with function names from the symbol table.
+
+enum { PROF_UNKNOWN, PROF_TRAP, PROF_FIRST }; // pseudo functions, then the real ones
+enum { PROF_DEPTH_MAX = 256, PROF_HOT_MAX = 20 };
+
+static int    prof_interval;
+static int    prof_samples;
+static int   *prof_code, *prof_code_end; // compiled code
+static int   *prof_pc;                   // samples by code word
+static int    prof_ops[OP__Sz + 1];      // samples by opcode, the last for custom opcodes
+static int    prof_funs;                 // functions, including the pseudo functions
+static int   *prof_entry;                // by function, sorted by address
+static char **prof_name;
+static int   *prof_self, *prof_total, *prof_seen;
+static int   *prof_arc_key, *prof_arc_count, *prof_arc_seen; // open addressed, key is caller * prof_funs + callee + 1
+static int    prof_arc_size, prof_arc_used;
+static int   *prof_sort_key;
+
+// @return 0 on success
+int c4m_prof_init (int interval, int *sym, int *code, int *code_end) {
+	int *i, n, j, entry;
+	char *s, *name;
+
+	n = PROF_FIRST;
+	i = sym;
+	while (i[Tk]) {
+		if (i[Tk] == Id && i[Class] == Fun) ++n;
+		i = i + Idsz;
+	}
+	prof_entry = calloc(n, sizeof(int));
+	prof_name = calloc(n, sizeof(char *));
+	prof_self = calloc(n, sizeof(int));
+	prof_total = calloc(n, sizeof(int));
+	prof_seen = calloc(n, sizeof(int));
+	prof_pc = calloc(code_end - code, sizeof(int));
+	prof_arc_size = 1024;
+	prof_arc_key = calloc(prof_arc_size, sizeof(int));
+	prof_arc_count = calloc(prof_arc_size, sizeof(int));
+	prof_arc_seen = calloc(prof_arc_size, sizeof(int));
+	if (!prof_entry || !prof_name || !prof_self || !prof_total || !prof_seen ||
+	    !prof_pc || !prof_arc_key || !prof_arc_count || !prof_arc_seen) {
+		printf("c4m: unable to allocate profiler tables\n");
+		return 1;
+	}
+	prof_name[PROF_UNKNOWN] = strdup("[unknown]");
+	prof_name[PROF_TRAP] = strdup("[trap]");
+
+	// Copy out the functions, keeping them sorted by entry address. The
+	// names point into the source, which is freed before the program runs.
+	prof_funs = PROF_FIRST;
+	i = sym;
+	while (i[Tk]) {
+		if (i[Tk] == Id && i[Class] == Fun) {
+			s = (char *)i[Name];
+			while ((*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || (*s >= '0' && *s <= '9') || *s == '_')
+				++s;
+			name = strndup((char *)i[Name], s - (char *)i[Name]);
+			entry = i[Val];
+			j = prof_funs++;
+			while (j > PROF_FIRST && prof_entry[j - 1] > entry) {
+				prof_entry[j] = prof_entry[j - 1];
+				prof_name[j] = prof_name[j - 1];
+				--j;
+			}
+			prof_entry[j] = entry;
+			prof_name[j] = name;
+		}
+		i = i + Idsz;
+	}
+	prof_interval = interval;
+	prof_code = code;
+	prof_code_end = code_end;
+	return 0;
+}
+
+// @return cycles until the next sample
+int c4m_prof_next () {
+	return prof_interval - prof_interval / 4 + rand() % (prof_interval / 2 + 1);
+}
+
+// @return the function containing pc, or PROF_UNKNOWN
+static int prof_function (int *pc) {
+	int lo, hi, mid;
+
+	if (pc < prof_code || pc >= prof_code_end || prof_funs == PROF_FIRST || (int)pc < prof_entry[PROF_FIRST])
+		return PROF_UNKNOWN;
+	lo = PROF_FIRST;
+	hi = prof_funs - 1;
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (prof_entry[mid] <= (int)pc) lo = mid;
+		else hi = mid - 1;
+	}
+	return lo;
+}
+
+// Count an arc, once per sample like the function totals
+static void prof_arc (int caller, int callee) {
+	int *key, *count, *seen, size, k, h, j;
+
+	if (2 * (prof_arc_used + 1) > prof_arc_size) {
+		key = prof_arc_key; count = prof_arc_count; seen = prof_arc_seen; size = prof_arc_size;
+		prof_arc_key = calloc(2 * size, sizeof(int));
+		prof_arc_count = calloc(2 * size, sizeof(int));
+		prof_arc_seen = calloc(2 * size, sizeof(int));
+		if (!prof_arc_key || !prof_arc_count || !prof_arc_seen) {
+			free(prof_arc_key); free(prof_arc_count); free(prof_arc_seen);
+			prof_arc_key = key; prof_arc_count = count; prof_arc_seen = seen;
+			return;
+		}
+		prof_arc_size = 2 * size;
+		prof_arc_used = 0;
+		j = 0;
+		while (j < size) {
+			if (key[j]) {
+				h = key[j] & (prof_arc_size - 1);
+				while (prof_arc_key[h]) h = (h + 1) & (prof_arc_size - 1);
+				prof_arc_key[h] = key[j];
+				prof_arc_count[h] = count[j];
+				prof_arc_seen[h] = seen[j];
+				++prof_arc_used;
+			}
+			++j;
+		}
+		free(key); free(count); free(seen);
+	}
+	k = caller * prof_funs + callee + 1;
+	h = k & (prof_arc_size - 1);
+	while (prof_arc_key[h] && prof_arc_key[h] != k)
+		h = (h + 1) & (prof_arc_size - 1);
+	if (!prof_arc_key[h]) {
+		prof_arc_key[h] = k;
+		++prof_arc_used;
+	}
+	if (prof_arc_seen[h] != prof_samples) {
+		prof_arc_seen[h] = prof_samples;
+		++prof_arc_count[h];
+	}
+}
+
+static void prof_count_total (int f) {
+	if (prof_seen[f] != prof_samples) {
+		prof_seen[f] = prof_samples;
+		++prof_total[f];
+	}
+}
+
+// Take a sample with the registers as they are before pc executes.
+void c4m_prof_sample (int *pc, int *sp, int *bp) {
+	int f, caller, op, *ret, depth;
+
+	++prof_samples;
+	op = *pc;
+	if (op == OPCD) op = *sp;
+	++prof_ops[op >= 0 && op < OP__Sz ? op : OP__Sz];
+	f = prof_function(pc);
+	++prof_self[f];
+	prof_count_total(f);
+	if (f == PROF_UNKNOWN)
+		return;
+	++prof_pc[pc - prof_code];
+	// Right after a call the ENT has not built the frame yet, bp is still
+	// the caller's and the return address is on top of the stack.
+	if ((int)pc == prof_entry[f]) ret = (int *)*sp;
+	else { ret = (int *)bp[1]; bp = (int *)*bp; }
+	depth = 0;
+	while (depth++ < PROF_DEPTH_MAX) {
+		if (ret == &tlev_instruction) caller = PROF_TRAP;
+		else if ((caller = prof_function(ret)) == PROF_UNKNOWN) return;
+		prof_arc(caller, f);
+		prof_count_total(caller);
+		if (caller == PROF_TRAP) return;
+		f = caller;
+		ret = (int *)bp[1];
+		bp = (int *)*bp;
+	}
+}
+
+// qsort comparison, indices by prof_sort_key descending. qsort expects a C
+// int, not the word sized int of c4.h.
+static int32_t prof_cmp (const void *x, const void *y) {
+	int a, b;
+	a = prof_sort_key[*(int *)x];
+	b = prof_sort_key[*(int *)y];
+	if (a != b) return a < b ? 1 : -1;
+	return *(int *)x < *(int *)y ? -1 : *(int *)x > *(int *)y;
+}
+
+static int *prof_sorted (int *key, int n) {
+	int *order, i;
+	if (!(order = malloc(n * sizeof(int))))
+		return 0;
+	i = 0;
+	while (i < n) { order[i] = i; ++i; }
+	prof_sort_key = key;
+	qsort(order, n, sizeof(int), prof_cmp);
+	return order;
+}
+
+// Print a count as a percentage of the samples
+static void prof_percent (int n) {
+	n = n * 1000 / prof_samples;
+	printf("%3d.%d%%", n / 10, n % 10);
+}
+
+static void prof_report () {
+	int *order, *key, *arcs, i, f, j, arc;
+
+	printf("c4m: profile of %d samples, one every %d cycles on average\n", prof_samples, prof_interval);
+	if (!prof_samples)
+		return;
+
+	// By self, then by total for functions only seen as callers
+	printf("\nFlat profile:\n   self%%    self  total%%   total  function\n");
+	if (!(key = malloc(prof_funs * sizeof(int)))) return;
+	f = 0;
+	while (f < prof_funs) { key[f] = prof_self[f] * (prof_samples + 1) + prof_total[f]; ++f; }
+	order = prof_sorted(key, prof_funs);
+	i = 0;
+	while (order && i < prof_funs && key[f = order[i]]) {
+		printf(" "); prof_percent(prof_self[f]); printf(" %7d ", prof_self[f]);
+		prof_percent(prof_total[f]); printf(" %7d  %s\n", prof_total[f], prof_name[f]);
+		++i;
+	}
+	free(order);
+	free(key);
+
+	printf("\nHottest instructions:\n   self%%    self  address             opcode  function+offset\n");
+	if (!(order = prof_sorted(prof_pc, prof_code_end - prof_code))) return;
+	i = 0;
+	while (i < PROF_HOT_MAX && i < prof_code_end - prof_code && prof_pc[j = order[i]]) {
+		f = prof_function(prof_code + j);
+		printf(" "); prof_percent(prof_pc[j]); printf(" %7d  0x%-16lX  ", prof_pc[j], (long)(prof_code + j));
+		if (prof_code[j] >= 0 && prof_code[j] < OP__Sz) printf("%.4s  ", &c4m_opcodes[prof_code[j] * 5]);
+		else printf("%-4d  ", prof_code[j]);
+		printf("%s+%d\n", prof_name[f], (int)(prof_code + j - (int *)prof_entry[f]));
+		++i;
+	}
+	free(order);
+
+	printf("\nOpcodes:\n   self%%    self  opcode\n");
+	if (!(order = prof_sorted(prof_ops, OP__Sz + 1))) return;
+	i = 0;
+	while (i <= OP__Sz && prof_ops[j = order[i]]) {
+		printf(" "); prof_percent(prof_ops[j]); printf(" %7d  ", prof_ops[j]);
+		if (j < OP__Sz) printf("%.4s\n", &c4m_opcodes[j * 5]);
+		else printf("(custom)\n");
+		++i;
+	}
+	free(order);
+
+	// Callers above each function and callees below, by arc samples
+	printf("\nCall graph:\n   total%%   total    self  function\n");
+	if (!(arcs = prof_sorted(prof_arc_count, prof_arc_size))) return;
+	order = prof_sorted(prof_total, prof_funs);
+	i = 0;
+	while (order && i < prof_funs && prof_total[f = order[i]]) {
+		j = 0;
+		while (j < prof_arc_used) {
+			arc = prof_arc_key[arcs[j++]] - 1;
+			if (arc % prof_funs == f)
+				printf("                  %7d      %s\n", prof_arc_count[arcs[j - 1]], prof_name[arc / prof_funs]);
+		}
+		printf("  "); prof_percent(prof_total[f]);
+		printf(" %7d %7d  %s\n", prof_total[f], prof_self[f], prof_name[f]);
+		j = 0;
+		while (j < prof_arc_used) {
+			arc = prof_arc_key[arcs[j++]] - 1;
+			if (arc / prof_funs == f)
+				printf("                  %7d      %s\n", prof_arc_count[arcs[j - 1]], prof_name[arc % prof_funs]);
+		}
+		printf("\n");
+		++i;
+	}
+	free(order);
+	free(arcs);
+}
+
+// Print the profile and free the profiler
+void c4m_prof_shutdown () {
+	int i;
+
+	prof_report();
+	i = 0;
+	while (i < prof_funs)
+		free(prof_name[i++]);
+	free(prof_entry); free(prof_name);
+	free(prof_self); free(prof_total); free(prof_seen);
+	free(prof_pc);
+	free(prof_arc_key); free(prof_arc_count); free(prof_arc_seen);
+}
@@ -0,0 +1,129 @@
+// c4m_safe.c - Bounds checked safe mode for natively compiled c4m.
+//
+// Included by c4m.c after c4m_dispatch.c. Like that file it is never seen by
+// c4 or c4cc, and c4m.c provides stubs for them in its C4_ONLY block.
+//
+// Enabled with -b. Every page of memory a program may use is counted in a
+// page table: the code, data and stack pools, argv, the opcode name list,
+// and every block returned by malloc (a page is counted once per block that
+// touches it, and uncounted when the block is freed). Before a load or store
+// the page of the address is looked up, and an access to a page with no count
+// raises TRAP_SEGV with the address as its parameter, instead of the
+// instruction running. Without a trap handler c4m prints a stacktrace and
+// stops.
+//
+// Checked are LI, LC, SI, SC, the first and last byte of MSET, MCMP and MCPY,
+// the string intrinsics' first argument, and FREE of a block that was never
+// allocated. Accesses through bp (LEV, TLEV, and the LLI and LLC
+// superinstructions) are not checked, nor are the builtins that hand memory
+// straight to the C library (READ, PRTF).
+//
+// Checks are page granular: an access past the end of a block, or to a freed
+// block, is only caught when no other live block shares the page.
+//
+// The table has two levels, indexed by address bits 47..32 and 31..12, so a
+// check is a few shifts, two loads and a branch. Leaves are allocated the
+// first time a page in their 4GB range is counted.
+//
+// The threaded engine is built a second time as c4m_safe_run, with the check
+// in its load and store instructions. The JIT is not used in safe mode.
+
+#include <malloc.h>
+
+enum {
+	SAFE_PAGE_SHIFT = 12,
+	SAFE_LEAF_SHIFT = 32,
+	SAFE_LEAF_PAGES = 1 << (SAFE_LEAF_SHIFT - SAFE_PAGE_SHIFT),
+	SAFE_DIR_SIZE   = 1 << (48 - SAFE_LEAF_SHIFT),
+};
+
+static unsigned short **safe_dir; // leaves of per page block counts
+static int              safe_leaves;
+
+#define SAFE_LEAF(x) (((unsigned long)(x) >> SAFE_LEAF_SHIFT) < SAFE_DIR_SIZE ? \
+                      safe_dir[(unsigned long)(x) >> SAFE_LEAF_SHIFT] : 0)
+#define SAFE_PAGE(x) (((unsigned long)(x) >> SAFE_PAGE_SHIFT) & (SAFE_LEAF_PAGES - 1))
+#define SAFE_OK(x)   ((safe_leaf = SAFE_LEAF(x)) && safe_leaf[SAFE_PAGE(x)])
+
+// @return 0 on success
+int c4m_safe_init () {
+	if (!(safe_dir = calloc(SAFE_DIR_SIZE, sizeof(unsigned short *)))) {
+		printf("c4m: safe mode unable to allocate page table\n");
+		return 1;
+	}
+	return 0;
+}
+
+void c4m_safe_shutdown (int verbose) {
+	int i;
+	if (!safe_dir)
+		return;
+	if (verbose)
+		printf("c4m: safe mode used %d page table leaves\n", safe_leaves);
+	i = 0;
+	while (i < SAFE_DIR_SIZE)
+		free(safe_dir[i++]);
+	free(safe_dir);
+	safe_dir = 0;
+}
+
+// Count (delta 1) or uncount (delta -1) the pages of len bytes at p.
+static void safe_pages (char *p, int len, int delta) {
+	unsigned long page, last, i;
+	unsigned short *leaf;
+
+	if (len <= 0)
+		return;
+	page = (unsigned long)p >> SAFE_PAGE_SHIFT;
+	last = ((unsigned long)p + len - 1) >> SAFE_PAGE_SHIFT;
+	while (page <= last) {
+		i = page >> (SAFE_LEAF_SHIFT - SAFE_PAGE_SHIFT);
+		if (i >= SAFE_DIR_SIZE)
+			return;
+		if (!(leaf = safe_dir[i])) {
+			if (delta < 0 || !(leaf = safe_dir[i] = calloc(SAFE_LEAF_PAGES, sizeof(unsigned short)))) {
+				++page;
+				continue;
+			}
+			++safe_leaves;
+		}
+		leaf[page & (SAFE_LEAF_PAGES - 1)] += delta;
+		++page;
+	}
+}
+
+void c4m_safe_add (char *p, int len) { safe_pages(p, len, 1); }
+void c4m_safe_alloc (char *p) { safe_pages(p, malloc_usable_size(p), 1); }
+void c4m_safe_release (char *p) { safe_pages(p, malloc_usable_size(p), -1); }
+
+// Check the memory instruction i is about to access.
+// @return 1 and *addr set to the address if it is not accessible, 0 otherwise
+int c4m_safe_fault (int i, int a, int *sp, int *addr) {
+	unsigned short *safe_leaf;
+	int p, n;
+
+	if (i == LI || i == LC) p = a;
+	else if (i == SI || i == SC) p = *sp;
+	else if (i == FREE) { if (!(p = *sp)) return 0; }
+	else if (i == MSET) { p = sp[2]; n = *sp; }
+	else if (i == MCMP || i == MCPY) {
+		n = *sp;
+		p = sp[1];
+		if (n > 0 && !(SAFE_OK(p) && SAFE_OK(p + n - 1))) { *addr = p; return 1; }
+		p = sp[2];
+	}
+	else if (i >= SLEN && i <= SCPY) p = sp[1];
+	else return 0;
+	if (i == MSET || i == MCMP || i == MCPY) {
+		if (n <= 0) return 0;
+		if (SAFE_OK(p) && SAFE_OK(p + n - 1)) return 0;
+	} else if (SAFE_OK(p))
+		return 0;
+	*addr = p;
+	return 1;
+}
+
+// The threaded engine, with checked loads and stores
+#define DISPATCH_RUN      c4m_safe_run
+#define DISPATCH_CHECK(x) do { unsigned short *safe_leaf; if (!SAFE_OK(x)) goto op_slow; } while (0)
+#include "c4m_dispatch.c"
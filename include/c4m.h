@@ -9,6 +9,7 @@
 #define __c4_jmp(x)
 #define __c4_adjust(x)
 #define __opcode(x) 0
+#define __builtin(x) 0
 #define install_trap_handler(x) 0
 #define __c4_configure(...) 0
 #define __c4_cycles() 0
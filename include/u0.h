@@ -23,6 +23,23 @@ enum { U0_DEBUG = 0 };
 // C4KE opcode: int request_opcode(char *name)
 enum { OP_REQUEST_SYMBOL = 128 };
 
+// Syscall numbers for C4KE_ABI_VERSION - keep up to date with c4ke.c.
+// If the kernel reports another version, opcodes are requested by name, and
+// any it does not have are left at 0.
+enum { C4KE_ABI_VERSION = 3 };
+enum {
+	SYS_REQUEST_SYMBOL = 128, SYS_C4INFO, SYS_SCHEDULE, SYS_AWAIT_MESSAGE,
+	SYS_AWAIT_PID, SYS_TASK_FINISH, SYS_TASK_EXIT, SYS_TASK_FOCUS,
+	SYS_TASK_CYCLES, SYS_SHUTDOWN, SYS_HALT, SYS_TIME, SYS_PEEK_BP, SYS_PEEK_SP,
+	SYS_KERN_TASK_CURRENT_ID, SYS_KERN_TASK_RUNNING, SYS_KERN_TASK_COUNT,
+	SYS_KERN_TASKS_MAX, SYS_KERN_TASKS_EXPORT, SYS_KERN_TASKS_EXPORT_UPDATE,
+	SYS_KERN_TASKS_EXPORT_FREE, SYS_KERN_TASKS_RUNNING, SYS_DEBUG_PRINTSTACK,
+	SYS_DEBUG_KERNELSTATE, SYS_USER_START_C4R, SYS_USER_SLEEP, SYS_USER_PID,
+	SYS_USER_PARENT, SYS_USER_SIGNAL, SYS_USER_KILL, SYS_CURRENTTASK_UPDATE_NAME,
+	SYS_KERN_REQUEST_EXCLUSIVE, SYS_KERN_RELEASE_EXCLUSIVE, SYS_SEND_MESSAGE,
+	SYS_RECEIVE_MESSAGE, SYS_USER_START_C4R_STACK, SYS_KERN_TASK_PROFILE
+};
+
 // Task priveleges
 enum { PRIV_NONE, PRIV_USER, PRIV_KERNEL };
 
@@ -31,6 +48,9 @@ enum {
 	KTI_COUNT,
 	KTI_USED,
 	KTI_LIST,  // see KTE_*
+	KTI_GEN,   // used by the kernel to update only changed tasks
+	KTI_OWNER,
+	KTI_NEXT,
 	KTI__Sz
 };
 
@@ -51,6 +71,15 @@ enum {
 	KTE__Sz
 };
 
+// Kernel profile element, see kern_task_profile
+enum {
+	KPE_COUNT,         // int, samples
+	KPE_ADDRESS,       // int *, function entry, or the sampled address without symbols
+	KPE_NAME,          // char *, function name, or 0 without symbols
+	KPE_NAMELEN,       // int
+	KPE__Sz
+};
+
 // Task state, keep up to date with c4ke.c
 enum {
 	STATE_UNLOADED = 0x0,
@@ -144,7 +173,7 @@ enum {
   SIGSTKFLT   ,SIGCHLD     ,SIGCONT     ,SIGSTOP     ,SIGTSTP,
   SIGTTIN     ,SIGTTOU     ,SIGURG      ,SIGXCPU     ,SIGXFSZ,
   SIGVTALRM   ,SIGPROF     ,SIGWINCH    ,SIGIO       ,SIGPWR,
-  SIGSYS      ,SIGRTMIN = 32,SIGRTMAX = 64, SIGMAX = 64
+  SIGSYS      ,SIGRTMIN = 32,SIGRTMAX = 63, SIGMAX = 64
 };
 
 ///
@@ -163,10 +192,49 @@ static int OP_USER_SLEEP, OP_USER_PID, OP_USER_PARENT, OP_USER_SIGNAL, OP_USER_K
 static int OP_CURRENTTASK_UPDATE_NAME;
 static int OP_DEBUG_KERNELSTATE;
 static int OP_KERN_REQUEST_EXCLUSIVE, OP_KERN_RELEASE_EXCLUSIVE;
+static int OP_SEND_MESSAGE, OP_RECEIVE_MESSAGE;
+static int OP_USER_START_C4R_STACK;
+static int OP_KERN_TASK_PROFILE;
 
 // Automatically initialize opcodes
 static int __u0_ops_init () {
 	if (U0_DEBUG) printf("u0: ops_init()\n");
+	// One request when the kernel speaks our ABI, instead of one per opcode
+	if (__c4_opcode("C4KE_ABI_VERSION", OP_REQUEST_SYMBOL) == C4KE_ABI_VERSION) {
+		OP_HALT = SYS_HALT;
+		OP_C4INFO = SYS_C4INFO;
+		OP_TIME = SYS_TIME;
+		OP_SCHEDULE = SYS_SCHEDULE;
+		OP_AWAIT_MESSAGE = SYS_AWAIT_MESSAGE;
+		OP_AWAIT_PID = SYS_AWAIT_PID;
+		OP_KERN_TASKS_EXPORT = SYS_KERN_TASKS_EXPORT;
+		OP_KERN_TASKS_EXPORT_UPDATE = SYS_KERN_TASKS_EXPORT_UPDATE;
+		OP_KERN_TASKS_EXPORT_FREE = SYS_KERN_TASKS_EXPORT_FREE;
+		OP_KERN_TASKS_RUNNING = SYS_KERN_TASKS_RUNNING;
+		OP_USER_START_C4R = SYS_USER_START_C4R;
+		OP_KERN_TASK_CURRENT_ID = SYS_KERN_TASK_CURRENT_ID;
+		OP_KERN_TASK_RUNNING = SYS_KERN_TASK_RUNNING;
+		OP_KERN_TASK_COUNT = SYS_KERN_TASK_COUNT;
+		OP_TASK_FINISH = SYS_TASK_FINISH;
+		OP_TASK_FOCUS = SYS_TASK_FOCUS;
+		OP_TASK_EXIT = SYS_TASK_EXIT;
+		OP_USER_SIGNAL = SYS_USER_SIGNAL;
+		OP_USER_KILL = SYS_USER_KILL;
+		OP_USER_SLEEP = SYS_USER_SLEEP;
+		OP_USER_PID = SYS_USER_PID;
+		OP_USER_PARENT = SYS_USER_PARENT;
+		OP_CURRENTTASK_UPDATE_NAME = SYS_CURRENTTASK_UPDATE_NAME;
+		OP_DEBUG_KERNELSTATE = SYS_DEBUG_KERNELSTATE;
+		OP_KERN_REQUEST_EXCLUSIVE = SYS_KERN_REQUEST_EXCLUSIVE;
+		OP_KERN_RELEASE_EXCLUSIVE = SYS_KERN_RELEASE_EXCLUSIVE;
+		OP_TASK_CYCLES = SYS_TASK_CYCLES;
+		OP_SEND_MESSAGE = SYS_SEND_MESSAGE;
+		OP_RECEIVE_MESSAGE = SYS_RECEIVE_MESSAGE;
+		OP_USER_START_C4R_STACK = SYS_USER_START_C4R_STACK;
+		OP_KERN_TASK_PROFILE = SYS_KERN_TASK_PROFILE;
+		if (U0_DEBUG) printf("u0: ~ops_init() using ABI %d\n", C4KE_ABI_VERSION);
+		return 0;
+	}
 	// These calls must be made in reverse order due to how arguments are pushed
 	OP_HALT = __c4_opcode("OP_HALT", OP_REQUEST_SYMBOL);
 	OP_C4INFO = __c4_opcode("OP_C4INFO", OP_REQUEST_SYMBOL);
@@ -196,6 +264,10 @@ static int __u0_ops_init () {
 	OP_KERN_REQUEST_EXCLUSIVE = __c4_opcode("OP_KERN_REQUEST_EXCLUSIVE", OP_REQUEST_SYMBOL);
 	OP_KERN_RELEASE_EXCLUSIVE = __c4_opcode("OP_KERN_RELEASE_EXCLUSIVE", OP_REQUEST_SYMBOL);
 	OP_TASK_CYCLES = __c4_opcode("OP_TASK_CYCLES", OP_REQUEST_SYMBOL);
+	OP_SEND_MESSAGE = __c4_opcode("OP_SEND_MESSAGE", OP_REQUEST_SYMBOL);
+	OP_RECEIVE_MESSAGE = __c4_opcode("OP_RECEIVE_MESSAGE", OP_REQUEST_SYMBOL);
+	OP_USER_START_C4R_STACK = __c4_opcode("OP_USER_START_C4R_STACK", OP_REQUEST_SYMBOL);
+	OP_KERN_TASK_PROFILE = __c4_opcode("OP_KERN_TASK_PROFILE", OP_REQUEST_SYMBOL);
     if (U0_DEBUG) printf("u0: ~ops_init()\n");
 	return 0;
 }
@@ -203,13 +275,18 @@ static int __u0_ops_init () {
 // These calls must be made in reverse order due to how arguments are pushed
 int schedule () { return __c4_opcode(OP_SCHEDULE); }
 int *kern_tasks_export () { return (int *)__c4_opcode(OP_KERN_TASKS_EXPORT); }
-void kern_tasks_export_update (int *kti) { __c4_opcode(kti, OP_KERN_TASKS_EXPORT_UPDATE); }
+// Returns the updated listing, which moves when the task table has grown
+int *kern_tasks_export_update (int *kti) { return (int *)__c4_opcode(kti, OP_KERN_TASKS_EXPORT_UPDATE); }
 void kern_tasks_export_free (int *kti) { __c4_opcode(kti, OP_KERN_TASKS_EXPORT_FREE); }
 int  kern_tasks_running () { return 0; } // TODO
 int  kern_user_start_c4r (int argc, char **argv, char *name, int privileges) {
 	// printf("u0: attempt to start c4r\n");
 	return __c4_opcode(privileges, name, argv, argc, OP_USER_START_C4R);
 }
+// As kern_user_start_c4r, giving the new task a stack of stack_size bytes
+int  kern_user_start_c4r_stack (int argc, char **argv, char *name, int privileges, int stack_size) {
+	return __c4_opcode(stack_size, privileges, name, argv, argc, OP_USER_START_C4R_STACK);
+}
 int kern_request_exclusive () { return __c4_opcode(OP_KERN_REQUEST_EXCLUSIVE); }
 int kern_release_exclusive () { return __c4_opcode(OP_KERN_RELEASE_EXCLUSIVE); }
 
@@ -232,6 +309,12 @@ int __getlen_task_state (int s) {
 int  kern_getlen_task_state (int state) { return __getlen_task_state(state); }
 int  kern_task_current_id () { return __c4_opcode(OP_KERN_TASK_CURRENT_ID); }
 int  kern_task_running (int pid) { return __c4_opcode(pid, OP_KERN_TASK_RUNNING); }
+// Fill out up to max KPE_ elements with the functions task pid was found in
+// by the kernel's profiler (c4ke -p), most samples first. Names need the
+// task loaded with symbols (c4ke -g), and an element without an address
+// counts samples the kernel could not record.
+// @return elements filled, or -1 if not profiling or there is no such task
+int  kern_task_profile (int pid, int *out, int max) { return __c4_opcode(max, out, pid, OP_KERN_TASK_PROFILE); }
 void debug_kernelstate () { __c4_opcode(OP_DEBUG_KERNELSTATE); }
 
 ///
@@ -301,10 +384,45 @@ void exit (int code) {
 /// checking doesn't complain.
 ///
 
+// Native string intrinsics, when c4m provides them. Set by __u0_init, the
+// loops below are used until then or when not available.
+static int __u0_op_strlen, __u0_op_strcmp, __u0_op_strchr, __u0_op_memmove, __u0_op_strcpy;
+
 #define strlen __c4_strlen
-static int strlen (char *s) { char *t; t = s; while(*t) ++t; return t - s; }
+static int strlen (char *s) {
+	char *t;
+	if (__u0_op_strlen) return __c4_opcode(s, __u0_op_strlen);
+	t = s; while(*t) ++t; return t - s;
+}
 #define strcmp __c4_strmcp
-static int strcmp (char *s1, char *s2) { while(*s1 && (*s1 == *s2)) { ++s1; ++s2; } return *s1 - *s2; }
+static int strcmp (char *s1, char *s2) {
+	if (__u0_op_strcmp) return __c4_opcode(s2, s1, __u0_op_strcmp);
+	while(*s1 && (*s1 == *s2)) { ++s1; ++s2; } return *s1 - *s2;
+}
+#define strchr __c4_strchr
+static char *strchr (char *s, int c) {
+	if (__u0_op_strchr) return (char *)__c4_opcode(c, s, __u0_op_strchr);
+	while (*s != c) if (!*s++) return 0;
+	return s;
+}
+#define strcpy __c4_strcpy
+static char *strcpy (char *dest, char *src) {
+	char *d;
+	if (__u0_op_strcpy) return (char *)__c4_opcode(src, dest, __u0_op_strcpy);
+	d = dest; while ((*d++ = *src++)) ; return dest;
+}
+// Copies length bytes from src to dest, which may overlap
+#define memmove __c4_memmove
+static void *memmove (void *dest, void *src, int length) {
+	char *d, *s;
+	if (__u0_op_memmove) return (void *)__c4_opcode(length, src, dest, __u0_op_memmove);
+	d = dest; s = src;
+	if (d + length <= s || d >= s + length) return memcpy(dest, src, length);
+	// Overlapping: copy forwards when moving down, backwards when moving up
+	if (d < s) while (length-- > 0) *d++ = *s++;
+	else while (length-- > 0) d[length] = s[length];
+	return dest;
+}
 #define atoi __c4_atoi
 static int atoi (char *str, int radix) {
 	int v, sign;
@@ -332,10 +450,30 @@ int sleep (int ms) {
 }
 
 enum { TIMEOUT_NEVER = 0 };
-int *await_message (int timeout) {
+// Wait until a message arrives, without taking it.
+// Returns the number of messages waiting, 0 on timeout.
+int await_message (int timeout) {
 	return __c4_opcode(timeout, OP_AWAIT_MESSAGE);
 }
 
+// Message filled in by receive_message - keep up to date with c4ke.c
+enum { MSG_SENDER, MSG_SIZE, MSG_DATA, MSG__Sz };
+
+// Send size bytes at data to a process. data must come from malloc, and
+// belongs to the receiver once sent.
+// Returns 0 on success, -1 if pid is not running, -2 if its mailbox is full.
+int send_message (int pid, int size, char *data) {
+	return __c4_opcode(data, size, pid, OP_SEND_MESSAGE);
+}
+
+// Take the oldest message into msg, waiting up to timeout ms for one
+// (TIMEOUT_NEVER waits forever, a negative timeout does not wait).
+// The receiver frees msg[MSG_DATA].
+// Returns 1 if a message was received, 0 on timeout or signal.
+int receive_message (int *msg, int timeout) {
+	return __c4_opcode(timeout, msg, OP_RECEIVE_MESSAGE);
+}
+
 int await_pid (int pid) {
 	return __c4_opcode(pid, OP_AWAIT_PID);
 }
@@ -506,10 +644,22 @@ int isnum (char c) { return (c >= '0' && c <= '9'); }
 ///
 /// Initialization
 ///
+
+// @return the opcode of a native intrinsic, or 0 if c4m does not provide it
+static int __u0_intrinsic (char *name) {
+	int op;
+	return (op = __builtin(name)) > 0 ? op : 0;
+}
+
 static int __attribute__((constructor)) __u0_init (int *c4r) {
 	int r;
 
 	__u0_c4r = c4r;
+	__u0_op_strlen  = __u0_intrinsic("strlen");
+	__u0_op_strcmp  = __u0_intrinsic("strcmp");
+	__u0_op_strchr  = __u0_intrinsic("strchr");
+	__u0_op_memmove = __u0_intrinsic("memmove");
+	__u0_op_strcpy  = __u0_intrinsic("strcpy");
 
 	if ((r = __u0_ops_init())) return r;
 	if ((r = __u0_atexit_init())) return r;
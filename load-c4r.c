@@ -12,8 +12,9 @@
 enum { C4R__Supported_Version = 2 };
 
 enum {
-	C4ROPT_NONE,
-	C4ROPT_SYMBOLS
+	C4ROPT_NONE    = 0x0,
+	C4ROPT_SYMBOLS = 0x1,
+	C4ROPT_FUSE    = 0x2  // Rewrite code using superinstructions, if supported
 };
 
 //
@@ -98,6 +99,8 @@ enum {
 	C4R_CONSTRUCTORS,
 	C4R_DESTRUCTORS,
 	C4R_LOADCOMPLETE,
+	C4R_STRINGS,      // Block holding all symbol names, or 0 if allocated individually
+	C4R_IMAGE,        // Module this is an instance of (see c4r_instance), or 0
 	C4R__Sz
 };
 
@@ -131,15 +134,147 @@ static char *c4r_strcpy_alloc (char *source) {
 }
 
 static int c4r_readoffset;
+// Read len bytes, retrying short reads. Returns the number of bytes read,
+// which is less than len only at end of file or on error.
 static int c4r_checked_read (int fd, char *buffer, int len) {
-	int i;
-	if ((i = read(fd, buffer, len)) <= 0) {
-		if (c4r_debug) printf("lc4r: error, read() returned %d\n", i);
-	} else {
-		if (c4r_debug) printf("lc4r: successful read of %d bytes from file.0x%lx\n", len, c4r_readoffset);
-		c4r_readoffset = c4r_readoffset + len;
+	int i, total;
+	total = 0;
+	while (total < len) {
+		if ((i = read(fd, buffer + total, len - total)) <= 0) {
+			if (c4r_debug) printf("lc4r: error, read() returned %d\n", i);
+			if (!total) return i;
+			return total;
+		}
+		total = total + i;
+	}
+	if (c4r_debug) printf("lc4r: successful read of %d bytes from file.0x%lx\n", len, c4r_readoffset);
+	c4r_readoffset = c4r_readoffset + total;
+	return total;
+}
+
+// Read the rest of the file into a single allocation, which starts with room
+// for guess bytes and doubles as needed. Sets *length to the bytes read.
+static char *c4r_read_rest (int fd, int guess, int *length) {
+	char *result, *grown;
+	int   size, have, got, done;
+
+	size = guess + 1;
+	have = done = 0;
+	if (!(result = malloc(size)))
+		return 0;
+	while (!done) {
+		if ((got = c4r_checked_read(fd, result + have, size - have)) > 0)
+			have = have + got;
+		// A short read means end of file, otherwise grow and keep reading
+		if (have < size) done = 1;
+		else {
+			if (!(grown = malloc(size * 2))) {
+				free(result);
+				return 0;
+			}
+			memcpy(grown, result, have);
+			free(result);
+			result = grown;
+			size = size * 2;
+		}
 	}
-	return i;
+	*length = have;
+	return result;
+}
+
+// Constructor and destructor entries are a single word in the file. Read them
+// into the top of the array in one go and spread them out in place, which is
+// safe going forwards as each write lands at or below the entry just read.
+static int c4r_read_cnde (int fd, int *target, int count) {
+	int *source, i, value;
+
+	if (!count) return 0;
+	source = target + count * (C4R_CNDE__Sz - 1);
+	if (c4r_checked_read(fd, (char *)source, count * sizeof(int)) < count * sizeof(int))
+		return 1;
+	i = 0;
+	while (i < count) {
+		value = source[i];
+		target[C4R_CNDE_Priority] = 0;
+		target[C4R_CNDE_Value]    = value;
+		target = target + C4R_CNDE__Sz;
+		++i;
+	}
+	return 0;
+}
+
+// Point code words at the code and data segments they are loaded at.
+static void c4r_apply_patches (int *code, char *data, int *patch, int count) {
+	int ptype;
+	while (count--) {
+		if ((ptype = patch[C4R_PAT_TYPE]) == C4R_PTYPE_CODE)
+			code[patch[C4R_PAT_ADDRESS]] = (int)(code + patch[C4R_PAT_VALUE]);
+		else if (ptype == C4R_PTYPE_DATA)
+			code[patch[C4R_PAT_ADDRESS]] = (int)(data + patch[C4R_PAT_VALUE]);
+		// Other types refer to symbols and are resolved by the linker
+		patch = patch + C4R_PAT__Sz;
+	}
+}
+
+//
+// Superinstructions
+//
+// Common instruction sequences are rewritten into a single instruction once
+// the code is loaded and patched. This is the same pass as c4m_fuse() in
+// c4m.c: only the first opcode word of a sequence is replaced, the rest is
+// left in place and skipped by the superinstruction, so code offsets,
+// patches, symbols and branch targets are unaffected.
+// Opcode numbers are requested from the VM, and the pass is skipped if it
+// does not provide the superinstructions.
+static int c4r_fuse_state; // 0 = not yet requested, 1 = available, -1 = unavailable
+static int c4r_op_LEA, c4r_op_IMM, c4r_op_ADJ, c4r_op_LI, c4r_op_LC, c4r_op_PSH;
+static int c4r_op_ADD, c4r_op_SUB, c4r_op_MUL;
+static int c4r_op_LLI, c4r_op_LLC, c4r_op_PSHL, c4r_op_PSHI;
+static int c4r_op_ADDI, c4r_op_SUBI, c4r_op_MULI;
+
+static int c4r_fuse_init () {
+	c4r_op_LLI  = __opcode("LLI");
+	// LLI is never opcode 0 (LEA), which is also what gcc's dummy returns
+	if (c4r_op_LLI <= 0) return c4r_fuse_state = -1;
+	c4r_op_LEA  = __opcode("LEA");  c4r_op_IMM  = __opcode("IMM");
+	c4r_op_ADJ  = __opcode("ADJ");  c4r_op_LI   = __opcode("LI");
+	c4r_op_LC   = __opcode("LC");   c4r_op_PSH  = __opcode("PSH");
+	c4r_op_ADD  = __opcode("ADD");  c4r_op_SUB  = __opcode("SUB");
+	c4r_op_MUL  = __opcode("MUL");
+	c4r_op_LLC  = __opcode("LLC");  c4r_op_PSHL = __opcode("PSHL");
+	c4r_op_PSHI = __opcode("PSHI"); c4r_op_ADDI = __opcode("ADDI");
+	c4r_op_SUBI = __opcode("SUBI"); c4r_op_MULI = __opcode("MULI");
+	return c4r_fuse_state = 1;
+}
+
+// Fuse instruction sequences in code (length in words), returning the
+// number of sequences rewritten.
+int c4r_fuse (int *code, int length) {
+	int *pc, *end, i, n;
+
+	if (!c4r_fuse_state) c4r_fuse_init();
+	if (c4r_fuse_state < 0) return 0;
+
+	n = 0;
+	pc = code + 1; // First word is never code
+	end = code + length;
+	while (pc + 3 < end) {
+		i = *pc;
+		if (i == c4r_op_LEA) {
+			if      (pc[2] == c4r_op_LI)  { *pc = c4r_op_LLI;  ++n; }
+			else if (pc[2] == c4r_op_LC)  { *pc = c4r_op_LLC;  ++n; }
+			else if (pc[2] == c4r_op_PSH) { *pc = c4r_op_PSHL; ++n; }
+		} else if (i == c4r_op_IMM) {
+			if (pc[2] == c4r_op_PSH) { *pc = c4r_op_PSHI; ++n; }
+		} else if (i == c4r_op_PSH && pc[1] == c4r_op_IMM) {
+			if      (pc[3] == c4r_op_ADD) { *pc = c4r_op_ADDI; ++n; }
+			else if (pc[3] == c4r_op_SUB) { *pc = c4r_op_SUBI; ++n; }
+			else if (pc[3] == c4r_op_MUL) { *pc = c4r_op_MULI; ++n; }
+		}
+		// Step over the original instruction and its operand
+		if (i <= c4r_op_ADJ) pc = pc + 2; else pc = pc + 1;
+	}
+	return n;
 }
 
 // static
@@ -190,9 +325,8 @@ int *c4r_load_opt (char *file, int options) {
 	int  wordbytes, bad;
 	int *base, *target;
 	int  loop_target;
-	char *tmp;
-	int  ptype, paddr, pvalu;
-	int  percent, p, pc;
+	char *tmp, *rest, *end, *names;
+	int  size, len;
 
 	if (!(buffer = malloc(C4R_BUFFER_SIZE))) {
 		printf("Failed to allocate %d bytes for read buffer\n", C4R_BUFFER_SIZE);
@@ -236,16 +370,18 @@ int *c4r_load_opt (char *file, int options) {
 			//
 			if (c4r_verbose) printf("lc4r: load header...\n");
 			header[C4R_HDR_SIGNATURE] = c4r__charword('C', '4', 'R', 0);
-			read(fd, buffer, 1); header[C4R_HDR_VERSION] = *buffer;
-			read(fd, buffer, 1); header[C4R_HDR_WORDBITS]= *buffer;
+			c4r_checked_read(fd, buffer, 2);
+			header[C4R_HDR_VERSION] = buffer[0];
+			header[C4R_HDR_WORDBITS]= buffer[1];
 			wordbytes = header[C4R_HDR_WORDBITS] / 8;
-			read(fd, buffer, wordbytes); header[C4R_HDR_ENTRY] = *(int *)buffer;
-			read(fd, buffer, wordbytes); header[C4R_HDR_CODELEN] = *(int *)buffer;
-			read(fd, buffer, wordbytes); header[C4R_HDR_DATALEN] = *(int *)buffer;
-			read(fd, buffer, wordbytes); header[C4R_HDR_PATCHLEN] = *(int *)buffer;
-			read(fd, buffer, wordbytes); header[C4R_HDR_SYMBOLSLEN] = *(int *)buffer;
-			read(fd, buffer, wordbytes); header[C4R_HDR_CONSTRUCTLEN] = *(int *)buffer;
-			read(fd, buffer, wordbytes); header[C4R_HDR_DESTRUCTLEN] = *(int *)buffer;
+			// Entry through DestructLen are consecutive words, read them at once
+			x = C4R_HDR_DESTRUCTLEN - C4R_HDR_ENTRY + 1;
+			c4r_checked_read(fd, buffer, x * wordbytes);
+			i = 0;
+			while (i < x) {
+				header[C4R_HDR_ENTRY + i] = *(int *)(buffer + i * wordbytes);
+				++i;
+			}
 			c4r[C4R_HEADER] = (int)header;
 
 			if (wordbytes != sizeof(int)) {
@@ -310,15 +446,15 @@ int *c4r_load_opt (char *file, int options) {
 
 				// Code
 				if (c4r_verbose) printf("lc4r: load code...\n");
-				read(fd, buffer, 1); if (*buffer != 'C') { printf("lc4r: expected code segment, found 0x%x\n", *buffer); return c4r; }
-				read(fd, (char *)code, header[C4R_HDR_CODELEN] * wordbytes);
+				c4r_checked_read(fd, buffer, 1); if (*buffer != 'C') { printf("lc4r: expected code segment, found 0x%x\n", *buffer); return c4r; }
+				c4r_checked_read(fd, (char *)code, header[C4R_HDR_CODELEN] * wordbytes);
 				if (c4r_debug) printf("lc4r: loaded code, now at position 0x%x\n", c4r_readoffset);
 				// target = code; i = 0; while (i++ <= header[C4R_HDR_CODELEN]) printf("  Code @ 0x%lx: %d\n", target, *target++);
 				c4r[C4R_CODE] = (int)code;
 				// Data
 				if (c4r_verbose) printf("lc4r: load data...\n");
-				read(fd, buffer, 1); if (*buffer != 'D') { printf("lc4r: expected data segment, found '%c' 0x%x at file position 0x%lx %d\n", *buffer, *buffer, c4r_readoffset, c4r_readoffset); return c4r; }
-				read(fd, (char *)data, header[C4R_HDR_DATALEN]);
+				c4r_checked_read(fd, buffer, 1); if (*buffer != 'D') { printf("lc4r: expected data segment, found '%c' 0x%x at file position 0x%lx %d\n", *buffer, *buffer, c4r_readoffset, c4r_readoffset); return c4r; }
+				c4r_checked_read(fd, (char *)data, header[C4R_HDR_DATALEN]);
 				//i = 0; x = header[C4R_HDR_DATALEN] / wordbytes; target = data;
 				//if (c4r_debug) printf("lc4r: data len %d = %d words\n", header[C4R_HDR_DATALEN], x);
 				//while (i++ < x) {
@@ -334,107 +470,96 @@ int *c4r_load_opt (char *file, int options) {
 				// Patches
 				target = patches; i = 0; loop_target = header[C4R_HDR_PATCHLEN];
 				if (c4r_verbose) printf("lc4r: loading and apply %d patches...\n", loop_target);
-				read(fd, buffer, 1); if (*buffer != 'P') { printf("lc4r: expected patch segment, found 0x%x, position 0x%x (%d)\n", *buffer, c4r_readoffset - 1, c4r_readoffset - 1); return c4r; }
-				percent = 0;
-				p = __time();
-				while (i < loop_target) {
-					read(fd, buffer, wordbytes); target[C4R_PAT_TYPE]    = ptype = *(int *)buffer;
-					read(fd, buffer, wordbytes); target[C4R_PAT_ADDRESS] = paddr = *(int *)buffer;
-					read(fd, buffer, wordbytes); target[C4R_PAT_VALUE]   = pvalu = *(int *)buffer;
-
-					// Perform the patching now
-					// if (c4r_debug) printf("Patch %d ", i);
-					if (ptype == C4R_PTYPE_CODE) {
-						// if (c4r_debug) printf("updating code 0x%lX from 0x%lX to 0x%lX\n",
-						//        (code + target[C4R_PAT_ADDRESS]),
-						//       *(code + target[C4R_PAT_ADDRESS]),
-						//	    (code + target[C4R_PAT_VALUE]));
-						*(code + paddr) = (int)(code + pvalu);
-					} else if(ptype == C4R_PTYPE_DATA) {
-						//if (c4r_debug) printf("updating data 0x%lX from 0x%lX to 0x%lX\n",
-						//        (code + target[C4R_PAT_ADDRESS]),
-						 //      *(code + target[C4R_PAT_ADDRESS]),
-						//	    (code + target[C4R_PAT_VALUE]));
-						*(code + paddr) = (int)(((char *)data) + pvalu);
-					} else {
-						//printf("lc4r: unexpected patch type %d (not %d or %d)\n", target[C4R_PAT_TYPE], C4R_PTYPE_CODE, C4R_PTYPE_DATA);
-						//return c4r;
-					}
-
-					++i;
-					target = target + C4R_PAT__Sz;
-
-					if (c4r_verbose && __time() - p >= 1000) {
-						// Only print every 1s max
-                        percent = (i * 100) / loop_target;
-                        printf("lc4r: %d%% patched...\n", percent);
-                        p = __time();
-					}
-
+				c4r_checked_read(fd, buffer, 1); if (*buffer != 'P') { printf("lc4r: expected patch segment, found 0x%x, position 0x%x (%d)\n", *buffer, c4r_readoffset - 1, c4r_readoffset - 1); return c4r; }
+				// The file layout matches the patch structure, so the segment is
+				// read in one go and applied from memory.
+				if (loop_target && c4r_checked_read(fd, (char *)patches, loop_target * C4R_PAT__Sz * wordbytes) < loop_target * C4R_PAT__Sz * wordbytes) {
+					printf("lc4r: patch segment truncated\n");
+					return c4r;
 				}
+				c4r_apply_patches(code, (char *)data, patches, loop_target);
 				if (c4r_verbose)
 					printf("lc4r: 100%% patched\n");
+				// Superinstructions must be applied after patching
+				if (options & C4ROPT_FUSE) {
+					i = c4r_fuse(code, header[C4R_HDR_CODELEN]);
+					if (c4r_verbose) printf("lc4r: fused %d instruction sequences\n", i);
+				}
 				c4r[C4R_PATCHES] = (int)patches;
 				if (c4r_debug) printf("lc4r: loaded patches, now at position 0x%x\n", c4r_readoffset);
 
 				// Constructors
 				if (c4r_verbose) printf("lc4r: load constructors and destructors...\n");
-				read(fd, buffer, 1);
+				c4r_checked_read(fd, buffer, 1);
 				if (*buffer != 'c') {
 					printf("lc4r: expected constructors segment, found 0x%x\n", *buffer);
 					return c4r;
 				}
-				target = constructors; i = 0; // Constructors
-				while (i++ < header[C4R_HDR_CONSTRUCTLEN]) {
-					// read(fd, buffer, wordbytes); target[C4R_CNDE_Priority] = *(int *)buffer;
-					read(fd, buffer, wordbytes); target[C4R_CNDE_Value]    = *(int *)buffer;
-					// printf("cnde_value=%d\n", target[C4R_CNDE_Value]);
-					target = target + C4R_CNDE__Sz;
+				if (c4r_read_cnde(fd, constructors, header[C4R_HDR_CONSTRUCTLEN])) {
+					printf("lc4r: constructors segment truncated\n");
+					return c4r;
 				}
 				c4r[C4R_CONSTRUCTORS] = (int)constructors;
 				if (c4r_debug) printf("lc4r: loaded constructors, now at position 0x%x\n", c4r_readoffset);
 				// Destructors
-				read(fd, buffer, 1);
+				c4r_checked_read(fd, buffer, 1);
 				if (*buffer != 'd') {
 					if (c4r_debug) printf("lc4r: expected constructors segment, found 0x%x\n", *buffer);
 					return c4r;
 				}
-				target = destructors; i = 0;
-				while (i++ < header[C4R_HDR_DESTRUCTLEN]) {
-					// read(fd, buffer, wordbytes); target[C4R_CNDE_Priority] = *(int *)buffer;
-					read(fd, buffer, wordbytes); target[C4R_CNDE_Value]    = *(int *)buffer;
-					target = target + C4R_CNDE__Sz;
+				if (c4r_read_cnde(fd, destructors, header[C4R_HDR_DESTRUCTLEN])) {
+					printf("lc4r: destructors segment truncated\n");
+					return c4r;
 				}
 				c4r[C4R_DESTRUCTORS] = (int)destructors;
 				if (c4r_debug) printf("lc4r: loaded destructors, now at position 0x%x\n", c4r_readoffset);
 
 				// Symbols
 				if (options & C4ROPT_SYMBOLS) {
-					read(fd, buffer, 1); if (*buffer != 'S') { printf("lc4r: expected symbols segment, found 0x%x\n", *buffer); return c4r; }
 					target = symbols; i = 0; loop_target = header[C4R_HDR_SYMBOLSLEN];
 					if (c4r_verbose) printf("lc4r: loading %d symbols...\n", loop_target);
+					// The segment runs to the end of the file and is read in one go,
+					// guessing at an average name length to size the buffer.
+					if (!(rest = c4r_read_rest(fd, 1 + loop_target * (5 * wordbytes + 1 + 16), &size))) {
+						printf("lc4r: failed to read symbols segment\n");
+						return c4r;
+					}
+					if (!size || *rest != 'S') { printf("lc4r: expected symbols segment, found 0x%x\n", size ? *rest : 0); free(rest); return c4r; }
+					// Names are copied into one block, each with a nul terminator
+					if (!(names = malloc(size + loop_target))) {
+						printf("lc4r: failed to allocate %d bytes for symbol names\n", size + loop_target);
+						free(rest);
+						return c4r;
+					}
+					c4r[C4R_STRINGS] = (int)names;
+					tmp = rest + 1; end = rest + size;
 					while (i < loop_target) {
-						read(fd, buffer, wordbytes); target[C4R_SYMB_ID] = *(int *)buffer;
-						read(fd, buffer, wordbytes); target[C4R_SYMB_TYPE] = *(int *)buffer;
-						read(fd, buffer, wordbytes); target[C4R_SYMB_CLASS]= *(int *)buffer;
-						read(fd, buffer, wordbytes); target[C4R_SYMB_ATTRS] = *(int *)buffer;
-						read(fd, buffer, 1); target[C4R_SYMB_NAMELEN] = *buffer;
-						memset(buffer, 0, C4R_BUFFER_SIZE); // TODO: write nul terminator
-						read(fd, buffer, target[C4R_SYMB_NAMELEN]); target[C4R_SYMB_NAME] = (int)c4r_strcpy_alloc(buffer);
-						read(fd, buffer, wordbytes); target[C4R_SYMB_VALUE] = *(int *)buffer;
-						//read(fd, buffer, wordbytes); target[C4R_SYMB_LENGTH] = *(int *)buffer;
+						if (tmp + 4 * wordbytes + 1 > end ||
+						    tmp + 5 * wordbytes + 1 + (tmp[4 * wordbytes] & 0xFF) > end) {
+							printf("lc4r: symbols segment truncated at symbol %d\n", i);
+							free(rest);
+							return c4r;
+						}
+						target[C4R_SYMB_ID]      = *(int *)tmp; tmp = tmp + wordbytes;
+						target[C4R_SYMB_TYPE]    = *(int *)tmp; tmp = tmp + wordbytes;
+						target[C4R_SYMB_CLASS]   = *(int *)tmp; tmp = tmp + wordbytes;
+						target[C4R_SYMB_ATTRS]   = *(int *)tmp; tmp = tmp + wordbytes;
+						target[C4R_SYMB_NAMELEN] = len = *tmp++ & 0xFF;
+						memcpy(names, tmp, len); names[len] = 0; tmp = tmp + len;
+						target[C4R_SYMB_NAME]    = (int)names; names = names + len + 1;
+						target[C4R_SYMB_VALUE]   = *(int *)tmp; tmp = tmp + wordbytes;
 						if (c4r_debug) {
-							printf("Symbol %d @ 0x%lX:\n  Type: %d\n", i, c4r_readoffset, target[C4R_SYMB_TYPE]);
+							printf("Symbol %d @ 0x%lX:\n  Type: %d\n", i, tmp - rest, target[C4R_SYMB_TYPE]);
 							printf("  Class: %d", target[C4R_SYMB_CLASS]);
 							printf("  Name len: %d", target[C4R_SYMB_NAMELEN]);
 							printf("  Name: '%s'", (char *)target[C4R_SYMB_NAME]);
 							printf("  Value: %d\n", target[C4R_SYMB_VALUE]);
-							//printf("  Length: %d\n", target[C4R_SYMB_LENGTH]);
 						}
 
 						++i;
 						target = target + C4R_SYMB__Sz;
 					}
+					free(rest);
 					if (c4r_debug) printf("lc4r: loaded %d symbols, now at position 0x%x\n", i, c4r_readoffset);
 				}
 				c4r[C4R_SYMBOLS] = (int)symbols;
@@ -473,10 +598,45 @@ int *c4r_load (char *file) {
 	return c4r_load_opt(file, C4ROPT_SYMBOLS);
 }
 
+// Checksum of the first limit bytes of a file, or all of it if limit is 0,
+// used to notice a rebuilt module since there is no way to stat a file from c4.
+// Reads whole blocks of 4096 bytes. Returns 0 if the file cannot be read.
+int c4r_file_checksum (char *file, int limit) {
+	int fd, n, len, sum, *w;
+	char *buffer;
+
+	if (!(buffer = malloc(4096))) return 0;
+	if ((fd = open(file, 0)) < 0) {
+		free(buffer);
+		return 0;
+	}
+	sum = 17; len = 0;
+	while ((!limit || len < limit) && (n = c4r_checked_read(fd, buffer, 4096)) > 0) {
+		len = len + n;
+		// Zero the partial word at the end of the last block
+		memset(buffer + n, 0, 4096 - n);
+		w = (int *)buffer;
+		n = (n + sizeof(int) - 1) / sizeof(int);
+		while (n--) sum = sum * 31 + *w++;
+	}
+	close(fd);
+	free(buffer);
+	sum = sum * 31 + len;
+	if (!sum) sum = 1;
+	return sum;
+}
+
 // Free all elements of a C4R module
 void c4r_free (int *c4r) {
 	int i, *s, *h, *d;
 
+	// Instances only own their code and data
+	if (c4r[C4R_IMAGE]) {
+		if (c4r[C4R_CODE]) free((int *)c4r[C4R_CODE]);
+		if (c4r[C4R_DATA]) free((char *)c4r[C4R_DATA]);
+		free(c4r);
+		return;
+	}
 	// First all the simple items
 	if (c4r[C4R_CODE]) {
 		if (c4r_debug) printf("lc4r: freeing code @ 0x%X\n", c4r[C4R_CODE]);
@@ -502,6 +662,12 @@ void c4r_free (int *c4r) {
 		i = 0;
 		d = (int *)c4r[C4R_SYMBOLS];
 		if (c4r_debug) printf("Freeing %d symbols\n", h[C4R_HDR_SYMBOLSLEN]);
+		// Names are either in one block or allocated individually
+		if (c4r[C4R_STRINGS]) {
+			free((char *)c4r[C4R_STRINGS]);
+			c4r[C4R_STRINGS] = 0;
+			i = h[C4R_HDR_SYMBOLSLEN];
+		}
 		while (i++ < h[C4R_HDR_SYMBOLSLEN]) {
 			if (d[C4R_SYMB_NAME]) {
 				free((char *)d[C4R_SYMB_NAME]);
@@ -521,6 +687,40 @@ void c4r_free (int *c4r) {
 	free(c4r);
 }
 
+// Create a runnable copy of a loaded module without touching the file.
+// The instance gets its own code and data segments, copied from the image and
+// patched for their new addresses. The header, patches, symbols, constructors
+// and destructors are borrowed from the image, which must outlive the
+// instance. Free with c4r_free as usual.
+int *c4r_instance (int *image) {
+	int *c4r, *header, *code, *data, i;
+
+	if (!image[C4R_LOADCOMPLETE]) return 0;
+	header = (int *)image[C4R_HEADER];
+	if (!(c4r = malloc((i = sizeof(int) * C4R__Sz))))
+		return 0;
+	memcpy(c4r, image, i);
+	c4r[C4R_IMAGE] = (int)image;
+	c4r[C4R_CODE] = c4r[C4R_DATA] = 0;
+	if (!(code = malloc((i = sizeof(int) * header[C4R_HDR_CODELEN])))) {
+		free(c4r);
+		return 0;
+	}
+	memcpy(code, (int *)image[C4R_CODE], i);
+	c4r[C4R_CODE] = (int)code;
+	data = 0;
+	if ((i = header[C4R_HDR_DATALEN])) {
+		if (!(data = malloc(i))) {
+			c4r_free(c4r);
+			return 0;
+		}
+		memcpy(data, (char *)image[C4R_DATA], i);
+		c4r[C4R_DATA] = (int)data;
+	}
+	c4r_apply_patches(code, (char *)data, (int *)image[C4R_PATCHES], header[C4R_HDR_PATCHLEN]);
+	return c4r;
+}
+
 void c4r_dump_patches (int *c4r) {
 	int *header, *patch, i, max;
 
@@ -616,6 +816,27 @@ void c4r_print_stacktrace (int *c4r, int *alt, int *pc) {
 	}
 }
 
+// Find the function containing pc, using symbols loaded with C4ROPT_SYMBOLS.
+// @return the function's symbol, or 0 if pc is outside the code or no symbols were loaded
+int *c4r_find_function (int *c4r, int *pc) {
+	int *hdr, *code, *sym, *best, i, offset;
+
+	hdr = (int *)c4r[C4R_HEADER];
+	code = (int *)c4r[C4R_CODE];
+	if (!(sym = (int *)c4r[C4R_SYMBOLS]) || pc < code || pc >= code + hdr[C4R_HDR_CODELEN])
+		return 0;
+	offset = pc - code;
+	best = 0;
+	i = hdr[C4R_HDR_SYMBOLSLEN];
+	while (i--) {
+		if (sym[C4R_SYMB_CLASS] == C4R_SCLASS_Fun && sym[C4R_SYMB_VALUE] <= offset &&
+		    (!best || sym[C4R_SYMB_VALUE] > best[C4R_SYMB_VALUE]))
+			best = sym;
+		sym = sym + C4R_SYMB__Sz;
+	}
+	return best;
+}
+
 //
 // Public interface
 //
@@ -705,16 +926,19 @@ static char *strcpycat (char *source, char *append) {
 	return buffer;
 }
 
+// Options used by loadc4r_run in addition to C4ROPT_SYMBOLS
+static int loadc4r_options;
+
 int loadc4r_run (char *file, int argc, char **argv) {
 	int *module, *modules, result;
 	char *alt_file;
 
 	alt_file = 0;
 
-	if (!(module = c4r_load(file))) {
+	if (!(module = c4r_load_opt(file, C4ROPT_SYMBOLS | loadc4r_options))) {
 		// Attempt a version with .c4r appended
 		alt_file = strcpycat(file, ".c4r");
-		if (!(module = c4r_load(alt_file))) {
+		if (!(module = c4r_load_opt(alt_file, C4ROPT_SYMBOLS | loadc4r_options))) {
 			printf("lc4r: unable to open '%s' or '%s'\n", file, alt_file);
 			free(alt_file);
 			return 1;
@@ -743,7 +967,7 @@ enum {
 };
 
 void loadc4r_usage () {
-    printf("Load C4R usage: ./c4m load-c4r.c [-v] [-d] [--] [file.c4r]\n");
+    printf("Load C4R usage: ./c4m load-c4r.c [-v] [-d] [-f] [--] [file.c4r]\n");
 }
 
 #ifndef NO_LOADC4R_MAIN
@@ -765,6 +989,8 @@ int main (int argc, char **argv) {
 				c4r_debug = !c4r_debug;
 			else if (n == 'v')
 				c4r_verbose = !c4r_verbose;
+			else if (n == 'f')
+				loadc4r_options = loadc4r_options | C4ROPT_FUSE;
 			else {
 				printf("load-c4r: unrecognised option: '%s'\n", *argv);
 				exit(-1);
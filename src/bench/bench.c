@@ -16,6 +16,7 @@ enum {
 	BENCH_PI_ALL = 0xF,
 	BENCH_FACTORIAL = 0x10,
 	BENCH_FACTORIAL_RECURSE = 0x20,
+	BENCH_SYSCALL = 0x40,
 	BENCH_ALL = 0xFF
 };
 
@@ -115,6 +116,14 @@ int bench_pi100 () { return nth_digit_of_pi(100); }
 int bench_pi1000 () { return nth_digit_of_pi(1000); }
 int bench_pi_all () { bench_pi10(); bench_pi100(); bench_pi1000(); return 0; }
 
+// Kernel call round trip, C4KE only
+int bench_syscall () {
+	int n;
+	n = 100;
+	while (n--) kern_task_current_id();
+	return 0;
+}
+
 int bench_all () {
 	benchfunc_factorial(10);
 	benchfunc_factorial_recursive(10);
@@ -183,6 +192,7 @@ void show_help (char *argv0) {
 	       "                     pi100   100th digit of pi\n"
 	       "                     pi1000  1000th digit of pi\n"
 	       "                     pi      Run all pi benchmarks\n"
+	       "                     syscall 100 kernel calls (C4KE only)\n"
 	       "                     all     Run all benchmarks\n"
 	       "       -n            No delay, do not settle clock between benchmarks\n"
 	       "       -d            Display debug information\n"
@@ -244,6 +254,7 @@ int parseArgs (int argc, char **argv) {
 					else if (!strcmp(*_argv, "pi100")) config_bench = BENCH_PI100;
 					else if (!strcmp(*_argv, "pi1000")) config_bench = BENCH_PI1000;
 					else if (!strcmp(*_argv, "pi")) config_bench = BENCH_PI_ALL;
+					else if (!strcmp(*_argv, "syscall")) config_bench = BENCH_SYSCALL;
 					else if (!strcmp(*_argv, "all")) config_bench = BENCH_ALL;
 					else {
 						printf("%s: option '-b' requires a valid benchmark, '%s' is not valid.\n", argv[0], *_argv);
@@ -418,6 +429,13 @@ int main (int argc, char **argv) {
 	else if (config_bench == BENCH_PI1000) bench_function = (int *)&bench_pi1000;
 	else if (config_bench == BENCH_PI_ALL) bench_function = (int *)&bench_pi_all;
 	else if (config_bench == BENCH_ALL)    bench_function = (int *)&bench_all;
+	else if (config_bench == BENCH_SYSCALL) {
+		if (!(__c4_info() & C4I_C4KE)) {
+			printf("%s: syscall benchmark requires C4KE\n", argv[0]);
+			return EXIT_BADOPTION;
+		}
+		bench_function = (int *)&bench_syscall;
+	}
 	else {
 		printf("Invalid benchmark function\n");
 		return 1;
@@ -59,6 +59,9 @@ int  *c4cc_emithandlers; // Instruction emit handlers (see EH_*)
 int *e, *le,  // current position in emitted code
     *id,      // currently parsed identifier
     *sym,     // symbol table (simple list of identifiers)
+    *symend,  // next free symbol table entry
+    *symhash, // open addressed index of sym entries, by identifier hash
+    symmask,  // symhash size - 1
     tk,       // current token
     ival,     // current token value
     ty,       // current expression type
@@ -446,6 +449,7 @@ void die (int exit_code) {
 void next()
 {
   char *pp;
+  int hs;
 
   while (tk = *p) {
     ++p;
@@ -467,11 +471,13 @@ void next()
       while ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')
         tk = tk * 147 + *p++;
       tk = (tk << 6) + (p - pp);
-      id = sym;
-      while (id[Tk]) {
+      hs = ((tk >> 6) * 40503) & symmask;
+      while ((id = (int *)symhash[hs])) {
         if (tk == id[Hash] && !memcmp((char *)id[Name], pp, p - pp)) { tk = id[Tk]; return; }
-        id = id + Idsz;
+        hs = (hs + 1) & symmask;
       }
+      symhash[hs] = (int)(id = symend);
+      symend = symend + Idsz;
       id[Name] = (int)pp;
       id[Hash] = tk;
       tk = id[Tk] = Id;
@@ -1126,11 +1132,15 @@ int c4cc_init () {
 
   poolsz = 512 * 1024;
   if (!(sym = _sym = malloc(poolsz))) { printf("could not malloc(%d) symbol area\n", poolsz); return -1; }
+  if (!(symhash = malloc(poolsz))) { printf("could not malloc(%d) symbol index\n", poolsz); return -1; }
   if (!(le = e = _e = malloc(poolsz))) { printf("could not malloc(%d) text area\n", poolsz); return -1; }
   if (!(data = _data = malloc(poolsz))) { printf("could not malloc(%d) data area\n", poolsz); return -1; }
   if (!(_sp = malloc(poolsz))) { printf("could not malloc(%d) stack area\n", poolsz); return -1; }
 
   memset(sym,  0, poolsz);
+  memset(symhash, 0, poolsz);
+  symmask = poolsz / sizeof(int) - 1; // more slots than sym has entries
+  symend = sym;
   memset(e,    0, poolsz);
   memset(data, 0, poolsz);
 
@@ -1156,6 +1166,7 @@ void c4cc_cleanup () {
   free(c4cc_emithandlers);
   free(_p);
   free(_sym);
+  free(symhash);
   free(_e);
   free(_data);
   free(_sp);
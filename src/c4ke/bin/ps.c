@@ -57,7 +57,7 @@ enum { __PS_RECALC_COLUMN_FREQUENCY = 2 }; // Only update columns every n displa
 int __ps_recalc_column_counter;
 
 static int *__ps_tasks, *__ps_cols, *__ps_kti;
-static int __ps_tasks_max, __ps_cols_max;
+static int __ps_tasks_max;
 static int __ps_interval_time;
 
 static int __ps_silent; // suppress output?
@@ -90,6 +90,32 @@ static void print_int_readable (int n) {
 	}
 }
 
+// Make room for count tasks, keeping what is there for the interval figures.
+// Column widths have an extra first row for the widest of each.
+// @return 0 on success
+static int ps_grow (int count) {
+	int *t, *c, i;
+
+	if (!(t = malloc((i = count * TASK__Sz * sizeof(int)))))
+		return -1;
+	memset(t, 0, i);
+	if (!(c = malloc((i = (count + 1) * COL__Sz * sizeof(int))))) {
+		free(t);
+		return -1;
+	}
+	memset(c, 0, i);
+	if (__ps_tasks) {
+		memcpy(t, __ps_tasks, __ps_tasks_max * TASK__Sz * sizeof(int));
+		memcpy(c, __ps_cols, (__ps_tasks_max + 1) * COL__Sz * sizeof(int));
+		free(__ps_tasks);
+		free(__ps_cols);
+	}
+	__ps_tasks = t;
+	__ps_cols = c;
+	__ps_tasks_max = count;
+	return 0;
+}
+
 void ps () {
 	int *t, i, l, c, x;
 	char *s;
@@ -103,7 +129,12 @@ void ps () {
 	int tasks_loaded, tasks_running, tasks_waiting, tasks_zombie, tasks_free;
 
 	time_refresh = __time();
-	kern_tasks_export_update(__ps_kti);
+	// The export moves when the task table grows
+	__ps_kti = kern_tasks_export_update(__ps_kti);
+	if (__ps_kti[KTI_COUNT] > __ps_tasks_max && ps_grow(__ps_kti[KTI_COUNT])) {
+		printf("ps: memory allocation failure\n");
+		return;
+	}
 	// TODO: why do we need a + 1 here?
 	//       without it we miss printing a process, but not sure why
 	tasks_loaded = task_count = __ps_kti[KTI_USED] + 1;
@@ -350,32 +381,21 @@ void ps () {
 }
 
 int ps_init () {
-	int i;
-
 	if (!(__ps_kti = kern_tasks_export())) {
         printf("ps: failed to export tasks\n");
         return -1;
     }
 
-	__ps_tasks_max = __ps_kti[KTI_COUNT];
-	__ps_cols_max  = 32;
 	c4_plain = __c4_info() & C4I_C4;
 
-	// TODO: memory corruption?
-	if (!(__ps_tasks = malloc((i = __ps_tasks_max * TASK__Sz * sizeof(int) * 2)))) {
+	__ps_tasks = __ps_cols = 0;
+	__ps_tasks_max = 0;
+	if (ps_grow(__ps_kti[KTI_COUNT])) {
 		//printf("ps: memory allocation failure\n");
 		return -1;
 	}
-	// printf("ps: allocated %d bytes for tasks\n", i);
-	memset(__ps_tasks, 0, i);
-	if (!(__ps_cols = malloc((i = __ps_cols_max * COL__Sz * (sizeof(int) * 4))))) {
-		//printf("ps: malloc for columns failed\n");
-		return -1;
-	}
-	// printf("ps: allocated %d bytes for cols\n", i);
-	memset(__ps_cols, 0, i);
 	__ps_interval_time = 0;
-    // printf("ps: tasks max=%ld, cols max=%ld, kti = 0x%lx\n", __ps_tasks_max, __ps_cols_max, __ps_kti);
+    // printf("ps: tasks max=%ld, kti = 0x%lx\n", __ps_tasks_max, __ps_kti);
 
 	// Set static column sizes (these never change)
 	__ps_cols[COL_STATE] = 1;
@@ -25,6 +25,7 @@
 // This kernel has some optional extras if compiled with them:
 //  - c4ke_ipc.c  - InterProcess Communication
 //  - c4ke_plus.c - Support for advanced features of c4plus
+//  - c4ke_ring.c - Shared ring buffers for bulk data between tasks
 //
 // See u0.c for the user mode interface to the kernel. u0.c is used for most programs compiled to
 // run under C4KE.
@@ -54,8 +55,8 @@
 //
 // This means that tasks cannot exit by themselves, as their stack is still
 // being used at the point of call to exit() or returning from main.
-// Instead, the idle task (task_idle) cleans up tasks that have finished, as
-// their stack is no longer active.
+// Instead, a finished task is cleaned up on the next trap or interrupt after
+// the switch away from it, once its stack is no longer active.
 //
 // Programs are compiled to .c4r files, the "C4 Relocatable" executable.
 // These executables are not interpreted, merely loaded and called directly
@@ -101,8 +102,6 @@
 //   -> can use tasks c4r structure, then fall back to loaded modules (TODO) or
 //      using the kernels (TODO)
 // Not doing:
-// - Load balance: use a percentage of the cycle interrupt interval based on number
-//   of used process slots.
 // - Find cause of random segfault. Sometimes the kernel will crash, especially
 //   under high load (eg, 100 processes running.)
 //   - is c4m trap overwriting currently pushed arguments? it must be, as top is causing a crash
@@ -110,7 +109,12 @@
 //   - TRAP_SEGV and TRAP_OPV were added to try to narrow down the cause of the crash.
 //     -> c4m has specific checks that slow down execution to provide these additional traps.
 //     -> Sometimes the segfault happens outside of these checks and the kernel crashes.
+//     -> c4m -b (safe mode) checks loads and stores against all memory in use,
+//        raising TRAP_SEGV before the access instead.
 //   - OpenRISC 1000: segfaulting due to bad argc value (several million!)
+//   - Found one cause: a cycle interrupt landing between critical_path_end() and
+//     the handler's TLEV saved the old task's registers into the new task.
+//     c4m now holds interrupts for a few cycles after they are re-enabled.
 //   - The best the kernel can do right now is terminate the faulting process, but
 //     stack traces would help narrow down where the issue is.
 // - Implement relative functions as a kernel module provided set of extended
@@ -142,18 +146,52 @@
 ///
 /// Feel free to play around with the values in this enum
 enum {                         // Main configuration section
-	KERN_TASK_COUNT = 128,     // Fixed count until updated to use linked list
+	KERN_TASK_CHUNK = 128,     // The task table grows by this many tasks at a time,
+	KERN_TASK_MAX = 8192,      // up to this many. Must be a multiple of KERN_TASK_CHUNK
+	KERN_PID_BUCKETS = 1024,   // Size of the pid lookup table, must be a power of 2
 	TASK_STACK_SIZE = 0x1000,  // How much stack memory to allocate to tasks.
-	SIGNAL_MAX = 64,           // How many signals are supported
+	TASK_STACK_MIN  = 0x400,   // Limits for stack sizes requested per task
+	TASK_STACK_MAX  = 0x100000,
+	SIGNAL_MAX = 64,           // How many signals are supported, one bit each in TASK_SIGPENDING
 	// Minimum acceptable cycles between cycle-based interrupt.
 	// Values below this may crash the kernel.
 	// 900 seems to crash fairly consistently, 901 only sometimes.
 	KERNEL_CYCLES_MIN = 1000,
 	// Maximum pre-emptive interrupts per second to aim for.
 	IH_MAX_CYCLES_PER_SECOND = 10,
+	// The cycle interrupt interval is retuned at runtime, see kernel_retune.
+	// It shrinks so that a ready focus task waits at most this long for the
+	// others ahead of it (needs speed measurement),
+	KERNEL_FOCUS_LATENCY_MS = 50,
+	// but not so far that ih_cycle takes more than this percentage of cycles.
+	KERNEL_SWITCH_OVERHEAD_PCT = 2,
 	KERNEL_EXTENSIONS_MAX = 32,
+	KERNEL_EXT_OPCODES_MAX = 32, // Opcodes extensions can add, see kext_opcode
+	// How many different .c4r modules can be shared between running tasks
+	KERNEL_MODULE_CACHE_MAX = 32,
+	// Bytes read from a module file to tell whether a cached image is current.
+	// This covers the header with every segment length and the start of the code.
+	KERNEL_MODULE_KEY_BYTES = 4096,
+	// Scheduling priority levels. TASK_NICE_BASE selects the level, and a task
+	// at level n gets roughly 1/(n + 1) the time of one at level 0.
+	KERNEL_PRIO_LEVELS = 21,
+	// How many messages can be queued for a task before send_message fails
+	KERNEL_MBOX_SIZE = 32,
+	// Exit codes kept for a task's finished children that it has not awaited.
+	// Past this the oldest is dropped, so a parent that never awaits stays bounded.
+	KERNEL_EXITED_MAX = 64,
+	// Traps read the wall clock at most once per this many cycles, and on task
+	// switches. Cycles are always charged exactly. 0 reads it on every trap.
+	KERNEL_TIME_SAMPLE_CYCLES = 10000,
+	// Freed task memory kept for reuse, in bytes per size class. Larger
+	// blocks are never kept. See kernel_pool_alloc
+	KERNEL_POOL_KEEP = 0x40000,
 	// Give tasks 10 seconds to comply with SIGTERM during shutdown
 	KERNEL_FINISH_WAIT_TIME = 10000,
+	// Profiling (-p): addresses counted per task, a power of 2, and the least
+	// number of cycle interrupts per second, each of which takes a sample.
+	KERNEL_PROF_SLOTS = 256,
+	KERNEL_PROF_HZ = 100,
 };
 
 ///
@@ -173,7 +211,7 @@ enum {
 // These settings control how long we measure performance for during boot.
 enum { KERNEL_MEASURE_QUICK = 200, KERNEL_MEASURE_SLOW = 1000 };
 enum { KERNEL_TFACTOR_QUICK =   5, KERNEL_TFACTOR_SLOW =    1 };
-enum { KERNEL_IDLE_SLEEP_TIME = 10000 }; // used with usleep, so in microseconds
+enum { KERNEL_IDLE_SLEEP_MAX = 1000 }; // longest idle sleep in ms when no timer is due
 
 // Details for managing the opcode to function vector
 enum { CO_BASE = 128, CO_MAX = 128 };
@@ -185,6 +223,7 @@ enum {
 	START_NOSTACK,   // Unable to allocate stack
 	START_NOSIG,     // Unable to allocate signal handlers
 	START_ARGV,      // Failed to allocate argv
+	START_NONAME,    // Failed to allocate the task name
 };
 
 // At some stage this will be a symbol available under c4m
@@ -206,7 +245,10 @@ enum {
 };
 
 // Configure codes, for use with CSYS/__c4_configure
-enum { C4KE_CONF_CYCLE_INTERRUPT_INTERVAL, C4KE_CONF_CYCLE_INTERRUPT_HANDLER };
+enum { C4KE_CONF_CYCLE_INTERRUPT_INTERVAL, C4KE_CONF_CYCLE_INTERRUPT_HANDLER, C4KE_CONF_PRIVS, C4KE_CONF_FAST_OPCODES,
+       C4KE_CONF_NATIVE_OPCODE };
+// Request given to C4KE_CONF_NATIVE_OPCODE
+enum { NATIVE_REQ_NAME, NATIVE_REQ_OPCODE, NATIVE_REQ_CONTEXT, NATIVE_REQ__Sz };
 
 static char *VERSION() { return "0.66"; }
 
@@ -233,6 +275,7 @@ enum {
 	WSTATE_TIME,     // Waiting for a time target. WAITARG is target timestamp
 	WSTATE_PID,      // Waiting for a process to terminate. WAITARG is the pid.
 	WSTATE_MESSAGE,  // Waiting for a message. WAITARG is the "give up" timestamp
+	WSTATE_EXT,      // Waiting on a kernel extension, which wakes the task itself
 };
 
 // Task structure
@@ -241,8 +284,16 @@ enum {
 	// less array lookup if it is at the start of the array.
 	TASK_STATE,       // int, see STATE_
 	TASK_ID,          // int, task id
-	TASK_NICE,        // int, priority counter
-	TASK_NICE_BASE,   // int, priority base level
+	TASK_SLOT,        // int, index in the task table, kept when cleaned
+	TASK_PID_NEXT,    // struct TASK*, next task in the same pid bucket
+	TASK_GEN,         // int, generation of the last exported change, see kernel_task_changed
+	TASK_CHANGED_NEXT,// struct TASK*, next (older) and previous tasks in the changed list
+	TASK_CHANGED_PREV,// struct TASK*
+	TASK_NICE_BASE,   // int, priority level, see kernel_task_level
+	TASK_RQ,          // int, run queue the task is linked into plus one, or 0
+	TASK_RQ_NEXT,     // int *, next task in the same run queue
+	TASK_RQ_PREV,     // int *, previous task in the same run queue
+	TASK_TIMER,       // int, index in kernel_timers plus one, or 0
 	TASK_PARENT,      // int, parent task id
 	TASK_WAITSTATE,   // int, see WSTATE_
 	TASK_WAITARG,     // int, depends on WSTATE_
@@ -266,21 +317,56 @@ enum {
 	TASK_TRAPS,       // int, how many traps the task has caused
 	TASK_C4R,         // int *, ptr to C4R structure
 	TASK_SIGHANDLERS, // int *, ptr to SIGH_ structure
-	TASK_SIGPENDING,  // int, number of pending signals total
-	TASK_MBOX,        // int *, see MBOX_
-	TASK_MBOX_SZ,     // int,
-	TASK_MBOX_COUNT,  // int,
+	TASK_SIGPENDING,  // int, bitmask of pending signals, bit n for signal n
+	TASK_MBOX,        // int *, ring buffer of MBOX_ entries, allocated on first delivery
+	TASK_MBOX_SZ,     // int, capacity of TASK_MBOX in entries
+	TASK_MBOX_COUNT,  // int, messages waiting
+	TASK_MBOX_HEAD,   // int, index of the oldest message
 	TASK_EXCLUSIVE,   // int,
+	TASK_WAITERS,     // struct TASK*, first task in await_pid on this one
+	TASK_WAIT_ON,     // struct TASK*, task this one is in await_pid on
+	TASK_WAIT_NEXT,   // struct TASK*, next and previous tasks waiting on the same task
+	TASK_WAIT_PREV,   // struct TASK*
 	TASK_EXTDATA,     // int *, task extension data
+	TASK_EXITED,      // int *, EXIT_ records of finished children not yet awaited, newest first
+	TASK_EXITED_COUNT,// int, records in TASK_EXITED, at most KERNEL_EXITED_MAX
 	TASK__Sz          // task structure size
 };
 
+// Mailbox entry, see kernel_mbox_put
+enum {
+	MBOX_SENDER,      // int, pid of the sender
+	MBOX_SIZE,        // int, size of the payload in bytes
+	MBOX_DATA,        // char *, malloc'd payload, owned by the kernel while queued
+	MBOX__Sz
+};
+
+// Exit record of a finished child, kept on its parent until the parent awaits
+// it or is cleaned up. See kernel_exit_record
+enum {
+	EXIT_PID,         // int, pid of the finished task
+	EXIT_CODE,        // int, its exit code
+	EXIT_NEXT,        // int *, next record on the same parent
+	EXIT__Sz
+};
+
+// Received message, filled in by OP_RECEIVE_MESSAGE - keep up to date with u0.h
+enum {
+	MSG_SENDER,
+	MSG_SIZE,
+	MSG_DATA,
+	MSG__Sz
+};
+
 // Kernel task information, the superstructure for kernel task information
 // returned via kern_tasks_export() in u0.c
 enum {
 	KTI_COUNT,
 	KTI_USED,
 	KTI_LIST,  // see KTE_*
+	KTI_GEN,   // task generation the list is up to date with
+	KTI_OWNER, // task id that requested the export
+	KTI_NEXT,  // next export, see kernel_exports
 	KTI__Sz
 };
 
@@ -301,12 +387,32 @@ enum {
 	KTE__Sz
 };
 
-// Custom opcodes
-// TODO: Move to a syscall interface instead of string based opcode lookup.
-//       All of these are checked via memcmp in request_symbol()
+// Kernel profile element, returned via kern_task_profile() in u0.c - keep up to date with u0.c
+enum {
+	KPE_COUNT,       // int, samples
+	KPE_ADDRESS,     // int *, function entry, or the sampled address without symbols
+	KPE_NAME,        // char *, function name, or 0 without symbols
+	KPE_NAMELEN,     // int
+	KPE__Sz
+};
+
+// Task profile, kept in TASK_EXTDATA with -p. See kernel_prof_sample
+enum {
+	KPROF_SAMPLES,   // int, samples taken
+	KPROF_LOST,      // int, samples not counted because the table was full
+	KPROF_TABLE      // KERNEL_PROF_SLOTS address and count pairs follow
+};
+
+// Custom opcodes, which double as syscall numbers.
+// u0.h compiles these numbers in and uses them directly when the kernel reports
+// the same C4KE_ABI_VERSION, otherwise it looks each one up by name through
+// request_symbol(). Only add new opcodes at the end (before
+// OP_EXTENSIONS_START), and bump C4KE_ABI_VERSION whenever numbers are added or
+// changed, so that a newer u0 never issues a number an older kernel lacks.
 // TODO: These could be global ints instead, and offset when detecting we're running
 //       within C4KE already. That way multiple kernels could run at once. At the moment,
 //       each child kernel disables the parent kernel.
+enum { C4KE_ABI_VERSION = 3 };
 enum {
 	// Request a symbols opcode
 	// (char *symbol) -> integer value of requested symbol
@@ -317,8 +423,8 @@ enum {
 	// Switch task manually
 	// () -> success (1) or no task to switch to (0)
 	OP_SCHEDULE,
-	// Wait for a message or timeout
-	// (int timeout) -> 0 TODO: only timeout is implemented, messages not
+	// Wait for a message or timeout, without taking it
+	// (int timeout) -> number of messages waiting
 	OP_AWAIT_MESSAGE,
 	// Wait for a process to exit
 	// (int pid)     -> pid exit code
@@ -365,8 +471,9 @@ enum {
 	// Request a task listing. Returns a KTI_* struct.
 	// () -> int *
 	OP_KERN_TASKS_EXPORT,
-	// Update a task listing with the latest data from the kernel.
-	// (int *kti) -> void
+	// Update a task listing with the latest data from the kernel. The listing
+	// is moved when the task table has grown, use the one returned.
+	// (int *kti) -> int *
 	OP_KERN_TASKS_EXPORT_UPDATE,
 	// Release a task listing and all data
 	OP_KERN_TASKS_EXPORT_FREE,
@@ -398,11 +505,25 @@ enum {
 	// Debugging functions to disable/enable the cycle based interrupt
 	OP_KERN_REQUEST_EXCLUSIVE,
 	OP_KERN_RELEASE_EXCLUSIVE,
+	// Send a malloc'd payload to a task's mailbox, handing over ownership
+	// (int pid, int size, char *data) -> 0, or -1 no such task, -2 mailbox full
+	OP_SEND_MESSAGE,
+	// Take the oldest message, waiting up to timeout ms for one to arrive
+	// (int *msg, int timeout) -> 1 msg filled in (see MSG_), 0 timed out
+	OP_RECEIVE_MESSAGE,
+	// As OP_USER_START_C4R, with a stack size for the new task
+	// (int argc, char **argv, char *name, int privileges, int stack_size) -> pid
+	OP_USER_START_C4R_STACK,
+	// Hottest functions of a task, when profiling with -p. See KPE_
+	// (int pid, int *out, int max) -> elements filled, most samples first, or -1
+	OP_KERN_TASK_PROFILE,
 	OP_EXTENSIONS_START,       // Not used directly, kernel extensions will start from this
 	                           // number when registering opcodes.
 };
 
 static int request_symbol (char *symbol) {
+	// Checked first, u0 programs built against this ABI request nothing else
+	if (!memcmp(symbol, "C4KE_ABI_VERSION", 16)) return C4KE_ABI_VERSION;
 	if (!memcmp(symbol, "OP_HALT", 7)) return OP_HALT;
 	if (!memcmp(symbol, "OP_TIME", 7)) return OP_TIME;
 	if (!memcmp(symbol, "OP_C4INFO", 9)) return OP_C4INFO;
@@ -419,14 +540,18 @@ static int request_symbol (char *symbol) {
 	if (!memcmp(symbol, "OP_USER_SIGNAL", 14)) return OP_USER_SIGNAL;
 	if (!memcmp(symbol, "OP_TASK_FINISH", 14)) return OP_TASK_FINISH;
 	if (!memcmp(symbol, "OP_USER_PARENT", 14)) return OP_USER_PARENT;
+	if (!memcmp(symbol, "OP_SEND_MESSAGE", 15)) return OP_SEND_MESSAGE;
 	if (!memcmp(symbol, "OP_AWAIT_MESSAGE", 16)) return OP_AWAIT_MESSAGE;
 	if (!memcmp(symbol, "OP_REQUEST_SYMBOL", 17)) return OP_REQUEST_SYMBOL;
+	if (!memcmp(symbol, "OP_USER_START_C4R_STACK", 23)) return OP_USER_START_C4R_STACK;
 	if (!memcmp(symbol, "OP_USER_START_C4R", 17)) return OP_USER_START_C4R;
+	if (!memcmp(symbol, "OP_RECEIVE_MESSAGE", 18)) return OP_RECEIVE_MESSAGE;
 	if (!memcmp(symbol, "OP_KERN_TASKS_MAX", 17)) return OP_KERN_TASKS_MAX;
 	if (!memcmp(symbol, "OP_KERN_TASK_COUNT", 18)) return OP_KERN_TASK_COUNT;
 	if (!memcmp(symbol, "OP_DEBUG_PRINTSTACK", 19)) return OP_DEBUG_PRINTSTACK;
 	if (!memcmp(symbol, "OP_DEBUG_KERNELSTATE", 20)) return OP_DEBUG_KERNELSTATE;
 	if (!memcmp(symbol, "OP_KERN_TASK_RUNNING", 20)) return OP_KERN_TASK_RUNNING;
+	if (!memcmp(symbol, "OP_KERN_TASK_PROFILE", 20)) return OP_KERN_TASK_PROFILE;
 	if (!memcmp(symbol, "OP_KERN_TASKS_RUNNING", 21)) return OP_KERN_TASKS_RUNNING;
 	if (!memcmp(symbol, "OP_KERN_TASK_CURRENT_ID", 23)) return OP_KERN_TASK_CURRENT_ID;
 	//if (!memcmp(symbol, "OP_KERN_PRINT_TASK_STATE", 24)) return OP_KERN_PRINT_TASK_STATE;
@@ -472,7 +597,7 @@ static void print_c4_info () {
 ///
 // Signal handlers structure
 enum {
-	SIGH_PENDING,      //
+	SIGH_PENDING,      // Queued count, realtime signals only
 	SIGH_BLOCKED,
 	SIGH_ADDRESS,      // C4 code address of handler
 	SIGH__Sz
@@ -540,6 +665,7 @@ enum {
 	KEXT_INIT,         // int *, ptr to init function if any
 	KEXT_START,        // int *, ptr to start (called just before tasks execute) if any
 	KEXT_SHUTDOWN,     // int *, ptr to shutdown function if any
+	KEXT_TASK_CLEAN,   // int *, ptr to function called with each task being cleaned, see kext_task_clean
 	KEXT__Sz
 };
 
@@ -550,6 +676,17 @@ enum {
 	KXS_ERROR = 0x2       // Error during init
 };
 
+// Module cache entry, see kernel_module_acquire
+enum {
+	MODC_PATH,         // char *, file the image was loaded from
+	MODC_MODE,         // int, C4ROPT_* used to load, or -1 once stale
+	MODC_IMAGE,        // int *, loaded C4R structure that instances copy from
+	MODC_REFS,         // int, instances currently in use
+	MODC_SUM,          // int, c4r_file_checksum of the file's first KERNEL_MODULE_KEY_BYTES when loaded
+	MODC_USED,         // int, kernel_module_clock when last acquired or released
+	MODC__Sz
+};
+
 // Kernel extension callback function return values
 enum {
 	KXERR_NONE = 0,    // No error
@@ -559,15 +696,26 @@ enum {
 ///
 // Kernel main data
 ///
-static int *kernel_tasks;            // struct TASK*
+static int *kernel_tasks;            // struct TASK*, the first chunk, starting with the kernel task
+static int *kernel_task_chunks;      // struct TASK* per KERN_TASK_CHUNK slots, see kernel_task_grow
+static int  kernel_task_slots;       // slots allocated so far
+static int *kernel_free_slots;       // stack of free slot numbers
+static int  kernel_free_count;
+static int *kernel_pid_hash;         // struct TASK* chains by pid, see kernel_task_find_pid
+static int *kernel_changed_head;     // struct TASK*, most recently changed first, see kernel_task_changed
+static int  kernel_task_gen;         // generation of the last change
+static int *kernel_exports;          // struct KTI*, live task exports, see kern_tasks_export_update
+static int *kernel_retired_names;    // names still shared with exports, see kernel_name_retire
 static int *kernel_task_current;     // struct TASK*
 static int *kernel_task_idle;        // struct TASK*
 static int  kernel_task_id_counter;
 static int  kernel_max_slot;
 static int  kernel_task_extdata_size;// For TASK_EXTDATA member of TASK
+static int  kernel_profiling;        // -p, sample tasks in ih_cycle
+static int  kernel_prof_extdata;     // offset of the task profile in TASK_EXTDATA
 static int *kernel_task_focus; // Interactive focus, hacky
 static int  kernel_verbosity;
-static int  kernel_loadc4r_mode; // defaults to not loading symbols unless -g is given
+static int  kernel_loadc4r_mode; // defaults to superinstructions and no symbols, see -g and -F
 static int  kernel_shutdown;
 static char*kernel_init,
            *kernel_default_init;
@@ -580,11 +728,22 @@ static int  kernel_start_time;
 static int  kernel_schedule_time;
 static int  kernel_shutdown_time;
 static int *kernel_extensions, kernel_ext_count, kernel_ext_errno;
+static int *kernel_ext_opcodes, kernel_ext_opcode_count; // name and handler pairs, see kext_opcode
 static int  kernel_ext_initialized;
+static int *kernel_modules;          // struct MODC*, see kernel_module_acquire
+static int  kernel_module_clock;     // counts module acquires and releases
+// Run queues, see kernel_rq_insert. Each array has a slot per priority level.
+static int *kernel_rq_head, *kernel_rq_tail, *kernel_rq_pass;
+static int  kernel_rq_mask;          // bit n set when level n has ready tasks
+static int  kernel_rq_vtime;         // pass of the level last picked
+static int  kernel_rq_count;         // tasks in the run queues, including idle
+static int *kernel_timers;           // struct TASK* min-heap, see kernel_timer_add
+static int  kernel_timer_count;
 // Testing modes
 static int enable_measurement; // perform speed measurement at startup
 static int enable_test_tasks;  // launch internal test tasks
 static int kernel_cycles_count, kernel_cycles_base;
+static int kernel_switch_cost; // cycles spent in ih_cycle, moving average * 8
 static int kernel_cycles_force;
 
 // Track task counts
@@ -598,8 +757,10 @@ static int old_ih_cycle_interval, *old_ih_cycle_handler;
 // And signal handlers
 static int *old_sig_int;//, *old_sig_segv;
 static int *custom_opcodes;
+// Fast opcode table given to c4m, indexed by opcode (CO_BASE + CO_MAX entries)
+static int *fast_opcodes, *old_fast_opcodes;
+static int *kernel_native_context;   // see kernel_native_setup
 static int start_errno; // see START_*
-static int kernel_task_find_iterator;
 // TODO: removed
 //static int kernel_hlt_count; // Tracks tasks call to halt, except for the idle task
 static int last_trap_handler;
@@ -608,6 +769,8 @@ static char *readable_int_table;
 static int   readable_int_max;
 static int kernel_last_cycle;
 static int kernel_last_time;
+static int kernel_time_sample; // see KERNEL_TIME_SAMPLE_CYCLES
+static int kernel_time_cycle;  // kernel_last_cycle when the clock was last read
 // Initialized to the C4m opcode for TLEV in main(), used only in process_trap.
 static int opcode_TLEV;
 static int opcode_PSH;
@@ -618,8 +781,32 @@ static int  critical_path_value;
 // Utility functions
 ///
 
-static int _strlen (char *s) { char *t; t = s; while(*t) ++t; return t - s; }
-static int _strcmp (char *s1, char *s2) { while(*s1 && (*s1 == *s2)) { ++s1; ++s2; } return *s1 - *s2; }
+// Native string intrinsics provided by c4m, or 0 to use the loops below.
+// Set at startup by kernel_intrinsics_init.
+static int kernel_op_strlen, kernel_op_strcmp, kernel_op_strcpy;
+
+static int kernel_intrinsic (char *name) { int op; return (op = __builtin(name)) > 0 ? op : 0; }
+static void kernel_intrinsics_init () {
+	kernel_op_strlen = kernel_intrinsic("strlen");
+	kernel_op_strcmp = kernel_intrinsic("strcmp");
+	kernel_op_strcpy = kernel_intrinsic("strcpy");
+}
+
+static int _strlen (char *s) {
+	char *t;
+	if (kernel_op_strlen) return __c4_opcode(s, kernel_op_strlen);
+	t = s; while(*t) ++t; return t - s;
+}
+static int _strcmp (char *s1, char *s2) {
+	if (kernel_op_strcmp) return __c4_opcode(s2, s1, kernel_op_strcmp);
+	while(*s1 && (*s1 == *s2)) { ++s1; ++s2; } return *s1 - *s2;
+}
+// @return dest
+static char *_strcpy (char *dest, char *src) {
+	char *d;
+	if (kernel_op_strcpy) return (char *)__c4_opcode(src, dest, kernel_op_strcpy);
+	d = dest; while ((*d++ = *src++)) ; return dest;
+}
 static int _atoi (char *str, int radix) {
 	int v, sign;
 
@@ -686,27 +873,83 @@ static void print_time_readable (int ms) {
 
 // strcpy with allocation
 static char *k_strcpy_alloc (char *source) {
-	int len, *s;
-	char *dest, *t;
+	char *dest;
 	//if (source == 0) return 0; // allow nuls
 	if (source == 0) {
 		printf("c4ke: k_strcpy_alloc - source is null\n");
 		source = "(k_strcpy_alloc)";
 	}
-	// Find length
-	len = 0; t = source;
-	while (*t++) ++len;
-	// Allocate buffer
-	if (!(dest = malloc(len + 1))) {
+	if (!(dest = malloc(_strlen(source) + 1))) {
 		printf("c4ke: memory allocation failure in k_strcpy_alloc\n");
 		return 0;
 	}
-	// Copy
-	t = dest;
-	while (*source)
-		*dest++ = *source++;
-	*dest++ = 0;
-	return t;
+	return _strcpy(dest, source);
+}
+
+//
+// Task memory pool
+//
+// Per-task allocations (stacks, signal handlers, argv, names and extension
+// data) are made in power of two size classes. Freed blocks are kept on a
+// free list per class, so that short lived tasks can be started and cleaned
+// without calling malloc or free. The word before each block holds its class.
+enum {
+	POOL_CLASS_MIN = 4,  // 16 bytes
+	POOL_CLASSES   = 24, // blocks larger than 8MB are never kept
+};
+static int *kernel_pool_free;  // per class, first free block, linked through word 0
+static int *kernel_pool_count; // per class, blocks on the free list
+static int  kernel_pool_hits, kernel_pool_misses;
+
+static int *kernel_pool_alloc (int size) {
+	int c, *b;
+	c = POOL_CLASS_MIN;
+	while ((1 << c) < size) ++c;
+	if (c < POOL_CLASSES && (b = (int *)kernel_pool_free[c])) {
+		kernel_pool_free[c] = *b;
+		--kernel_pool_count[c];
+		++kernel_pool_hits;
+		return b;
+	}
+	++kernel_pool_misses;
+	if (!(b = malloc(sizeof(int) + (1 << c))))
+		return 0;
+	*b = c;
+	return b + 1;
+}
+
+static void kernel_pool_release (int *p) {
+	int c;
+	if (!p) return;
+	c = p[-1];
+	// Keep at most KERNEL_POOL_KEEP bytes of any class
+	if (c < POOL_CLASSES && ((kernel_pool_count[c] + 1) << c) <= KERNEL_POOL_KEEP) {
+		*p = kernel_pool_free[c];
+		kernel_pool_free[c] = (int)p;
+		++kernel_pool_count[c];
+	} else {
+		free(p - 1);
+	}
+}
+
+// Return all kept blocks to the system allocator
+static void kernel_pool_drain () {
+	int c, *b;
+	c = 0;
+	while (c < POOL_CLASSES) {
+		while ((b = (int *)kernel_pool_free[c])) {
+			kernel_pool_free[c] = *b;
+			free(b - 1);
+		}
+		kernel_pool_count[c++] = 0;
+	}
+}
+
+static char *kernel_pool_strcpy (char *source) {
+	char *dest;
+	if ((dest = (char *)kernel_pool_alloc(_strlen(source) + 1)))
+		_strcpy(dest, source);
+	return dest;
 }
 
 // Print the readable form of a task state
@@ -734,22 +977,6 @@ static void kernel_print_task (int *t) {
 	//	printf("\n  Exit code: %d\n", t[TASK_EXIT_CODE]);
 }
 
-// TODO: load balancing removed
-enum { MAX_BALANCE_RANGE = 2 };
-//static void kernel_load_balance () {
-//	// Multiply kernel_cycles_base based on number of loaded tasks
-//	int new_cycles;
-//	// doesn't play well on slow systems
-//	return;
-//
-//	new_cycles = kernel_cycles_base + (kernel_cycles_base * (MAX_BALANCE_RANGE * (100 - ((kernel_tasks_loaded - kernel_tasks_waiting) * 100 / KERN_TASK_COUNT * 100) / 100) / 100));
-//	if (new_cycles != kernel_cycles_count) {
-//		if (kernel_verbosity >= VERB_MED)
-//			printf("c4ke: load balance adjusting cycles to %ld\n", new_cycles);
-//		__c4_configure(C4KE_CONF_CYCLE_INTERRUPT_INTERVAL, (kernel_cycles_count = new_cycles));
-//	}
-//}
-
 // Cycle count helper
 static int cycles_difference () {
 	int c, d;
@@ -850,6 +1077,10 @@ static void critical_path_start () {
 	//++critical_path_value;
 	//printf("c4ke: critical path value now at %d\n", critical_path_value);
 }
+// Re-enabling the interrupt holds it in c4m for IRQ_SHADOW_CYCLES (8), and
+// one that comes due meanwhile is delivered after. A trap handler calling
+// this must reach its TLEV within that many instructions, currently at most
+// 5, so keep the code after it short.
 static void critical_path_end() {
 	//if (critical_path_value && !--critical_path_value) {
 		__c4_configure(C4KE_CONF_CYCLE_INTERRUPT_INTERVAL, kernel_cycles_count);
@@ -870,17 +1101,33 @@ static int time_difference () {
 	return d;
 }
 
+// As time_difference(), but only reads the clock once kernel_time_sample
+// cycles have passed since the last read. Call after cycles_difference().
+static int time_difference_sampled () {
+	if (kernel_last_cycle - kernel_time_cycle < kernel_time_sample)
+		return 0;
+	kernel_time_cycle = kernel_last_cycle;
+	return time_difference();
+}
+
+// Read the clock now, charging the time since the last read to the current
+// task. Used on task switches and wherever kernel_last_time must be current.
+static void current_task_time_sync () {
+	kernel_time_cycle = kernel_last_cycle;
+	kernel_task_current[TASK_TIMEMS] = kernel_task_current[TASK_TIMEMS] + time_difference();
+}
+
 // Update the current task's timekeeping details.
 static void current_task_timekeeping () {
 	kernel_task_current[TASK_CYCLES] = kernel_task_current[TASK_CYCLES] + cycles_difference();
-	kernel_task_current[TASK_TIMEMS] = kernel_task_current[TASK_TIMEMS] + time_difference();
+	kernel_task_current[TASK_TIMEMS] = kernel_task_current[TASK_TIMEMS] + time_difference_sampled();
 	++kernel_task_current[TASK_TRAPS];
 }
 
 // Update the kernel tasks' timekeeping details.
 static void kernel_task_timekeeping () {
 	kernel_tasks[TASK_CYCLES] = kernel_tasks[TASK_CYCLES] + cycles_difference();
-	kernel_tasks[TASK_TIMEMS] = kernel_tasks[TASK_TIMEMS] + time_difference();
+	kernel_tasks[TASK_TIMEMS] = kernel_tasks[TASK_TIMEMS] + time_difference_sampled();
 }
 
 static void trap_enter() {
@@ -907,186 +1154,709 @@ int schedule () {
 	return __c4_opcode(OP_SCHEDULE);
 }
 
-// TODO: make me a macro!
+///
+// Run queues
+///
+// Tasks that can run are kept in a FIFO per priority level, linked through
+// TASK_RQ_NEXT and TASK_RQ_PREV. Tasks waiting with a deadline (WSTATE_TIME
+// and WSTATE_MESSAGE) are kept in the timer heap instead. Tasks only move
+// between them when their state changes, so finding the next task to run
+// does not depend on how many tasks there are.
+
+// Priority level a task is queued at.
+static int kernel_task_level (int *task) {
+	int n;
+	if ((n = task[TASK_NICE_BASE]) < 0) return 0;
+	if (n >= KERNEL_PRIO_LEVELS) return KERNEL_PRIO_LEVELS - 1;
+	return n;
+}
+
+// Add a task to the back (or front) of run queue q.
+static void kernel_rq_insert (int *task, int q, int front) {
+	int *t;
+	if (!(t = (int *)kernel_rq_head[q])) {
+		// Level becomes ready. Don't let it catch up on time it did not want.
+		if (kernel_rq_pass[q] < kernel_rq_vtime)
+			kernel_rq_pass[q] = kernel_rq_vtime;
+		kernel_rq_mask = kernel_rq_mask | (1 << q);
+		task[TASK_RQ_NEXT] = task[TASK_RQ_PREV] = 0;
+		kernel_rq_head[q] = kernel_rq_tail[q] = (int)task;
+	} else if (front) {
+		task[TASK_RQ_PREV] = 0;
+		task[TASK_RQ_NEXT] = (int)t;
+		t[TASK_RQ_PREV] = (int)task;
+		kernel_rq_head[q] = (int)task;
+	} else {
+		t = (int *)kernel_rq_tail[q];
+		task[TASK_RQ_NEXT] = 0;
+		task[TASK_RQ_PREV] = (int)t;
+		t[TASK_RQ_NEXT] = (int)task;
+		kernel_rq_tail[q] = (int)task;
+	}
+	task[TASK_RQ] = q + 1;
+	++kernel_rq_count;
+}
+
+// Remove a task from whichever run queue it is in, if any.
+static void kernel_rq_remove (int *task) {
+	int q, *p, *n;
+	if (!(q = task[TASK_RQ])) return;
+	--q;
+	p = (int *)task[TASK_RQ_PREV];
+	n = (int *)task[TASK_RQ_NEXT];
+	if (p) p[TASK_RQ_NEXT] = (int)n;
+	else kernel_rq_head[q] = (int)n;
+	if (n) n[TASK_RQ_PREV] = (int)p;
+	else kernel_rq_tail[q] = (int)p;
+	if (!kernel_rq_head[q])
+		kernel_rq_mask = kernel_rq_mask & ~(1 << q);
+	task[TASK_RQ] = task[TASK_RQ_NEXT] = task[TASK_RQ_PREV] = 0;
+	--kernel_rq_count;
+}
+
+// Record that a task changed in a way kern_tasks_export shows. The task
+// moves to the head of the changed list with a new generation, keeping
+// the list ordered newest first with each task on it once.
+static void kernel_task_changed (int *task) {
+	int *n, *p;
+	task[TASK_GEN] = ++kernel_task_gen;
+	if (task == kernel_changed_head)
+		return;
+	n = (int *)task[TASK_CHANGED_NEXT];
+	if ((p = (int *)task[TASK_CHANGED_PREV]))
+		p[TASK_CHANGED_NEXT] = (int)n;
+	if (n)
+		n[TASK_CHANGED_PREV] = (int)p;
+	task[TASK_CHANGED_PREV] = 0;
+	if ((task[TASK_CHANGED_NEXT] = (int)kernel_changed_head))
+		kernel_changed_head[TASK_CHANGED_PREV] = (int)task;
+	kernel_changed_head = task;
+}
+
+// Queue a task at its priority level if it is able to run.
+static void kernel_task_ready (int *task, int front) {
+	int s;
+	kernel_rq_remove(task);
+	if ((s = task[TASK_STATE]) && !(s & (STATE_WAITING | STATE_ZOMBIE)))
+		kernel_rq_insert(task, kernel_task_level(task), front);
+}
+
+// Change the priority level of a task, requeueing it if needed.
+static void kernel_task_renice (int *task, int nice) {
+	task[TASK_NICE_BASE] = nice;
+	kernel_task_changed(task);
+	if (task[TASK_RQ])
+		kernel_task_ready(task, 0);
+}
+
+// Timers are a binary min-heap of tasks ordered by TASK_WAITARG, which is the
+// deadline for WSTATE_TIME and WSTATE_MESSAGE waits. The root is the next task
+// due, which kernel_task_find wakes and task_idle sleeps until.
+static void kernel_timer_set (int i, int *task) {
+	kernel_timers[i] = (int)task;
+	task[TASK_TIMER] = i + 1;
+}
+
+static void kernel_timer_up (int i) {
+	int *t, *pt, p, wa;
+	t = (int *)kernel_timers[i];
+	wa = t[TASK_WAITARG];
+	while (i > 0 && (pt = (int *)kernel_timers[p = (i - 1) / 2])[TASK_WAITARG] > wa) {
+		kernel_timer_set(i, pt);
+		i = p;
+	}
+	kernel_timer_set(i, t);
+}
+
+static void kernel_timer_down (int i) {
+	int *t, *ct, c, wa, done;
+	t = (int *)kernel_timers[i];
+	wa = t[TASK_WAITARG];
+	done = 0;
+	while (!done && (c = i * 2 + 1) < kernel_timer_count) {
+		ct = (int *)kernel_timers[c];
+		if (c + 1 < kernel_timer_count && ((int *)kernel_timers[c + 1])[TASK_WAITARG] < ct[TASK_WAITARG])
+			ct = (int *)kernel_timers[++c];
+		if (ct[TASK_WAITARG] < wa) {
+			kernel_timer_set(i, ct);
+			i = c;
+		} else done = 1;
+	}
+	kernel_timer_set(i, t);
+}
+
+static void kernel_timer_add (int *task) {
+	kernel_timer_set(kernel_timer_count, task);
+	kernel_timer_up(kernel_timer_count++);
+}
+
+static void kernel_timer_remove (int *task) {
+	int i, *last;
+	if (!(i = task[TASK_TIMER])) return;
+	task[TASK_TIMER] = 0;
+	if (--i < --kernel_timer_count) {
+		// Fill the hole with the last timer
+		last = (int *)kernel_timers[kernel_timer_count];
+		kernel_timer_set(i, last);
+		kernel_timer_up(i);
+		kernel_timer_down(last[TASK_TIMER] - 1);
+	}
+}
+
+// Tasks in await_pid are listed on the task they wait for, so that
+// kernel_task_finish wakes exactly those.
+static void kernel_waiter_add (int *task, int *target) {
+	int *n;
+	task[TASK_WAIT_ON] = (int)target;
+	task[TASK_WAIT_PREV] = 0;
+	if ((n = (int *)(task[TASK_WAIT_NEXT] = target[TASK_WAITERS])))
+		n[TASK_WAIT_PREV] = (int)task;
+	target[TASK_WAITERS] = (int)task;
+}
+
+static void kernel_waiter_remove (int *task) {
+	int *on, *p, *n;
+	if (!(on = (int *)task[TASK_WAIT_ON])) return;
+	p = (int *)task[TASK_WAIT_PREV];
+	n = (int *)task[TASK_WAIT_NEXT];
+	if (p) p[TASK_WAIT_NEXT] = (int)n;
+	else on[TASK_WAITERS] = (int)n;
+	if (n) n[TASK_WAIT_PREV] = (int)p;
+	task[TASK_WAIT_ON] = task[TASK_WAIT_NEXT] = task[TASK_WAIT_PREV] = 0;
+}
+
+// Called once STATE_WAITING and the wait state are set on a task.
+static void kernel_task_wait (int *task) {
+	int ws;
+	kernel_rq_remove(task);
+	kernel_task_changed(task);
+	// WSTATE_PID waiters are listed by op_await_pid and woken by
+	// kernel_task_finish, and WSTATE_MESSAGE
+	// waiters with no timeout (WAITARG 0) by kernel_mbox_put.
+	if ((ws = task[TASK_WAITSTATE]) == WSTATE_TIME || (ws == WSTATE_MESSAGE && task[TASK_WAITARG]))
+		kernel_timer_add(task);
+}
+
+// Wake a waiting task. It goes to the front of its level so that it gets to
+// respond quickly.
 static void kernel_task_wake (int *task) {
-	// No checking done to see if task is valid
+	if (!(task[TASK_STATE] & STATE_WAITING))
+		return;
 	task[TASK_STATE] = task[TASK_STATE] & ~(STATE_WAITING);
 	--kernel_tasks_waiting;
+	kernel_task_changed(task);
     // TODO: this line causes more problems than its worth
 	// task[TASK_WAITSTATE] = task[TASK_WAITARG] = 0;
+	kernel_timer_remove(task);
+	kernel_waiter_remove(task);
+	kernel_task_ready(task, 1);
+}
+
+// Remove a task from the run queues, timers and waiter lists.
+static void kernel_task_unqueue (int *task) {
+	kernel_rq_remove(task);
+	kernel_timer_remove(task);
+	kernel_waiter_remove(task);
+	while (task[TASK_WAITERS])
+		kernel_waiter_remove((int *)task[TASK_WAITERS]);
 }
 
 static int kernel_is_task_running (int *task) {
 	return task[TASK_STATE] & STATE_RUNNING;
 }
 
-// Find a task to run.
-// Also handles certain wait states like sleeping.
-// This function is probably inefficient
-// TODO: re-enable find_mask if appropriate
-// TODO: the logic could be much simplified, but attempts to do so keep breaking task switching.
+// Find a task to run other than the current one.
+// Levels are picked by stride: the ready level that has been given the least
+// time runs next, and running a level at priority n costs it n + 1. Tasks
+// within a level take turns.
+// @return 0 if no other task is ready
 static int *kernel_task_find () {
-	int c, i, *t, ts, ws, wa, *result, ms, n, nb;
-	//int cycles;
-	int *backup_task, backup_task_nice, backup_task_iterator;
-	int  tsw;
-	i = kernel_task_find_iterator;
-	result = backup_task = (int *)(c = 0);
-	ms = kernel_max_slot + 1;
-	// cycles = __c4_cycles();
-	backup_task_nice = 100;
-	// backup_task_iterator = 0;
-
-	//while (!result && ++c < KERN_TASK_COUNT) {
-	//	i = (i + 1) % KERN_TASK_COUNT;
-	while (++c < ms) {
-		i = (i + 1) % ms;
-		t = kernel_tasks + (TASK__Sz * i);
-		//ts = t[TASK_STATE];
-		// printf("c4ke: check task 0x%lx, id %ld, state 0x%x\n", t, t[TASK_ID], t[TASK_STATE]);
-		// TASK_STATE is the first item in the structure
-		if (!(ts = *t) || ts & STATE_ZOMBIE) {
-			// Skip empty/zombie tasks
-		//} else
-		//} else if (t == kernel_task_current) {
-			// Skip current task
-		//} else if (ts & STATE_ZOMBIE) {
-			// Skip zombies
-		// } else if (ts & STATE_NOTRUN) {
-			// Skip ethereal and zombie tasks
-		//} else if (ts) { // & find_mask) {
-		//} else if ((tsw = ts & STATE_WAITING)) {
-		} else if (ts & STATE_WAITING) {
-			//ws = t[TASK_WAITSTATE];
-			wa = t[TASK_WAITARG];
-			if ((ws = t[TASK_WAITSTATE]) == WSTATE_TIME) {
-				// kernel_last_time will have been updated recently enough that we
-				// need not call __time() but use the last saved value.
-				if (kernel_last_time >= wa)
-					result = t;
-			}
-			else if (ws == WSTATE_MESSAGE) {
-				// Control returns to op_await_message
-				// TODO: message waiting only supports timeout, never delivers messages.
-				//if (t[TASK_MBOX_COUNT] > 0) {
-				//	printf("c4ke: have %d messages for pid %d\n", t[TASK_MBOX_COUNT], t[TASK_ID]);
-				//	result = t;
-				//} else
-				if (kernel_last_time >= wa) {
-					// printf("c4ke: message timeout for pid %d\n", t[TASK_ID]);
-					result = t;
-				}
-			}
-			// WSTATE_PID is not checked here, but in kernel_task_finish
-			if (result) {
-				kernel_task_find_iterator = i;
-				t[TASK_NICE] = t[TASK_NICE_BASE];
-				// Wake up
-				kernel_task_wake(t);
-				//if (c4_info & C4I_C4)
-				//	printf("c4ke: woke up task %d after %d cycles (crit path: %d)\n", t[TASK_ID], __c4_cycles() - cycles, critical_path_value);
-				return t;
-			}
-		// } else if (!tsw && n > 0) {
-		} else if ((n = t[TASK_NICE]) > 0) {
-			// TODO: this section feels wrong.
-			// Skip if nice counter not met,
-			// but allow if nothing else is found
-			if ((t[TASK_NICE] = --n) < backup_task_nice) {
-				backup_task = t;
-				backup_task_nice = n;
-				backup_task_iterator = i;
-			}
+	int *t, *cur, m, q, i, best;
+
+	// Wake tasks whose timer is due. Control returns to op_user_sleep or
+	// op_receive_message.
+	// Traps only sample the clock, so read it here where a switch may happen.
+	current_task_time_sync();
+	while (kernel_timer_count && kernel_last_time >= ((int *)*kernel_timers)[TASK_WAITARG])
+		kernel_task_wake((int *)*kernel_timers);
+
+	m = kernel_rq_mask;
+	cur = kernel_task_current;
+	if ((q = cur[TASK_RQ]) && kernel_rq_head[q - 1] == (int)cur) {
+		if (cur[TASK_RQ_NEXT]) {
+			// Let the rest of the level go first
+			kernel_rq_remove(cur);
+			kernel_rq_insert(cur, q - 1, 0);
 		} else {
-			// Satisfies all criteria
-			kernel_task_find_iterator = i;
-			t[TASK_NICE] = t[TASK_NICE_BASE];
-			// if (c4_info & C4I_C4)
-			//	printf("c4ke: activating task %d after %d cycles (crit path: %d)\n", t[TASK_ID], __c4_cycles() - cycles, critical_path_value);
-			return t;
+			// Alone at its level
+			m = m & ~(1 << (q - 1));
 		}
 	}
-	if (backup_task) {
-		kernel_task_find_iterator = backup_task_iterator;
-		backup_task[TASK_NICE] = backup_task[TASK_NICE_BASE];
-		// printf("c4ke: returning backup task in slot %i\n", backup_task_iterator);
-		return backup_task;
+	if (!m)
+		return 0;
+
+	best = -1;
+	i = 0;
+	while (m) {
+		if ((m & 1) && (best < 0 || kernel_rq_pass[i] < kernel_rq_pass[best]))
+			best = i;
+		m = m >> 1;
+		++i;
 	}
-	kernel_task_find_iterator = i; // ?i;
-	//if (c4_info & C4I_C4)
-	//	printf("c4ke: failed to find task to activate after %d cycles (crit path: %d)\n", __c4_cycles() - cycles, critical_path_value);
-	return 0;
+	kernel_rq_vtime = kernel_rq_pass[best];
+	kernel_rq_pass[best] = kernel_rq_vtime + best + 1;
+
+	// Move to the back of its level
+	t = (int *)kernel_rq_head[best];
+	if (t[TASK_RQ_NEXT]) {
+		kernel_rq_remove(t);
+		kernel_rq_insert(t, best, 0);
+	}
+	return t;
+}
+
+// Get the task in a slot.
+static int *kernel_task_at (int slot) {
+	return (int *)kernel_task_chunks[slot / KERN_TASK_CHUNK] + TASK__Sz * (slot % KERN_TASK_CHUNK);
+}
+
+// Add a chunk of free tasks to the task table. Tasks already in the table
+// stay where they are, so task pointers remain valid.
+// @return 0 on failure (table full or out of memory), 1 on success
+static int kernel_task_grow () {
+	int *c, i, sz;
+
+	if (kernel_task_slots >= KERN_TASK_MAX)
+		return 0;
+	if (!(c = malloc((sz = sizeof(int) * TASK__Sz * KERN_TASK_CHUNK))))
+		return 0;
+	memset(c, 0, sz);
+	kernel_task_chunks[kernel_task_slots / KERN_TASK_CHUNK] = (int)c;
+	// Push in reverse so the lowest slots are handed out first
+	i = KERN_TASK_CHUNK;
+	while (i--) {
+		c[TASK__Sz * i + TASK_SLOT] = kernel_task_slots + i;
+		kernel_free_slots[kernel_free_count++] = kernel_task_slots + i;
+	}
+	kernel_task_slots = kernel_task_slots + KERN_TASK_CHUNK;
+	kernel_tasks_unloaded = kernel_tasks_unloaded + KERN_TASK_CHUNK;
+	if (kernel_verbosity >= VERB_MAX)
+		printf("c4ke: task table grown to %d tasks\n", kernel_task_slots);
+	return 1;
 }
 
-// Find a free task slot and return it.
+// Find a free task slot and return it. The slot goes back on the free
+// stack when the task is cleaned.
 // Assumes already running in a critical path section.
 // @return 0 on failure (max tasks running), otherwise task address
 static int *kernel_task_find_free () {
-	int i, *t, loops_remain;
-	i = 0;
-	t = kernel_tasks;
-	loops_remain = KERN_TASK_COUNT;
-	while (loops_remain-- && i < KERN_TASK_COUNT) {
-		i = (i + 1) % KERN_TASK_COUNT;
-		t = kernel_tasks + (TASK__Sz * i);
-		if (t[TASK_STATE] == STATE_UNLOADED) {
-			// printf("c4ke: find_free found at 0x%lx\n", t);
-			return t;
-		}
-		//t = t + TASK__Sz;
-	}
+	if (!kernel_free_count && !kernel_task_grow())
+		return 0;
+	return kernel_task_at(kernel_free_slots[--kernel_free_count]);
+}
 
-	return 0;
+// Add a task to the pid lookup table once it has an id.
+static void kernel_pid_insert (int *task) {
+	int *bucket;
+	bucket = kernel_pid_hash + (task[TASK_ID] & (KERN_PID_BUCKETS - 1));
+	task[TASK_PID_NEXT] = *bucket;
+	*bucket = (int)task;
+}
+
+// Remove a task from the pid lookup table, if present.
+static void kernel_pid_remove (int *task) {
+	int *link;
+	link = kernel_pid_hash + (task[TASK_ID] & (KERN_PID_BUCKETS - 1));
+	while (*link && *link != (int)task)
+		link = (int *)*link + TASK_PID_NEXT;
+	if (*link)
+		*link = task[TASK_PID_NEXT];
+	task[TASK_PID_NEXT] = 0;
 }
 
 // Find a specific task id and return the task structure.
 // Assumes already running in a critical path section.
 // @return 0 on failure (not found), otherwise task address
 static int *kernel_task_find_pid (int pid) {
-	int *t, loops_remain;
+	int *t;
 
 	if (pid <= 0)
 		return 0;
 
-	t = kernel_tasks;
-	loops_remain = KERN_TASK_COUNT;
-	while (--loops_remain) {
-		if (t[TASK_ID] == pid) {
-			return t;
+	t = (int *)kernel_pid_hash[pid & (KERN_PID_BUCKETS - 1)];
+	while (t && t[TASK_ID] != pid)
+		t = (int *)t[TASK_PID_NEXT];
+
+	return t;
+}
+
+//
+// Module cache
+//
+// Tasks running the same .c4r file share one loaded image of it. Each task
+// runs an instance with its own code and data, copied from the image and
+// patched (see c4r_instance), so starting another copy of a program only
+// needs to checksum the file. c4 cannot stat files, so the checksum is what
+// tells a rebuilt module apart. Images stay cached once their last instance
+// is freed, and the least recently used unused image makes room for a new
+// one when the cache is full.
+//
+
+static void kernel_module_drop (int *m) {
+	c4r_free((int *)m[MODC_IMAGE]);
+	free((char *)m[MODC_PATH]);
+	memset(m, 0, sizeof(int) * MODC__Sz);
+}
+
+// Find a slot for a new image: a free one, or else the least recently used
+// image no task is running, which is dropped. Returns 0 if every image is in
+// use. Assumes already in critical path section.
+static int *kernel_module_slot () {
+	int *m, *lru, i;
+
+	m = kernel_modules; lru = 0; i = 0;
+	while (i++ < KERNEL_MODULE_CACHE_MAX) {
+		if (!m[MODC_IMAGE]) return m;
+		if (!m[MODC_REFS] && (!lru || m[MODC_USED] < lru[MODC_USED])) lru = m;
+		m = m + MODC__Sz;
+	}
+	if (lru) kernel_module_drop(lru);
+	return lru;
+}
+
+// Returns a module instance for file, or 0 if it could not be loaded.
+// Only the first KERNEL_MODULE_KEY_BYTES of the file are read to check a
+// cached image, so a rebuild that keeps every segment length and those bytes
+// the same is not noticed.
+static int *kernel_module_acquire (char *file) {
+	int *m, *slot, *image, *module, sum, i;
+
+	sum = c4r_file_checksum(file, KERNEL_MODULE_KEY_BYTES);
+
+	// Look for a loaded image
+	critical_path_start();
+	m = kernel_modules; image = 0; i = 0;
+	while (i++ < KERNEL_MODULE_CACHE_MAX) {
+		if (m[MODC_IMAGE] && m[MODC_MODE] == kernel_loadc4r_mode && !_strcmp((char *)m[MODC_PATH], file)) {
+			image = (int *)m[MODC_IMAGE];
+			i = KERNEL_MODULE_CACHE_MAX;
+		} else m = m + MODC__Sz;
+	}
+	if (image && (!sum || m[MODC_SUM] != sum)) {
+		// File has changed, stop handing out this image
+		m[MODC_MODE] = -1;
+		if (!m[MODC_REFS]) kernel_module_drop(m);
+		image = 0;
+	}
+	if (image) {
+		++m[MODC_REFS];
+		m[MODC_USED] = ++kernel_module_clock;
+	}
+	critical_path_end();
+
+	if (image) {
+		if ((module = c4r_instance(image)))
+			return module;
+		// Out of memory
+		critical_path_start();
+		if (!--m[MODC_REFS] && m[MODC_MODE] == -1) kernel_module_drop(m);
+		critical_path_end();
+		return 0;
+	}
+
+	if (!(image = c4r_load_opt(file, kernel_loadc4r_mode)))
+		return 0;
+	if (!image[C4R_LOADCOMPLETE] || !sum)
+		return image;
+	critical_path_start();
+	module = 0;
+	if ((slot = kernel_module_slot()) && (slot[MODC_PATH] = (int)c4r_strcpy_alloc(file))) {
+		slot[MODC_MODE]  = kernel_loadc4r_mode;
+		slot[MODC_IMAGE] = (int)image;
+		slot[MODC_REFS]  = 1;
+		slot[MODC_SUM]   = sum;
+		slot[MODC_USED]  = ++kernel_module_clock;
+		if (!(module = c4r_instance(image))) {
+			// Give the slot back but keep the image, which is run below
+			free((char *)slot[MODC_PATH]);
+			memset(slot, 0, sizeof(int) * MODC__Sz);
 		}
-		t = t + TASK__Sz;
 	}
+	critical_path_end();
+	// Cache full or out of memory: run the image itself, uncached
+	if (!module) return image;
+	return module;
+}
 
+// Free a module instance. Its image stays cached unless it is stale.
+// Assumes already in critical path section.
+static void kernel_module_release (int *module) {
+	int *image, *m, i;
+
+	image = (int *)module[C4R_IMAGE];
+	c4r_free(module);
+	if (!image) return;
+	m = kernel_modules; i = 0;
+	while (i++ < KERNEL_MODULE_CACHE_MAX) {
+		if (m[MODC_IMAGE] == (int)image) {
+			m[MODC_USED] = ++kernel_module_clock;
+			if (!--m[MODC_REFS] && m[MODC_MODE] == -1) kernel_module_drop(m);
+			return;
+		}
+		m = m + MODC__Sz;
+	}
+}
+
+// Drop every cached image, at shutdown.
+static void kernel_module_drop_all () {
+	int *m, i;
+
+	if (!(m = kernel_modules)) return;
+	i = 0;
+	while (i++ < KERNEL_MODULE_CACHE_MAX) {
+		if (m[MODC_IMAGE]) kernel_module_drop(m);
+		m = m + MODC__Sz;
+	}
+}
+
+///
+// Mailboxes
+///
+// Each task has a ring buffer of up to KERNEL_MBOX_SIZE messages, allocated
+// when the first message is delivered to it. A message is the sender's pid and
+// a malloc'd payload with its size. Payloads are handed over rather than
+// copied: the kernel owns a payload while it is queued, and the receiver frees
+// it once taken.
+
+// Queue a message for a task, waking it if it is waiting for one.
+// Assumes already in critical path section.
+// @return 0 on success, -2 if the mailbox is full or cannot be allocated
+static int kernel_mbox_put (int *task, int sender, int size, int data) {
+	int *m, *e;
+
+	if (!(m = (int *)task[TASK_MBOX])) {
+		if (!(m = malloc(sizeof(int) * MBOX__Sz * KERNEL_MBOX_SIZE)))
+			return -2;
+		task[TASK_MBOX] = (int)m;
+		task[TASK_MBOX_SZ] = KERNEL_MBOX_SIZE;
+		task[TASK_MBOX_COUNT] = task[TASK_MBOX_HEAD] = 0;
+	}
+	if (task[TASK_MBOX_COUNT] == task[TASK_MBOX_SZ])
+		return -2;
+	e = m + MBOX__Sz * ((task[TASK_MBOX_HEAD] + task[TASK_MBOX_COUNT]++) % task[TASK_MBOX_SZ]);
+	e[MBOX_SENDER] = sender;
+	e[MBOX_SIZE]   = size;
+	e[MBOX_DATA]   = data;
+	if ((task[TASK_STATE] & STATE_WAITING) && task[TASK_WAITSTATE] == WSTATE_MESSAGE)
+		kernel_task_wake(task);
 	return 0;
 }
 
+// Take the oldest message for a task into msg (see MSG_).
+// Assumes already in critical path section.
+// @return 1 if a message was taken, 0 if the mailbox is empty
+static int kernel_mbox_take (int *task, int *msg) {
+	int *e;
+
+	if (!task[TASK_MBOX_COUNT])
+		return 0;
+	e = (int *)task[TASK_MBOX] + MBOX__Sz * task[TASK_MBOX_HEAD];
+	task[TASK_MBOX_HEAD] = (task[TASK_MBOX_HEAD] + 1) % task[TASK_MBOX_SZ];
+	--task[TASK_MBOX_COUNT];
+	msg[MSG_SENDER] = e[MBOX_SENDER];
+	msg[MSG_SIZE]   = e[MBOX_SIZE];
+	msg[MSG_DATA]   = e[MBOX_DATA];
+	return 1;
+}
+
+// Free a task's mailbox and any payloads never received.
+static void kernel_mbox_free (int *task) {
+	int *m, i, n;
+
+	if (!(m = (int *)task[TASK_MBOX]))
+		return;
+	i = task[TASK_MBOX_HEAD];
+	n = task[TASK_MBOX_COUNT];
+	while (n--) {
+		free((char *)m[MBOX__Sz * i + MBOX_DATA]);
+		i = (i + 1) % task[TASK_MBOX_SZ];
+	}
+	free(m);
+	task[TASK_MBOX] = task[TASK_MBOX_COUNT] = 0;
+}
+
 // Clean up a task. Called by idle and the kernel shutdown routine.
 // Assumes already in critical path section.
+// Release a task name. Exports share task names instead of copying them,
+// so while any exist the name is kept until they have all been updated
+// past the change that dropped it. See kernel_names_sweep.
+static void kernel_name_retire (char *name) {
+	int *r;
+	if (!kernel_exports || !(r = kernel_pool_alloc(sizeof(int) * 3))) {
+		kernel_pool_release((int *)name);
+		return;
+	}
+	r[0] = (int)kernel_retired_names;
+	r[1] = kernel_task_gen;
+	r[2] = (int)name;
+	kernel_retired_names = r;
+}
+
+// Release the retired names that every export has been updated past.
+static void kernel_names_sweep () {
+	int *e, *r, *n, *link, min;
+
+	min = kernel_task_gen + 1;
+	e = kernel_exports;
+	while (e) {
+		if (e[KTI_GEN] < min)
+			min = e[KTI_GEN];
+		e = (int *)e[KTI_NEXT];
+	}
+	// Newest first, so everything after the first old enough entry goes too.
+	// The next pointer is word 0, so an entry is also the link to the next.
+	link = (int *)&kernel_retired_names;
+	while ((r = (int *)*link) && r[1] >= min)
+		link = r;
+	*link = 0;
+	while (r) {
+		n = (int *)*r;
+		kernel_pool_release((int *)r[2]);
+		kernel_pool_release(r);
+		r = n;
+	}
+}
+
+// Unlink an export from kernel_exports.
+static void kernel_export_unlink (int *kti) {
+	int *link;
+	link = (int *)&kernel_exports;
+	while (*link && *link != (int)kti)
+		link = (int *)*link + KTI_NEXT;
+	if (*link)
+		*link = kti[KTI_NEXT];
+}
+
+// Free exports left behind by a task that did not free them.
+static void kernel_exports_drop (int pid) {
+	int *e, *n;
+	e = kernel_exports;
+	while (e) {
+		n = (int *)e[KTI_NEXT];
+		if (e[KTI_OWNER] == pid) {
+			kernel_export_unlink(e);
+			free(e);
+		}
+		e = n;
+	}
+	kernel_names_sweep();
+}
+
+// Keep the exit code of a finishing task on its parent, for a later await_pid.
+// Drops the parent's oldest record once it has KERNEL_EXITED_MAX.
+static void kernel_exit_record (int *task) {
+	int *p, *x, *prev;
+	if (!task[TASK_PARENT] || !(p = kernel_task_find_pid(task[TASK_PARENT])) ||
+	    (*p & STATE_ZOMBIE))
+		return;
+	if (p[TASK_EXITED_COUNT] >= KERNEL_EXITED_MAX) {
+		prev = 0;
+		x = (int *)p[TASK_EXITED];
+		while (x[EXIT_NEXT]) {
+			prev = x;
+			x = (int *)x[EXIT_NEXT];
+		}
+		if (prev) prev[EXIT_NEXT] = 0;
+		else p[TASK_EXITED] = 0;
+		--p[TASK_EXITED_COUNT];
+	} else if (!(x = kernel_pool_alloc(sizeof(int) * EXIT__Sz)))
+		return;
+	x[EXIT_PID] = task[TASK_ID];
+	x[EXIT_CODE] = task[TASK_EXIT_CODE];
+	x[EXIT_NEXT] = p[TASK_EXITED];
+	p[TASK_EXITED] = (int)x;
+	++p[TASK_EXITED_COUNT];
+}
+
+// Take the exit record of pid from task, its parent.
+// @return 1 with *code set if found, 0 otherwise
+static int kernel_exit_take (int *task, int pid, int *code) {
+	int *x, *prev;
+	prev = 0;
+	x = (int *)task[TASK_EXITED];
+	while (x && x[EXIT_PID] != pid) {
+		prev = x;
+		x = (int *)x[EXIT_NEXT];
+	}
+	if (!x) return 0;
+	if (prev) prev[EXIT_NEXT] = x[EXIT_NEXT];
+	else task[TASK_EXITED] = x[EXIT_NEXT];
+	--task[TASK_EXITED_COUNT];
+	*code = x[EXIT_CODE];
+	kernel_pool_release(x);
+	return 1;
+}
+
+// Let extensions release what a task still holds, see kext_task_clean
+#define cb(x) ((int (*)(int *))cb)(x)
+static void kernel_ext_task_clean (int *t) {
+	int i, *kext, *cb;
+
+	kext = kernel_extensions;
+	i = 0;
+	while (i < kernel_ext_count) {
+		if (*kext == KXS_REGISTERED && (cb = (int *)kext[KEXT_TASK_CLEAN]))
+			cb(t);
+		kext = kext + KEXT__Sz;
+		++i;
+	}
+}
+#undef cb
+
 static void kernel_clean_task (int *t) {
-	int *p;
+	int *p, slot, next, prev;
 	// Free the data used by this process
 
-	if ((p = (int *)t[TASK_NAME])) {
-		if (t != kernel_tasks)
-			free((char *)p);
-	}
+	if (t[TASK_ID])
+		kernel_ext_task_clean(t);
+	if (t != kernel_tasks)
+		kernel_name_retire((char *)t[TASK_NAME]);
+	if (t[TASK_ID] && kernel_exports)
+		kernel_exports_drop(t[TASK_ID]);
 	// printf("c4ke: freeing task stack at 0x%lx\n", t[TASK_BASE]);
-	if ((p = (int *)t[TASK_BASE])) free(p);
+	kernel_pool_release((int *)t[TASK_BASE]);
 	if ((p = (int *)t[TASK_CODE])) free(p);
 	if ((p = (int *)t[TASK_DATA])) free(p);
-	if ((p = (int *)t[TASK_ARGV])) free(p);
-	if ((p = (int *)t[TASK_ARGV_DATA])) free((char *)p);
-	if ((p = (int *)t[TASK_SIGHANDLERS])) free(p);
-	if ((p = (int *)t[TASK_C4R])) c4r_free(p);
-	if ((p = (int *)t[TASK_EXTDATA])) free(p);
+	kernel_pool_release((int *)t[TASK_ARGV]);
+	kernel_pool_release((int *)t[TASK_ARGV_DATA]);
+	kernel_pool_release((int *)t[TASK_SIGHANDLERS]);
+	kernel_mbox_free(t);
+	if ((p = (int *)t[TASK_C4R])) kernel_module_release(p);
+	kernel_pool_release((int *)t[TASK_EXTDATA]);
+	while ((p = (int *)t[TASK_EXITED])) {
+		t[TASK_EXITED] = p[EXIT_NEXT];
+		kernel_pool_release(p);
+	}
 	// Mark as unused and clear other state.
+	kernel_task_unqueue(t);
+	if (t[TASK_ID])
+		kernel_pid_remove(t);
+	slot = t[TASK_SLOT];
+	next = t[TASK_CHANGED_NEXT];
+	prev = t[TASK_CHANGED_PREV];
 	memset(t, 0, sizeof(int) * TASK__Sz);
 	*t = STATE_UNLOADED;
+	t[TASK_SLOT] = slot;
+	t[TASK_CHANGED_NEXT] = next;
+	t[TASK_CHANGED_PREV] = prev;
+	kernel_task_changed(t);
+	if (t != kernel_tasks)
+		kernel_free_slots[kernel_free_count++] = slot;
 	//t[TASK_ID] = t[TASK_PARENT] = t[TASK_REG_A]  = t[TASK_REG_BP] =
 	//             t[TASK_REG_SP] = t[TASK_REG_PC] = t[TASK_ENTRY]  =
 	//             t[TASK_PRIVS]  = t[TASK_CYCLES] = t[TASK_TIMEMS] =
 	//             t[TASK_ENTRY]  = t[TASK_EXIT_CODE] = t[TASK_TRAPS] =
-	//             t[TASK_NICE]   = t[TASK_NICE_BASE] = t[TASK_CYCLES] =
+	//             t[TASK_NICE_BASE] = t[TASK_CYCLES] =
 	//             t[TASK_TIMEMS] = t[TASK_SIGPENDING] =
 	//             t[TASK_MBOX]   = t[TASK_MBOX_SZ] = t[TASK_MBOX_COUNT] =
 	//             t[TASK_WAITSTATE] = t[TASK_WAITARG] = t[TASK_EXCLUSIVE] =
@@ -1097,9 +1867,12 @@ static void kernel_clean_task (int *t) {
 static void currenttask_update_name (char *newname) {
 	char *p;
 	critical_path_start();
-	if ((p = (char *)kernel_task_current[TASK_NAME]) != 0)
-		free(p);
-	kernel_task_current[TASK_NAME] = (int)k_strcpy_alloc(newname);
+	if (!(p = kernel_pool_strcpy(newname))) {
+		critical_path_end();
+		return;
+	}
+	kernel_name_retire((char *)kernel_task_current[TASK_NAME]);
+	kernel_task_current[TASK_NAME] = (int)p;
 	kernel_task_current[TASK_NAMELEN] = _strlen(newname);
 	critical_path_end();
 }
@@ -1110,40 +1883,66 @@ static int *kernel_task_sighandler (int *task, int sig) {
 	return ((int *)task[TASK_SIGHANDLERS]) + (sig * SIGH__Sz);
 }
 
+// Index of the lowest set bit in a non-zero word.
+static int kernel_lowest_bit (int m) {
+	int n;
+	n = 0;
+	m = m & -m;
+	// Only one bit is left, so the sign extension of >> does no harm
+	if (!(m & 0xFFFFFFFF)) { n = n + 32; m = m >> 32; }
+	if (!(m & 0xFFFF)) { n = n + 16; m = m >> 16; }
+	if (!(m & 0xFF)) { n = n + 8; m = m >> 8; }
+	if (!(m & 0xF)) { n = n + 4; m = m >> 4; }
+	if (!(m & 0x3)) { n = n + 2; m = m >> 2; }
+	if (!(m & 0x1)) ++n;
+	return n;
+}
+
 // Before switching to a task, check if any signals are pending, and if so
 // cause a process trap before we switch to it.
 static void kernel_before_switch (int *task) {
-	int *sigh, i;
+	int *sigh, m, sig;
 
 	// TODO: need a SIGWAITING or something to tell if the process is already in a signal handler.
-	if (task[TASK_SIGPENDING]) {
-		sigh = kernel_task_sighandler(task, 0);
-		i = 0;
-		// Find lowest signal id
-		while (i < SIGNAL_MAX) {
-			if (sigh[SIGH_PENDING]) {
-				process_trap(task, TRAP_SIGNAL, i, (int *)sigh[SIGH_ADDRESS]);
-				// TODO: use process_trap_handler and forward the signal nicer
-				//process_trap2(task, TRAP_SIGNAL, i, (int *)&process_trap_handler, sigh(SIGH_ADDRESS), i);
-				--sigh[SIGH_PENDING];
-				--task[TASK_SIGPENDING];
-				// break loop
-				i = SIGNAL_MAX;
-			}
-			++i;
-			sigh = sigh + SIGH__Sz;
-		}
+	if ((m = task[TASK_SIGPENDING])) {
+		// Lowest signal id first
+		sig = kernel_lowest_bit(m);
+		sigh = kernel_task_sighandler(task, sig);
+		process_trap(task, TRAP_SIGNAL, sig, (int *)sigh[SIGH_ADDRESS]);
+		// TODO: use process_trap_handler and forward the signal nicer
+		//process_trap2(task, TRAP_SIGNAL, sig, (int *)&process_trap_handler, sigh(SIGH_ADDRESS), sig);
+		if (sig < SIGRTMIN || !--sigh[SIGH_PENDING])
+			task[TASK_SIGPENDING] = m & ~(1 << sig);
 	}
 }
 
 static int internal_task_slot (int *task) {
-	return (task - kernel_tasks) / TASK__Sz;
+	return task[TASK_SLOT];
+}
+
+// The last finished task, cleaned by kernel_task_reap
+static int *kernel_task_dead;
+
+// Clean the last finished task once it is no longer running on its stack.
+// Called on trap entry, which is after the switch away from it.
+static void kernel_task_reap () {
+	int *t;
+	if (!(t = kernel_task_dead) || t == kernel_task_current)
+		return;
+	kernel_task_dead = 0;
+	if (kernel_task_focus == t)
+		kernel_task_focus = 0;
+	kernel_clean_task(t);
+	--kernel_tasks_zombie;
+	++kernel_tasks_unloaded;
 }
 
 // Called when a task finishes, by EXIT or returning from main, or some other way.
-// Also handles waking tasks when a task finishes.
+// Wakes the tasks waiting on it and makes it a zombie, to be reaped after the
+// next switch. TASK_EXIT_CODE must be set. Unless the parent is already
+// waiting, the exit code is also kept on the parent for a later await_pid.
 static void kernel_task_finish (int *task) {
-	int s, *t, i, tid;
+	int s, *t, parent_waiting;
 
 	// printf("c5ke: kernel_task_finish(%d), exit code = %d\n", task[TASK_ID], task[TASK_EXIT_CODE]);
 
@@ -1153,34 +1952,27 @@ static void kernel_task_finish (int *task) {
 	if (s & STATE_RUNNING) --kernel_tasks_running;
 	if (s & STATE_WAITING) --kernel_tasks_waiting;
 	if (s & STATE_TRAPPED) --kernel_tasks_trapped;
+	// Wake the tasks waiting on this one, with its exit code
+	parent_waiting = 0;
+	while ((t = (int *)task[TASK_WAITERS])) {
+		kernel_waiter_remove(t);
+		t[TASK_WAITARG] = task[TASK_EXIT_CODE];
+		kernel_task_wake(t);
+		if (t[TASK_ID] == task[TASK_PARENT]) parent_waiting = 1;
+	}
+	if (!parent_waiting) kernel_exit_record(task);
+	kernel_task_unqueue(task);
 	s = internal_task_slot(task);
 	if (kernel_max_slot == s) {
 		--kernel_max_slot;
 		// printf("c4ke: max slot-- now %d\n", kernel_max_slot);
 	}
 
-	// Check if any process is waiting on this task
-	t = kernel_tasks;
-	i = 0;
-	tid = task[TASK_ID];
-	while (i <= kernel_max_slot) {
-		if (*t & STATE_WAITING) {
-			if (t[TASK_WAITSTATE] == WSTATE_PID) {
-				// TODO: negative values to check against parent id
-				if (t[TASK_WAITARG] == tid) {
-					// Found a task waiting on this task's id specifically
-
-					// Update the WAITARG with tasks exit code.
-					t[TASK_WAITARG] = task[TASK_EXIT_CODE];
-					// printf("c4ke: woke task.%d with task exit code %d\n", t[TASK_ID], task[TASK_EXIT_CODE]);
-					// Wake up the task
-					kernel_task_wake(t);
-				}
-			}
-		}
-		t = t + TASK__Sz;
-		++i;
-	}
+	kernel_task_reap();
+	task[TASK_STATE] = STATE_ZOMBIE;
+	kernel_task_changed(task);
+	++kernel_tasks_zombie;
+	kernel_task_dead = task;
 }
 
 ///
@@ -1192,6 +1984,21 @@ static void op_c4info (int trap, int ins, int a, int *bp, int *sp, int *returnpc
 	trap_exit();
 }
 
+// Find an opcode added by a kernel extension.
+// @return opcode, or 0 if no extension added one by that name
+static int kext_symbol (char *symbol) {
+	int i, *e;
+	i = 0;
+	e = kernel_ext_opcodes;
+	while (i < kernel_ext_opcode_count) {
+		if (!_strcmp((char *)*e, symbol))
+			return OP_EXTENSIONS_START + i;
+		e = e + 2;
+		++i;
+	}
+	return 0;
+}
+
 static void op_request_symbol (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
 	char *symbol;
 	int i;
@@ -1202,7 +2009,8 @@ static void op_request_symbol (int trap, int ins, int a, int *bp, int *sp, int *
 	// }
 	symbol = (char *)sp[1];
 	// printf("Requesting symbol '%s'\n", symbol);
-	a = request_symbol(symbol);
+	if (!(a = kext_symbol(symbol)))
+		a = request_symbol(symbol);
 	// printf("Symbol value: %d\n", a);
 	trap_exit();
 }
@@ -1232,6 +2040,7 @@ static void op_schedule (int trap, int ins, int a, int *bp, int *sp, int *return
 		//       kernel_task_current, next);
 		// Save current state
 		curr = kernel_task_current;
+		kernel_task_changed(curr);
 		curr[TASK_REG_A]  = (int)1; // Found a task to switch to
 		curr[TASK_REG_BP] = (int)bp;
 		curr[TASK_REG_SP] = (int)sp;
@@ -1263,13 +2072,10 @@ static void op_schedule (int trap, int ins, int a, int *bp, int *sp, int *return
 static void op_task_finish (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
 	int *next, *p;
 
-	kernel_task_finish(kernel_task_current);
-	// printf("op_task_finish: finding a new task to move to\n");
-	kernel_task_current[TASK_STATE] = STATE_ZOMBIE; // Will be collected later
-	++kernel_tasks_zombie;
-
 	// Record the exit code
 	kernel_task_current[TASK_EXIT_CODE] = *sp;
+	kernel_task_finish(kernel_task_current);
+	// printf("op_task_finish: finding a new task to move to\n");
 
 	if ((next = kernel_task_find())) {
 		// TODO: not used on idle task, any reason to? not yet
@@ -1304,8 +2110,6 @@ static void op_task_exit (int trap, int ins, int a, int *bp, int *sp, int *retur
 	// Record the exit code
 	kernel_task_current[TASK_EXIT_CODE] = sp[1];
 	kernel_task_finish(kernel_task_current);
-	kernel_task_current[TASK_STATE] = STATE_ZOMBIE; // Will be collected later by idle
-	++kernel_tasks_zombie;
 
 	if ((next = kernel_task_find())) {
 		kernel_before_switch(next);
@@ -1345,14 +2149,23 @@ static void op_task_focus (int trap, int ins, int a, int *bp, int *sp, int *retu
 // int await_pid(int pid) => pid's exit code
 // TODO: implement as waitpid with POSIX style
 static void op_await_pid(int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	int pid;
+	int pid, *t;
 
 	pid = sp[1];
-	if (kernel_task_find_pid(pid)) {
+	if (kernel_exit_take(kernel_task_current, pid, &a)) {
+		// A child that finished earlier
+		trap_exit();
+	} else if ((t = kernel_task_find_pid(pid)) && (*t & STATE_ZOMBIE)) {
+		// Finished, but not reaped yet
+		a = t[TASK_EXIT_CODE];
+		trap_exit();
+	} else if (t) {
 		*kernel_task_current = *kernel_task_current | STATE_WAITING;
 		kernel_task_current[TASK_WAITSTATE] = WSTATE_PID;
 		kernel_task_current[TASK_WAITARG] = pid;
 		++kernel_tasks_waiting;
+		kernel_task_wait(kernel_task_current);
+		kernel_waiter_add(kernel_task_current, t);
 		trap_exit();
 		schedule();
 		// Exit code is placed into TASK_WAITARG by kernel_task_finish
@@ -1360,8 +2173,10 @@ static void op_await_pid(int trap, int ins, int a, int *bp, int *sp, int *return
 		// if (kernel_verbosity > VERB_MED)
 		//	printf("c4ke: op_await_pid returning, a = %d\n", a);
 	} else {
-		// If task not running, no point in waiting
-		printf("c4ke: await_pid(%d) - process %d not found\n", pid, pid);
+		// If task not running, no point in waiting. Finished children are
+		// found above until awaited, so this is some other task.
+		if (kernel_verbosity >= VERB_MED)
+			printf("c4ke: await_pid(%d) - process %d not found\n", pid, pid);
 		a = -1;
 		trap_exit();
 	}
@@ -1373,8 +2188,9 @@ static void op_user_sleep (int trap, int ins, int a, int *bp, int *sp, int *retu
 	*kernel_task_current = *kernel_task_current | STATE_WAITING;
 	kernel_task_current[TASK_WAITSTATE] = WSTATE_TIME;
 	++kernel_tasks_waiting;
-	// Use kernel_last_time, since __time() was called just prior to this opcode handler
+	current_task_time_sync();
 	kernel_task_current[TASK_WAITARG] = kernel_last_time + sp[1];
+	kernel_task_wait(kernel_task_current);
 	// Update kernel times
 	trap_exit();
 	schedule();
@@ -1393,14 +2209,14 @@ static void op_user_sleep (int trap, int ins, int a, int *bp, int *sp, int *retu
 // @param argv    Copied, then pushed as arguments
 // @param name    Name of the task
 // @param privileges   See PRIV_ enum
+// @param stack_size   Stack size in bytes, 0 for TASK_STACK_SIZE
 // @return 0 on failure (with start_errno set), or on success the task structure
 //         created.
-static int *start_task_builtin (int *entry, int argc, char **_argv, char *name, int privileges) {
+static int *start_task_builtin (int *entry, int argc, char **_argv, char *name, int privileges, int stack_size) {
 	int    *t, *temp, *sp, *bp, *sigh;
 	int    argv_size, i;
 	char **argv, *argv_data, *s;
 	int    slot;
-	int    require_critical;
 
 	if (kernel_running)
 		critical_path_start();
@@ -1415,61 +2231,45 @@ static int *start_task_builtin (int *entry, int argc, char **_argv, char *name,
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: found free task at 0x%lx\n", t);
 
-	if (!(bp = sp = malloc(TASK_STACK_SIZE))) {
-		free(t);
-		start_errno = START_NOSTACK;
-		if (kernel_running)
-			critical_path_end();
-		return 0;
-	}
-	memset(sp, 0, TASK_STACK_SIZE);
-	if (kernel_verbosity >= VERB_MAX)
-		printf("c4ke: allocated %d bytes for task stack at 0x%lx\n", TASK_STACK_SIZE, bp);
-
-	if (!(sigh = malloc((i = sizeof(int) * SIGH__Sz * SIGNAL_MAX)))) {
-		free(t);
-		free(bp);
-		start_errno = START_NOSIG;
-		if (kernel_running)
-			critical_path_end();
-		return 0;
-	}
-	memset(sigh, 0, i);
-	t[TASK_SIGHANDLERS] = (int)sigh;
-	t[TASK_SIGPENDING] = 0;
-
-	start_errno = START_NONE;
-
+	if (stack_size <= 0) stack_size = TASK_STACK_SIZE;
+	else if (stack_size < TASK_STACK_MIN) stack_size = TASK_STACK_MIN;
+	else if (stack_size > TASK_STACK_MAX) stack_size = TASK_STACK_MAX;
 	// Make a copy of the argv, otherwise tasks calling this function and returning
 	// before the program is started loses the argv values.
-	t[TASK_ARGC] = argc;
-	if (!(argv = malloc((i = sizeof(char *) * (argc + 1))))) {
-		free(t);
-		free(bp);
-		free(argv);
-		printf("c4ke: Unable to allocate argv\n");
-		start_errno = START_ARGV;
-		if (kernel_running)
-			critical_path_end();
-		return 0;
-	}
-	memset(argv, 0, i);
-	t[TASK_ARGV] = (int)argv;
 	i = argv_size = 0; while(i < argc) argv_size = argv_size + _strlen(_argv[i++]) + 1;
 	// Bugfix(1): argv_size of 0 returns null under original c4
 	++argv_size;
-	if (!(argv_data = malloc(argv_size))) {
-		free(t);
-		free(bp);
-		free(argv);
-		start_errno = START_ARGV;
-		printf("c4ke: Unable to allocate argv data of %d\n", argv_size);
+	// Everything allocated here is released by kernel_clean_task
+	t[TASK_BASE] = (int)(bp = sp = kernel_pool_alloc(stack_size));
+	t[TASK_SIGHANDLERS] = (int)(sigh = kernel_pool_alloc(i = sizeof(int) * SIGH__Sz * SIGNAL_MAX));
+	t[TASK_ARGV] = (int)(argv = (char **)kernel_pool_alloc(sizeof(char *) * (argc + 1)));
+	t[TASK_ARGV_DATA] = (int)(argv_data = (char *)kernel_pool_alloc(argv_size));
+	t[TASK_NAME] = (int)kernel_pool_strcpy(name);
+	if (kernel_task_extdata_size)
+		t[TASK_EXTDATA] = (int)kernel_pool_alloc(kernel_task_extdata_size);
+	if (!bp) start_errno = START_NOSTACK;
+	else if (!sigh) start_errno = START_NOSIG;
+	else if (!argv || !argv_data) start_errno = START_ARGV;
+	else if (!t[TASK_NAME]) start_errno = START_NONAME;
+	else if (kernel_task_extdata_size && !t[TASK_EXTDATA]) {
+		printf("c4ke: Warning: unable to allocate task extended data of %ld bytes\n", kernel_task_extdata_size);
+	}
+	if (start_errno != START_NONE) {
+		printf("c4ke: Unable to allocate task memory (error %d)\n", start_errno);
+		kernel_clean_task(t);
 		if (kernel_running)
 			critical_path_end();
 		return 0;
 	}
-	memset(argv_data, 0, argv_size);
-	t[TASK_ARGV_DATA] = (int)argv_data;
+	memset(sp, 0, stack_size);
+	memset(sigh, 0, i);
+	if (t[TASK_EXTDATA])
+		memset((int *)t[TASK_EXTDATA], 0, kernel_task_extdata_size);
+	if (kernel_verbosity >= VERB_MAX)
+		printf("c4ke: allocated %d bytes for task stack at 0x%lx\n", stack_size, bp);
+	t[TASK_SIGPENDING] = 0;
+
+	t[TASK_ARGC] = argc;
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: Allocated our own argv @ 0x%lx and data @ 0x%lx\n", argv, argv_data);
 	// Copy items
@@ -1477,16 +2277,15 @@ static int *start_task_builtin (int *entry, int argc, char **_argv, char *name,
 	while(i < argc) {
 		argv[i] = argv_data;
 		s = _argv[i];
-		while (*s) *argv_data++ = *s++;
-		*argv_data++ = 0; // nul terminator
+		argv_data = _strcpy(argv_data, s) + _strlen(s) + 1;
 		++i;
 	}
+	argv[i] = 0;
 
 	// Setup task stack
-	t[TASK_BASE] = (int)bp;
 	t[TASK_CODE] = 0;
 	t[TASK_DATA] = 0;
-	bp = sp = (int *)((int)sp + TASK_STACK_SIZE);
+	bp = sp = (int *)((int)sp + stack_size);
 
 	// Avoid a c4 issue where printf can read past the allocated stack
 	sp = bp = sp - 6;
@@ -1502,13 +2301,14 @@ static int *start_task_builtin (int *entry, int argc, char **_argv, char *name,
 		printf("c4ke: updating task at 0x%lx\n", t);
 	}
 	t[TASK_ID] = ++kernel_task_id_counter;
-	t[TASK_NICE]   = t[TASK_NICE_BASE] = 10; // default
+	kernel_pid_insert(t);
+	t[TASK_NICE_BASE] = 10; // default
 	// DEBUG renice based on name
 	// TODO: add renice interface and don't do it here in the kernel
 	if (!_strcmp(name, "kernel/idle")) {
-		t[TASK_NICE] = t[TASK_NICE_BASE] = 0;
+		t[TASK_NICE_BASE] = 0;
 	} else if (!_strcmp(name, "top")) {
-		t[TASK_NICE] = t[TASK_NICE_BASE] = 0;
+		t[TASK_NICE_BASE] = 0;
 	}
 	t[TASK_PARENT] = kernel_task_current[TASK_ID];
 	t[TASK_STATE] = STATE_LOADED | STATE_RUNNING;
@@ -1518,31 +2318,18 @@ static int *start_task_builtin (int *entry, int argc, char **_argv, char *name,
 	t[TASK_REG_PC] = t[TASK_ENTRY] = (int)entry;
 	t[TASK_PRIVS]  = privileges;
 	t[TASK_C4R]    = 0; // No C4R structure
-	t[TASK_NAME]   = (int)k_strcpy_alloc(name);
-	if (!t[TASK_NAME]) {
-		printf("c4ke: Warning: unable to copy task name\n");
-		t[TASK_NAME] = (int)"(copy error)";
-	}
 	t[TASK_NAMELEN] = _strlen((char *)t[TASK_NAME]);
-	t[TASK_EXTDATA] = 0;
-	if (kernel_task_extdata_size) {
-		if (!(t[TASK_EXTDATA] = (int)malloc(kernel_task_extdata_size))) {
-			printf("c4ke: Warning: unable to allocate task extended data of %ld bytes\n", kernel_task_extdata_size);
-		}
-	}
+	kernel_task_changed(t);
 	--kernel_tasks_unloaded;
 	++kernel_tasks_loaded;
 	++kernel_tasks_running;
+	kernel_task_ready(t, 0);
 	slot = internal_task_slot(t);
 	if (slot > kernel_max_slot) {
 		kernel_max_slot = slot;
 		// printf("c4ke: max slot++ now %d\n", kernel_max_slot);
 	}
 
-	// Trigger a load balance
-	// TODO: disabled
-	//kernel_load_balance();
-
 	if (kernel_verbosity >= VERB_MAX)
 		kernel_print_task(t);
 
@@ -1586,6 +2373,7 @@ static void trap_handler (int trap, int ins, int a, int *bp, int *sp, int *retur
 
 	// Stops timekeeping for task, activates kernel timekeeping
 	trap_enter();
+	kernel_task_reap();
 
 	if (trap == TRAP_ILLOP) {
 		//handler = (int *)custom_opcodes[ins - CO_BASE];
@@ -1618,7 +2406,6 @@ static void trap_handler (int trap, int ins, int a, int *bp, int *sp, int *retur
 		kernel_print_task(kernel_task_current);
 		kernel_task_current[TASK_EXIT_CODE] = -1000;
 		kernel_task_finish(kernel_task_current);
-		kernel_task_current[TASK_STATE] = STATE_ZOMBIE;
 		schedule();
 		printf("c4ke: unable to terminate instruction faulting process\n");
 		exit(-2);
@@ -1638,7 +2425,6 @@ static void trap_handler (int trap, int ins, int a, int *bp, int *sp, int *retur
 		// Kill the task and schedule()
 		kernel_task_current[TASK_EXIT_CODE] = -1000;
 		kernel_task_finish(kernel_task_current);
-		kernel_task_current[TASK_STATE] = STATE_ZOMBIE;
 		schedule();
 		printf("c4ke: unable to terminate segfaulting process\n");
 		exit(-4);
@@ -1653,7 +2439,6 @@ static void trap_handler (int trap, int ins, int a, int *bp, int *sp, int *retur
 		// Kill the task and schedule()
 		kernel_task_current[TASK_EXIT_CODE] = -1000;
 		kernel_task_finish(kernel_task_current);
-		kernel_task_current[TASK_STATE] = STATE_ZOMBIE;
 		schedule();
 		printf("c4ke: unable to terminate segfaulting process\n");
 		exit(-4);
@@ -1703,6 +2488,130 @@ static int install_custom_opcode (int opcode, int *handler) {
 	return 1;
 }
 
+//
+// Fast opcodes
+//
+// c4m calls these handlers directly instead of trapping: no trap frame is
+// built, trap_enter()/trap_exit() are not run, and the cycle interrupt stays
+// enabled. They run on the calling task's stack and return the value for
+// register A. Only read-only queries that are safe to interrupt belong here;
+// the regular handler stays installed for c4m builds without fast opcodes.
+//
+// The arguments mirror the __c4_opcode call, with the opcode last.
+//
+
+// Install a fast opcode handler.
+//
+// @param opcode    Opcode to install handler for, must also have a regular handler
+// @param handler   The handler, obtained using (int *)&function_name
+// @return          0 on success, 1 on error (out of range).
+static int install_fast_opcode (int opcode, int *handler) {
+	if (opcode >= CO_BASE && opcode < CO_BASE + CO_MAX) {
+		// Called like a regular function, so keep the ENT x instruction
+		fast_opcodes[opcode] = (int)handler;
+		return 0;
+	}
+	return 1;
+}
+
+static int fop_c4info (int op) { return __c4_info() | C4I_C4KE; }
+static int fop_time (int op) { return __time(); }
+static int fop_user_pid (int op) { return kernel_task_current[TASK_ID]; }
+static int fop_user_parent (int op) { return kernel_task_current[TASK_PARENT]; }
+static int fop_kern_task_count (int op) { return kernel_tasks_running; }
+static int fop_kern_tasks_max (int op) { return KERN_TASK_MAX; }
+
+// Cycles spent by the current task, including those since the last trap.
+// A task switch updates kernel_last_cycle, in which case try again.
+static int fop_task_cycles (int op) {
+	int last, cycles;
+	last = kernel_last_cycle - 1;
+	while (last != kernel_last_cycle) {
+		last = kernel_last_cycle;
+		cycles = kernel_task_current[TASK_CYCLES] + __c4_cycles() - last;
+	}
+	return cycles;
+}
+
+//
+// Native opcodes
+//
+// A native build of c4m can be started with modules (-x c4ke) that provide C
+// versions of some opcode handlers, see c4m_native.c. The kernel binds them
+// by opcode name and hands them kernel_native_context, which tells them where
+// the kernel state they use lives. A bound handler is tried before the fast
+// and regular handlers, and declines anything it cannot finish by itself, so
+// the regular handlers stay installed.
+//
+
+// Native context, keep up to date with c4m_native_c4ke.c
+enum {
+	KNC_SIZE,           // int, KNC__Sz, so c4m can refuse a context laid out differently
+	KNC_TASK_CURRENT,   // int **, &kernel_task_current
+	KNC_RQ_MASK,        // int *,  &kernel_rq_mask
+	KNC_RQ_HEAD,        // int **, &kernel_rq_head
+	KNC_TIMER_COUNT,    // int *,  &kernel_timer_count
+	KNC_TIMERS,         // int **, &kernel_timers
+	KNC_TASK_ID,        // TASK field indices
+	KNC_TASK_PARENT,
+	KNC_TASK_SIGHANDLERS,
+	KNC_TASK_RQ,
+	KNC_TASK_RQ_NEXT,
+	KNC_TASK_WAITARG,
+	KNC_SIGH_SZ,        // Signal handler structure size,
+	KNC_SIGH_ADDRESS,   // and its handler field index
+	KNC_SIGNAL_MAX,
+	KNC__Sz
+};
+
+// @return 1 if a native handler was bound to opcode
+static int kernel_native_bind (int *request, char *name, int opcode) {
+	request[NATIVE_REQ_NAME] = (int)name;
+	request[NATIVE_REQ_OPCODE] = opcode;
+	request[NATIVE_REQ_CONTEXT] = (int)kernel_native_context;
+	return __c4_configure(C4KE_CONF_NATIVE_OPCODE, request) == 1;
+}
+
+// Bind whatever native handlers c4m offers.
+// Only a native c4m can have any, other hosts are not asked.
+// @return number of opcodes bound
+static int kernel_native_setup () {
+	int *c, *request, n;
+
+	if ((__c4_info() & (C4I_C4 | C4I_C4M)) != C4I_C4M)
+		return 0;
+	if (!(c = kernel_native_context = malloc(sizeof(int) * KNC__Sz)))
+		return 0;
+	if (!(request = malloc(sizeof(int) * NATIVE_REQ__Sz))) {
+		free(c);
+		kernel_native_context = 0;
+		return 0;
+	}
+	c[KNC_SIZE] = KNC__Sz;
+	c[KNC_TASK_CURRENT] = (int)&kernel_task_current;
+	c[KNC_RQ_MASK] = (int)&kernel_rq_mask;
+	c[KNC_RQ_HEAD] = (int)&kernel_rq_head;
+	c[KNC_TIMER_COUNT] = (int)&kernel_timer_count;
+	c[KNC_TIMERS] = (int)&kernel_timers;
+	c[KNC_TASK_ID] = TASK_ID;
+	c[KNC_TASK_PARENT] = TASK_PARENT;
+	c[KNC_TASK_SIGHANDLERS] = TASK_SIGHANDLERS;
+	c[KNC_TASK_RQ] = TASK_RQ;
+	c[KNC_TASK_RQ_NEXT] = TASK_RQ_NEXT;
+	c[KNC_TASK_WAITARG] = TASK_WAITARG;
+	c[KNC_SIGH_SZ] = SIGH__Sz;
+	c[KNC_SIGH_ADDRESS] = SIGH_ADDRESS;
+	c[KNC_SIGNAL_MAX] = SIGNAL_MAX;
+	n = kernel_native_bind(request, "OP_SCHEDULE", OP_SCHEDULE) +
+	    kernel_native_bind(request, "OP_TIME", OP_TIME) +
+	    kernel_native_bind(request, "OP_USER_PID", OP_USER_PID) +
+	    kernel_native_bind(request, "OP_USER_PARENT", OP_USER_PARENT) +
+	    kernel_native_bind(request, "OP_USER_SIGNAL", OP_USER_SIGNAL) +
+	    kernel_native_bind(request, "OP_KERN_TASK_CURRENT_ID", OP_KERN_TASK_CURRENT_ID);
+	free(request);
+	return n;
+}
+
 static int schedule_task_mask;
 
 
@@ -1710,19 +2619,15 @@ static int schedule_task_mask;
 // Builtin kernel tasks
 //
 
-// A builtin task that attempts to schedule.
-// Also cleans up finished tasks, as their stack is not in use when another
-// task is running, and is free to cleanup.
+// A builtin task that attempts to schedule, and sleeps until the next
+// timer is due when nothing else can run.
 static int task_idle (int argc, char **argv) {
-	int i, *t;
+	int i;
 	int run;
 	int spin;
-	int zombie_reap_time, zrp;
-	int load_balance_time, lbt;
 
 	//printf("idle: task %d starting idle loop\n", kernel_task_current[TASK_ID]);
 	run = 1;
-	zombie_reap_time = load_balance_time = __time();
 	// TODO: c4cc, while(1) should use unconditional jump
 	while (1) {
 		if (schedule()) {
@@ -1731,43 +2636,14 @@ static int task_idle (int argc, char **argv) {
 			//       "running tasks: %d (%d loaded)\n",
 			//       count_running, count_loaded);
 			// kernel_hlt_count = 0;
-			// TODO: check for next schedule time
-			//i = __time();
-			__c4_usleep(KERNEL_IDLE_SLEEP_TIME);
-			//printf("(idle: slept for %d usec)\n", __time() - i);
+			// Nothing can run, so sleep until the next timer is due.
+			// Signals interrupt the sleep.
+			i = KERNEL_IDLE_SLEEP_MAX;
+			if (kernel_timer_count && (i = ((int *)*kernel_timers)[TASK_WAITARG] - __time()) > KERNEL_IDLE_SLEEP_MAX)
+				i = KERNEL_IDLE_SLEEP_MAX;
+			if (i > 0)
+				__c4_usleep(i * 1000);
 		}
-
-		// a trap has been called recently, use the last timestamps
-		zrp = lbt = kernel_last_time;
-
-		// Clear out zombie tasks, and do inventory on task counts
-		// Ensure there's actually other tasks running.
-		// Disables task switching whilst this is performed.
-		// Only occurs after 1 second has passed.
-		if (kernel_tasks_zombie) {
-			if (zrp - zombie_reap_time >= 1000) {
-				zombie_reap_time = zrp;
-				i = 0;
-				t = kernel_tasks + (TASK__Sz * 2); // Skip kernel and idle tasks
-				while (++i < KERN_TASK_COUNT) {
-					// Might not see tasks that zombify straight away, but that's ok
-					if (t[TASK_STATE] & STATE_ZOMBIE) {
-						critical_path_start();
-						kernel_clean_task(t);
-						--kernel_tasks_zombie;
-						++kernel_tasks_unloaded;
-						critical_path_end();
-					}
-					t = t + TASK__Sz;
-				}
-			}
-		}
-
-		// TODO: removed load balancing
-		//if (lbt - load_balance_time >= 2000) {
-		//	load_balance_time = lbt;
-		//	kernel_load_balance();
-		//}
 	}
 }
 
@@ -1853,7 +2729,7 @@ static int task_loadc4r (int argc, char **argv) {
 			name_ptr = name;
 			while (i < argc) {
 				s = argv[i];
-				while (*s) *name_ptr++ = *s++;
+				name_ptr = _strcpy(name_ptr, s) + _strlen(s);
 				*name_ptr++ = ' '; // space between arguments
 				++i;
 			}
@@ -1864,10 +2740,10 @@ static int task_loadc4r (int argc, char **argv) {
 	// printf("lc4r: load mode = 0x%x\n", kernel_loadc4r_mode);
 	alt_file = 0;
 	file = argv[0];
-	if (!(module = c4r_load_opt(file, kernel_loadc4r_mode))) {
+	if (!(module = kernel_module_acquire(file))) {
 		// Attempt a version with .c4r appended
 		alt_file = strcpycat(file, ".c4r");
-		if (!(module = c4r_load_opt(alt_file, kernel_loadc4r_mode))) {
+		if (!(module = kernel_module_acquire(alt_file))) {
 			printf("lc4r: unable to open '%s' or '%s'\n", file, alt_file);
 			free(alt_file);
 			free(name);
@@ -1877,12 +2753,13 @@ static int task_loadc4r (int argc, char **argv) {
 	// printf("lc4r: module %s loaded\n", alt_file ? alt_file : file);
 
 	// c4r_dump_info(module);
+	// Recorded before running so that the module is released however the task ends
+	kernel_task_current[TASK_C4R] = (int)module;
 	result = -1;
 	if (module[C4R_LOADCOMPLETE])
 		result = loadc4r_execute(module, argc, argv);
 	else
 		printf("c4ke: load not complete\n");
-	kernel_task_current[TASK_C4R] = (int)module;
 	if (alt_file) free(alt_file);
 
 	if (kernel_verbosity >= VERB_MAX)
@@ -1896,6 +2773,66 @@ static int task_loadc4r (int argc, char **argv) {
 // Interrupt handlers
 ///
 
+// Retune the cycle interrupt interval, given the cycles the current ih_cycle
+// took. The interval starts at kernel_cycles_base, which is never exceeded.
+// If the focus task is ready along with n others, it is shortened so that n
+// slices fit in KERNEL_FOCUS_LATENCY_MS, but kept long enough that switching
+// costs at most KERNEL_SWITCH_OVERHEAD_PCT of all cycles.
+// The new interval is applied by the critical_path_end that follows.
+static void kernel_retune (int cost) {
+	int n, want, least;
+
+	kernel_switch_cost = kernel_switch_cost - kernel_switch_cost / 8 + cost;
+	if (kernel_cycles_force)
+		return;
+
+	want = kernel_cycles_base;
+	// Tasks ready besides idle and the focus task
+	n = kernel_rq_count - (kernel_task_idle[TASK_RQ] != 0);
+	if (kernel_ips && kernel_task_focus && kernel_task_focus[TASK_RQ] && --n > 0) {
+		want = kernel_ips / 1000 * KERNEL_FOCUS_LATENCY_MS / n;
+		least = kernel_switch_cost / 8 * (100 - KERNEL_SWITCH_OVERHEAD_PCT) / KERNEL_SWITCH_OVERHEAD_PCT;
+		if (want < least) want = least;
+		if (want < KERNEL_CYCLES_MIN) want = KERNEL_CYCLES_MIN;
+		if (want > kernel_cycles_base) want = kernel_cycles_base;
+	}
+	// Ignore small changes
+	n = want - kernel_cycles_count;
+	if (n < 0) n = -n;
+	if (n > kernel_cycles_count / 8) {
+		if (kernel_verbosity >= VERB_MAX)
+			printf("c4ke: cycle interrupt interval now %ld (%ld ready)\n", want, kernel_rq_count);
+		kernel_cycles_count = want;
+	}
+}
+
+// Count an address in the profile of task t, see -p.
+// Addresses are hashed into the table with a short probe, and when that finds
+// no room the sample is counted as lost.
+static void kernel_prof_sample (int *t, int *pc) {
+	int *h, *slot, i, n;
+
+	if (!t[TASK_EXTDATA])
+		return;
+	h = (int *)((char *)t[TASK_EXTDATA] + kernel_prof_extdata);
+	++h[KPROF_SAMPLES];
+	i = (int)pc / sizeof(int);
+	n = 8;
+	while (n--) {
+		i = i & (KERNEL_PROF_SLOTS - 1);
+		slot = h + KPROF_TABLE + 2 * i++;
+		if (*slot == (int)pc) {
+			++slot[1];
+			return;
+		} else if (!*slot) {
+			*slot = (int)pc;
+			slot[1] = 1;
+			return;
+		}
+	}
+	++h[KPROF_LOST];
+}
+
 // Cycle interrupt handler.
 // This is never directly called via an opcode, it happens as a trap with
 // type TRAP_HARD_IRQ.
@@ -1911,7 +2848,10 @@ static void ih_cycle (int type, int ins, int a, int *bp, int *sp, int *returnpc)
 	//}
 
 	critical_path_start();
+	if (kernel_profiling)
+		kernel_prof_sample(kernel_task_current, returnpc);
 	current_task_timekeeping();
+	kernel_task_reap();
 
 	// Getting too close to stack overflow error, just return.
 	// (May lag system)
@@ -1927,6 +2867,7 @@ static void ih_cycle (int type, int ins, int a, int *bp, int *sp, int *returnpc)
 		//        kernel_task_current, next);
 		// Save current state
 		curr = kernel_task_current;
+		kernel_task_changed(curr);
 		curr[TASK_REG_A]  = (int)a;
 		curr[TASK_REG_BP] = (int)bp;
 		curr[TASK_REG_SP] = (int)sp;
@@ -1945,6 +2886,7 @@ static void ih_cycle (int type, int ins, int a, int *bp, int *sp, int *returnpc)
 		// printf("c4ke: warning in ih_cycle: no other task found\n");
 		// Just return as normal since no other tasks found
 	}
+	kernel_retune(__c4_cycles() - kernel_last_cycle);
 	kernel_task_timekeeping();
 	critical_path_end();
 }
@@ -1964,8 +2906,10 @@ static int internal_signal (int *task, int sig) {
 
 	if (sigh[SIGH_ADDRESS]) {
 		// process_trap(task, TRAP_SIGNAL, sig, (int *)sigh[SIGH_ADDRESS]);
-		++task[TASK_SIGPENDING];
-		++sigh[SIGH_PENDING];
+		// Standard signals coalesce while pending, realtime signals queue
+		if (sig >= SIGRTMIN)
+			++sigh[SIGH_PENDING];
+		task[TASK_SIGPENDING] = task[TASK_SIGPENDING] | (1 << sig);
 		// printf("c4ke: Handler: 0x%x  Pending: %d  Blocked: %d\n",
 		//	sigh[SIGH_ADDRESS], sigh[SIGH_PENDING], sigh[SIGH_BLOCKED]);
 		// TODO: signals wake tasks, even if awaiting on a pid
@@ -1996,13 +2940,11 @@ static int kernel_signal (int pid, int sig) {
 
 // TODO: moveme
 static void dump_tasks () {
-	int i, *t;
+	int i;
 	i = 0;
-	t = kernel_tasks;
 	while (i < kernel_max_slot) {
-		kernel_print_task(t);
+		kernel_print_task(kernel_task_at(i));
 		++i;
-		t = t + TASK__Sz;
 	}
 }
 
@@ -2059,6 +3001,11 @@ static int kext_initialize () {
 		return KXERR_FAIL;
 	}
 	memset(kernel_extensions, 0, i);
+	if (!(kernel_ext_opcodes = malloc((i = sizeof(int) * 2 * KERNEL_EXT_OPCODES_MAX)))) {
+		printf("c4ke: kext_register failed to allocate %d bytes for extension opcodes\n", i);
+		return KXERR_FAIL;
+	}
+	kernel_ext_opcode_count = 0;
 	kernel_ext_count = 0;
 	kernel_ext_errno = 0;
 	kernel_ext_initialized = 1;
@@ -2130,6 +3077,47 @@ static int kext_register (char *name, int *init, int *start, int *shutdown) {
 	return KXERR_NONE;
 }
 
+// Set the function called with each task as it is cleaned up, after it exits or
+// is killed, so an extension can release what the task held. Not called for
+// tasks cleaned during shutdown once the extension's shutdown has run.
+// Call after kext_register with the same name.
+static int kext_task_clean (char *name, int *clean) {
+	int i, *kext;
+
+	kext = kernel_extensions;
+	i = 0;
+	while (i < kernel_ext_count) {
+		if (!_strcmp((char *)kext[KEXT_NAME], name)) {
+			kext[KEXT_TASK_CLEAN] = (int)clean;
+			return KXERR_NONE;
+		}
+		kext = kext + KEXT__Sz;
+		++i;
+	}
+	return KXERR_FAIL;
+}
+
+// Add an opcode for a kernel extension, numbered from OP_EXTENSIONS_START.
+// Tasks find it by name with OP_REQUEST_SYMBOL. The handler takes the same
+// arguments as the kernel's own op_ functions and must call trap_exit().
+// Can be called from init, before the opcode table exists, or from start.
+// @return opcode, or 0 on failure
+static int kext_opcode (char *name, int *handler) {
+	int op;
+
+	if (kernel_ext_opcode_count >= KERNEL_EXT_OPCODES_MAX ||
+	    (op = OP_EXTENSIONS_START + kernel_ext_opcode_count) >= CO_BASE + CO_MAX) {
+		printf("c4ke: kext_opcode(%s) failed, no opcodes left\n", name);
+		return 0;
+	}
+	kernel_ext_opcodes[2 * kernel_ext_opcode_count] = (int)name;
+	kernel_ext_opcodes[2 * kernel_ext_opcode_count + 1] = (int)handler;
+	++kernel_ext_opcode_count;
+	if (custom_opcodes)
+		install_custom_opcode(op, handler);
+	return op;
+}
+
 ///
 // More opcode handlers using functions above
 ///
@@ -2148,7 +3136,8 @@ static void op_halt (int trap, int ins, int a, int *bp, int *sp, int *returnpc)
 }
 
 static void op_time (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	// The time has just been updated prior to entering this trap, use that
+	// Traps only sample the clock, read it now so the result is current
+	current_task_time_sync();
 	a = kernel_last_time;
 	trap_exit();
 }
@@ -2181,22 +3170,13 @@ static void op_kern_task_current_id (int trap, int ins, int a, int *bp, int *sp,
 	trap_exit();
 }
 static void op_kern_task_running (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	int id, i, *t;
-	id = sp[1];
-	// printf("c4ke: kern_task_running requested for task %d\n", id);
+	int *t;
+	// printf("c4ke: kern_task_running requested for task %d\n", sp[1]);
 	// Skip kernel and idle
-	t = kernel_tasks + (TASK__Sz * 2);
-	i = 2;
-	while (i < KERN_TASK_COUNT) {
-		if (t[TASK_ID] == id) {
-			a = kernel_is_task_running(t);
-			trap_exit();
-			return;
-		}
-		++i;
-		t = t + TASK__Sz;
-	}
-	a = 0;
+	if ((t = kernel_task_find_pid(sp[1])) && t != kernel_task_idle)
+		a = kernel_is_task_running(t);
+	else
+		a = 0;
 	trap_exit();
 }
 // Get the current number of tasks
@@ -2206,75 +3186,88 @@ static void op_kern_task_count (int trap, int ins, int a, int *bp, int *sp, int
 }
 // Get the maximum number of tasks
 static void op_kern_tasks_max (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	a = KERN_TASK_COUNT;
+	a = KERN_TASK_MAX;
 	trap_exit();
 }
 
-static void kern_tasks_export_update (int *target) {
-	int i, *t, task_name, kti_used, kte_name, kte_size;
-	int kms;
+// Copy one task into an export entry. Names are shared, not copied.
+static void kern_tasks_export_task (int *kte, int *t) {
+	if ((*kte = *t)) {
+		kte[KTE_TASK_ID]      = t[TASK_ID];
+		kte[KTE_TASK_PARENT]  = t[TASK_PARENT];
+		kte[KTE_TASK_NAME]    = t[TASK_NAME];
+		kte[KTE_TASK_NAMELEN] = t[TASK_NAMELEN];
+		kte[KTE_TASK_PRIVS]   = t[TASK_PRIVS];
+		kte[KTE_TASK_NICE]    = t[TASK_NICE_BASE];
+		kte[KTE_TASK_CYCLES]  = t[TASK_CYCLES];
+		kte[KTE_TASK_TIMEMS]  = t[TASK_TIMEMS];
+		kte[KTE_TASK_TRAPS]   = t[TASK_TRAPS];
+	} else {
+		memset(kte, 0, sizeof(int) * KTE__Sz);
+	}
+}
 
-	kti_used = target[KTI_USED];
-	// Set the used tasks count and cache value for use in while loop
-	target[KTI_USED] = (kms = kernel_max_slot + 1);
-	// printf("c4ke: kern_tasks_export_update(0x%lx)\n", target);
-	// Fill in public details
-	target = target + KTI__Sz;
-	i = 0;
-	t = kernel_tasks;
-	kte_size = sizeof(int) * KTE__Sz; // cache for later
-	while (++i <= kms) {
-		kte_name = target[KTE_TASK_NAME];
-		// If a task is present...
-		if ((*target = *t)) {
-			task_name = t[TASK_NAME];
-			// If task name is different or kte_name not set
-			// TODO: strcmp that also gathers strlen for less cycles
-			// TODO: this whole section is questionable and takes far too many cycles
-			//if (kte_name ? _strcmp((char *)task_name, (char *)kte_name) : 1) {
-			if (kte_name ? (target[KTE_TASK_NAMELEN] != t[TASK_NAMELEN] && _strcmp((char *)task_name, (char *)kte_name)) : 1) {
-				target[KTE_TASK_ID] = t[TASK_ID];
-				target[KTE_TASK_PARENT] = t[TASK_PARENT];
-				target[KTE_TASK_PRIVS] = t[TASK_PRIVS];
-				if (kte_name) free((char *)kte_name);
-				if (!(kte_name = target[KTE_TASK_NAME] = (int)k_strcpy_alloc((char *)task_name))) {
-					printf("c4ke: KTE alloc failure\n");
-					target[KTE_TASK_NAMELEN] = 0;
-				} else {
-					// Update these values once only
-					target[KTE_TASK_NAMELEN] = _strlen((char *)kte_name);
-				}
-			}
-			// Update these values every cycle
-			target[KTE_TASK_CYCLES] = t[TASK_CYCLES];
-			target[KTE_TASK_TIMEMS] = t[TASK_TIMEMS];
-			target[KTE_TASK_TRAPS]  = t[TASK_TRAPS];
-			target[KTE_TASK_NICE]   = t[TASK_NICE_BASE];
-		} else if (kte_name) {
-			// Free KTE and reset data
-			free((char *)kte_name);
-			memset(target, 0, kte_size);
-		}
-		t = t + TASK__Sz;
-		target = target + KTE__Sz;
-	}
-	// Clear the rest of the entries
-	target = target + KTE__Sz;
-	while (++i <= kti_used) {
-		if ((kte_name = target[KTE_TASK_NAME])) {
-			// Free KTE and reset data
-			free((char *)kte_name);
-			memset(target, 0, kte_size);
-		}
-		target = target + KTE__Sz;
+// Move an export to a new allocation with room for every task slot, copying
+// the new slots in full. Returns the new export, or the old one if out of
+// memory.
+static int *kern_tasks_export_grow (int *target) {
+	int *n, *kte, sz, i;
+
+	sz = sizeof(int) * (KTI__Sz + (kernel_task_slots * KTE__Sz));
+	if (!(n = malloc(sz)))
+		return target;
+	i = target[KTI_COUNT];
+	memcpy(n, target, sizeof(int) * (KTI__Sz + (i * KTE__Sz)));
+	kte = n + KTI__Sz;
+	n[KTI_LIST] = (int)kte;
+	while (i < kernel_task_slots) {
+		kern_tasks_export_task(kte + KTE__Sz * i, kernel_task_at(i));
 		++i;
 	}
-	// printf("c4ke: kern_tasks_export_update finished\n");
+	n[KTI_COUNT] = kernel_task_slots;
+	kernel_export_unlink(target);
+	n[KTI_NEXT] = (int)kernel_exports;
+	kernel_exports = n;
+	free(target);
+	return n;
+}
+
+// Bring an export up to date. Only the tasks changed since its last update
+// are copied, found by walking the changed list until the export's generation.
+// The export is moved if the task table has grown since it was made.
+// @return the export
+static int *kern_tasks_export_update (int *target) {
+	int *t, *kte, gen, count, kms;
+
+	if (target[KTI_COUNT] < kernel_task_slots)
+		target = kern_tasks_export_grow(target);
+	gen = target[KTI_GEN];
+	count = target[KTI_COUNT];
+	kte = (int *)target[KTI_LIST];
+	t = kernel_changed_head;
+	while (t && t[TASK_GEN] > gen) {
+		if (t[TASK_SLOT] < count)
+			kern_tasks_export_task(kte + KTE__Sz * t[TASK_SLOT], t);
+		t = (int *)t[TASK_CHANGED_NEXT];
+	}
+	// The kernel and the caller have not been switched out, so their
+	// counters are newer than their last change.
+	kern_tasks_export_task(kte, kernel_tasks);
+	t = kernel_task_current;
+	if (t[TASK_SLOT] < count)
+		kern_tasks_export_task(kte + KTE__Sz * t[TASK_SLOT], t);
+	if ((kms = kernel_max_slot + 1) > count)
+		kms = count;
+	target[KTI_USED] = kms;
+	target[KTI_GEN] = kernel_task_gen;
+	if (kernel_retired_names)
+		kernel_names_sweep();
+	return target;
 }
 static void op_kern_tasks_export (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
 	int sz, *result;
 	// printf("c4ke: Kern tasks export triggered by ins @ 0x%lx, task %d\n", returnpc, kernel_task_current[TASK_ID]);
-	sz = sizeof(int) * (KTI__Sz + (KERN_TASK_COUNT * KTE__Sz));
+	sz = sizeof(int) * (KTI__Sz + (kernel_task_slots * KTE__Sz));
 	if (!(result = malloc(sz))) {
 		printf("c4ke: failed to malloc %d bytes\n", sz);
 		a = 0;
@@ -2283,32 +3276,27 @@ static void op_kern_tasks_export (int trap, int ins, int a, int *bp, int *sp, in
 	}
 	memset(result, 0, sz);
 
-	result[KTI_COUNT] = KERN_TASK_COUNT;
+	result[KTI_COUNT] = kernel_task_slots;
 	result[KTI_USED ] = kernel_tasks_loaded;
 	result[KTI_LIST ] = (int)(result + KTI__Sz);
-	kern_tasks_export_update(result);
+	result[KTI_OWNER] = kernel_task_current[TASK_ID];
+	result[KTI_NEXT ] = (int)kernel_exports;
+	kernel_exports = result;
+	result = kern_tasks_export_update(result);
 	a = (int)result;
 	trap_exit();
 }
 static void op_kern_tasks_export_update (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	kern_tasks_export_update((int *)sp[1]);
+	a = (int)kern_tasks_export_update((int *)sp[1]);
 	trap_exit();
 }
 static void op_kern_tasks_export_free (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	int *kti, *kte, i;
+	int *kti;
 
 	kti = (int *)sp[1];
-	kte = (int *)kti[KTI_LIST];
-	i = 0;
-	while (i++ < KERN_TASK_COUNT) {
-		if (kte[KTE_TASK_NAME]) {
-			free((char *)kte[KTE_TASK_NAME]);
-			kte[KTE_TASK_NAME] = 0;
-		}
-		kte = kte + KTE__Sz;
-	}
-
+	kernel_export_unlink(kti);
 	free(kti);
+	kernel_names_sweep();
 	trap_exit();
 }
 static void op_kern_tasks_running (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
@@ -2316,6 +3304,74 @@ static void op_kern_tasks_running (int trap, int ins, int a, int *bp, int *sp, i
 	trap_exit();
 }
 
+// Fill out with up to max KPE_ elements for the profile of task t, one per
+// function, or per address for code loaded without symbols (see -g).
+// Samples that were lost are given as a last element with no address.
+// @return elements filled
+static int kernel_prof_export (int *t, int *out, int max) {
+	int *h, *slot, *sym, *c4r, *e, *f, i, n, addr, x;
+
+	h = (int *)((char *)t[TASK_EXTDATA] + kernel_prof_extdata);
+	n = i = 0;
+	while (i < KERNEL_PROF_SLOTS) {
+		slot = h + KPROF_TABLE + 2 * i++;
+		if (*slot) {
+			sym = 0;
+			if ((c4r = (int *)t[TASK_C4R]))
+				sym = c4r_find_function(c4r, (int *)*slot);
+			if (!sym && (c4r = kernel_c4r))
+				sym = c4r_find_function(c4r, (int *)*slot);
+			addr = sym ? (int)((int *)c4r[C4R_CODE] + sym[C4R_SYMB_VALUE]) : *slot;
+			// Merge with the function's element, if there is one
+			e = out;
+			x = n;
+			while (x && e[KPE_ADDRESS] != addr) {
+				e = e + KPE__Sz;
+				--x;
+			}
+			if (x) {
+				e[KPE_COUNT] = e[KPE_COUNT] + slot[1];
+			} else if (n < max) {
+				e[KPE_COUNT] = slot[1];
+				e[KPE_ADDRESS] = addr;
+				e[KPE_NAME] = sym ? sym[C4R_SYMB_NAME] : 0;
+				e[KPE_NAMELEN] = sym ? sym[C4R_SYMB_NAMELEN] : 0;
+				++n;
+			}
+		}
+	}
+	// Most samples first
+	i = 1;
+	while (i < n) {
+		e = out + KPE__Sz * i++;
+		f = e - KPE__Sz;
+		while (f >= out && f[KPE_COUNT] < e[KPE_COUNT]) {
+			x = 0;
+			while (x < KPE__Sz) {
+				addr = f[x]; f[x] = e[x]; e[x] = addr;
+				++x;
+			}
+			e = f;
+			f = f - KPE__Sz;
+		}
+	}
+	if (h[KPROF_LOST] && n < max) {
+		e = out + KPE__Sz * n++;
+		e[KPE_COUNT] = h[KPROF_LOST];
+		e[KPE_ADDRESS] = e[KPE_NAME] = e[KPE_NAMELEN] = 0;
+	}
+	return n;
+}
+
+static void op_kern_task_profile (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *t;
+	if (kernel_profiling && (t = kernel_task_find_pid(sp[1])) && t[TASK_EXTDATA])
+		a = kernel_prof_export(t, (int *)sp[2], sp[3]);
+	else
+		a = -1;
+	trap_exit();
+}
+
 static void op_debug_printstack (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
 	printf("op_debug_printstack:\n");
 	printf("  pc: 0x%lx (%ld)\n", returnpc - 1, returnpc - 1);
@@ -2334,8 +3390,12 @@ static void op_debug_kernelstate (int trap, int ins, int a, int *bp, int *sp, in
 	       kernel_tasks_running, kernel_tasks_waiting);
 	printf("    : tasks_trapped:  %2ld    tasks_zombie:   %2ld\n",
 	       kernel_tasks_trapped,  kernel_tasks_zombie);
-	printf("    : task iterator:  %2ld    critical path:  %2ld\n",
-	       kernel_task_find_iterator, critical_path_value);
+	printf("    : ready levels: 0x%06lx  critical path:  %2ld\n",
+	       kernel_rq_mask, critical_path_value);
+	printf("    : cycle interval: %ld (base %ld)  switch cost: %ld\n",
+	       kernel_cycles_count, kernel_cycles_base, kernel_switch_cost / 8);
+	printf("    : pool hits:     %4ld    pool misses:  %4ld\n",
+	       kernel_pool_hits, kernel_pool_misses);
 	trap_exit();
 }
 
@@ -2351,33 +3411,35 @@ static void op_release_exclusive (int trap, int ins, int a, int *bp, int *sp, in
 	trap_exit();
 }
 
-// int __user_start_c4r(int argc, char **argv);
-// Start a .c4r file from a user process.
-// argv is copied based on argc.
-// return value is the process id, or 0 if failure.
-static void op_user_start_c4r (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
-	int argc;
-	char **argv;
-	int privileges;
-	char *name;
+// Start a .c4r file for the current task, see op_user_start_c4r.
+// @return the process id, or 0 if failure.
+static int user_start_c4r (int argc, char **argv, char *name, int privileges, int stack_size) {
 	int *t;
-
-	argc = sp[1];
-	argv = (char **)sp[2];
-	name = (char *)sp[3];
-	privileges = sp[4];
 	// Remove kernel privileges if not a kernel task
 	if (!(kernel_task_current[TASK_PRIVS] & PRIV_KERNEL))
 		privileges = privileges & ~(PRIV_KERNEL);
 	// printf("op_user_start_c4r: argc: %d, argv:\n", argc);
-	t = start_task_builtin((int *)&task_loadc4r, argc, argv, name, privileges);
+	t = start_task_builtin((int *)&task_loadc4r, argc, argv, name, privileges, stack_size);
 	if (!t) {
 		printf("op_user_start_c4r: failed to start builtin\n");
-		a = 0;
-	} else {
-		// printf("op_user_start_c4r: builtin started, task id = %d\n", t[TASK_ID]);
-		a = t[TASK_ID];
+		return 0;
 	}
+	// printf("op_user_start_c4r: builtin started, task id = %d\n", t[TASK_ID]);
+	return t[TASK_ID];
+}
+
+// int __user_start_c4r(int argc, char **argv, char *name, int privileges);
+// Start a .c4r file from a user process.
+// argv is copied based on argc.
+// return value is the process id, or 0 if failure.
+static void op_user_start_c4r (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	a = user_start_c4r(sp[1], (char **)sp[2], (char *)sp[3], sp[4], 0);
+	trap_exit();
+}
+
+// As op_user_start_c4r, with the stack size of the new task in bytes.
+static void op_user_start_c4r_stack (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	a = user_start_c4r(sp[1], (char **)sp[2], (char *)sp[3], sp[4], sp[5]);
 	trap_exit();
 }
 
@@ -2386,8 +3448,8 @@ static void op_user_start_c4r (int trap, int ins, int a, int *bp, int *sp, int *
 static void op_user_signal (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
 	int *sigh, sig;
 	sig = sp[1];
-	if (sig < 0 || sig > SIGNAL_MAX) {
-		printf("c4ke: signal(%d, 0x%X) - invalid signal provided\n");
+	if (sig < 0 || sig >= SIGNAL_MAX) {
+		printf("c4ke: signal(%d, 0x%X) - invalid signal provided\n", sig, sp[2]);
 	} else {
 		// printf("c4ke: install user signal handler, sig %d @ 0x%x\n", sp[1], sp[2]);
 		sigh = (int *)kernel_task_current[TASK_SIGHANDLERS];
@@ -2436,19 +3498,60 @@ static void op_currenttask_update_name (int trap, int ins, int a, int *bp, int *
 	trap_exit();
 }
 
-// int await_message(int timeout (0 = never))
-static void op_await_message(int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+// Put the current task to sleep until a message arrives or timeout ms pass.
+// A timeout of 0 waits forever.
+static void kernel_await_message (int timeout) {
 	*kernel_task_current = *kernel_task_current | STATE_WAITING;
 	kernel_task_current[TASK_WAITSTATE] = WSTATE_MESSAGE;
-	kernel_task_current[TASK_WAITARG] = kernel_last_time + sp[1]; // timeout
+	if (timeout)
+		current_task_time_sync();
+	kernel_task_current[TASK_WAITARG] = timeout ? kernel_last_time + timeout : 0;
 	++kernel_tasks_waiting;
-	trap_exit();
-	schedule();
-	// TODO: fetch first message or return 0
-	a = kernel_task_current[TASK_MBOX];
+	kernel_task_wait(kernel_task_current);
+}
+
+// int await_message(int timeout (0 = never))
+// Returns the number of messages waiting, which is 0 on timeout.
+static void op_await_message(int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	if (!kernel_task_current[TASK_MBOX_COUNT]) {
+		kernel_await_message(sp[1]);
+		trap_exit();
+		schedule();
+	} else
+		trap_exit();
+	a = kernel_task_current[TASK_MBOX_COUNT];
 	// printf("c4ke: op_await_message returning, a = %d\n", a);
 }
 
+// int send_message(int pid, int size, char *data)
+static void op_send_message (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *t;
+
+	if (!(t = kernel_task_find_pid(sp[1])) || !(t[TASK_STATE] & STATE_RUNNING))
+		a = -1;
+	else
+		a = kernel_mbox_put(t, kernel_task_current[TASK_ID], sp[2], sp[3]);
+	trap_exit();
+}
+
+// int receive_message(int *msg, int timeout (0 = never, < 0 = don't wait))
+static void op_receive_message (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *msg;
+
+	msg = (int *)sp[1];
+	if ((a = kernel_mbox_take(kernel_task_current, msg)) || sp[2] < 0) {
+		trap_exit();
+	} else {
+		kernel_await_message(sp[2]);
+		trap_exit();
+		schedule();
+		// Woken by a message, the timeout, or a signal
+		critical_path_start();
+		a = kernel_mbox_take(kernel_task_current, msg);
+		critical_path_end();
+	}
+}
+
 // int kill(int pid, int signal) => 0 (success) -1 (error)
 // Send a signal to a process.
 // NOTE: not POSIX-compliant, presently only pid > 0 supported. No group signals
@@ -2465,7 +3568,7 @@ static void op_user_kill (int trap, int ins, int a, int *bp, int *sp, int *retur
 	} else if (sig < 0) {
 		printf("c4ke: kill(%ld, %ld) - process groups not implemented\n", pid, sig);
 		a = -1;
-	} else if (sig > SIGNAL_MAX) {
+	} else if (sig >= SIGNAL_MAX) {
 		printf("c4ke: kill(%d, %d) - invalid signal provided\n", pid, sig);
 		a = -1;
 	} else if (!(t = kernel_task_find_pid(pid))) {
@@ -2511,18 +3614,21 @@ static int measure_ips () {
 //
 static void show_help () {
 	printf("c4ke v%s: C4 Kernel Experiment\n"
-	       "          : [-dtmg] [-v nn] [-c nn] [--] [init_file.c4r] [arguments...]\n"
+	       "          : [-dtmgFp] [-v nn] [-c nn] [-T nn] [--] [init_file.c4r] [arguments...]\n"
 	       "           -d               Enable debug mode\n"
 	       "           -t               Enable test tasks\n"
 	       "           -m               Disable speed measurement\n"
 		   "           -g               Load .c4r symbols by default\n"
+	       "           -F               Do not fuse .c4r code into superinstructions\n"
+	       "           -p               Profile tasks, see prof in c4sh (use with -g)\n"
 	       "           -v nn            Enable verbose mode and set verbosity (0 - 100, default %i)\n"
-	       "           -c nn            Set cycle interrupt count (implies -m)\n"
+	       "           -c nn            Set a fixed cycle interrupt count (implies -m)\n"
+	       "           -T nn            Read the clock in traps every nn cycles (0: always, default %i)\n"
 	       "           --               End arguments\n"
 	       "           init_file.c4r    File to use as init process (default: %s)\n"
 	       "           arguments...     Arguments to pass to init process\n"
 	       "           --help -h        Show this help\n"
-	       , VERSION(), kernel_verbosity, kernel_default_init);
+	       , VERSION(), kernel_verbosity, KERNEL_TIME_SAMPLE_CYCLES, kernel_default_init);
 }
 
 // parse_commandline() => 0 success, 1 failure
@@ -2576,6 +3682,8 @@ static int parse_commandline(int argc, char **argv) {
 				else if (*arg == 't') enable_test_tasks = 1;
 				else if (*arg == 'm') enable_measurement = 0;
 				else if (*arg == 'g') kernel_loadc4r_mode = kernel_loadc4r_mode | C4ROPT_SYMBOLS;
+				else if (*arg == 'F') kernel_loadc4r_mode = kernel_loadc4r_mode & ~C4ROPT_FUSE;
+				else if (*arg == 'p') kernel_profiling = 1;
 				// Flags with options
 				else if (*arg == 'v') { // Verbosity
 					endopt = 1;
@@ -2598,6 +3706,14 @@ static int parse_commandline(int argc, char **argv) {
 					kernel_cycles_count = _atoi(*argv, 10);
 					kernel_cycles_force = 1; // skip minimum cycle count check
 					enable_measurement  = 0; // skip measurement
+				} else if (*arg == 'T') { // Clock sampling interval
+					endopt = 1;
+					--argc; ++argv;
+					if (!argc) {
+						printf("c4ke: option '-T' requires an argument, none given\n");
+						return 1;
+					}
+					kernel_time_sample = _atoi(*argv, 10);
 				} else {
 					printf("Invalid option '%c'\n", *arg);
 					show_help();
@@ -2632,8 +3748,8 @@ static int kernel_finish_tasks_wait (int wait_time) {
 		schedule();
 		i = 1; // skip kernel and idle
 		t = 0;
-		while(++i < KERN_TASK_COUNT) {
-			tsk = kernel_tasks + (TASK__Sz * i);
+		while(++i < kernel_task_slots) {
+			tsk = kernel_task_at(i);
 			if (kernel_is_task_running(tsk)) {
 				++t; // track tasks needing to terminate
 			}
@@ -2649,10 +3765,10 @@ static int kernel_finish_tasks_send_all (int signal) {
 
 	i = 1; // skip kernel and idle
 	remain = 0;
-	while(++i < KERN_TASK_COUNT) {
-		tsk = kernel_tasks + (TASK__Sz * i);
+	while(++i < kernel_task_slots) {
+		tsk = kernel_task_at(i);
 		if (kernel_is_task_running(tsk)) {
-			printf("c4ke: pid %d '%s' still running, sending signal %d\n", i, (char *)tsk[TASK_NAME], signal);
+			printf("c4ke: pid %d '%s' still running, sending signal %d\n", tsk[TASK_ID], (char *)tsk[TASK_NAME], signal);
 			internal_signal(tsk, signal);
 			++remain; // track tasks needing to terminate
 		}
@@ -2697,8 +3813,8 @@ static void kernel_finish_tasks_term () {
 	if (kernel_verbosity >= VERB_MIN) {
 		printf("c4ke: %d tasks remaining, printing details...\n", remain);
 		i = 1; // skip kernel and idle
-		while(++i < KERN_TASK_COUNT) {
-			tsk = kernel_tasks + (TASK__Sz * i);
+		while(++i < kernel_task_slots) {
+			tsk = kernel_task_at(i);
 			if (*tsk) {
 				kernel_print_task(tsk);
 			}
@@ -2743,6 +3859,7 @@ int main (int argc, char **argv) {
 
 	kernel_last_cycle = __c4_cycles();
 	kernel_start_time = __time();
+	kernel_intrinsics_init();
 
 	// Install early trap handler
 	last_trap_handler = install_trap_handler((int *)&early_trap_handler);
@@ -2758,17 +3875,20 @@ int main (int argc, char **argv) {
 	c4r_verbose = 0;
 	c4r_debug = 0;
 	kernel_last_time = __time();
+	kernel_time_sample = KERNEL_TIME_SAMPLE_CYCLES;
+	kernel_time_cycle = kernel_last_cycle;
 	kernel_max_slot = 1;
 	kernel_cycles_count = KERNEL_CYCLES_MIN;
 	kernel_cycles_force = 0;
 	kernel_verbosity = VERB_DEFAULT;
-	kernel_loadc4r_mode = C4ROPT_NONE;
+	kernel_loadc4r_mode = C4ROPT_FUSE;
 	kernel_init = kernel_default_init = "init.c4r";
 	kernel_init_argc = 0;
 	kernel_init_argv = 0;
 	kernel_running = 0;
 	enable_test_tasks = 0;
 	enable_measurement = 1;
+	kernel_profiling = 0;
 	c4_info = __c4_info();
 	if (parse_commandline(argc, argv)) {
 		// Abort early
@@ -2776,7 +3896,7 @@ int main (int argc, char **argv) {
 	}
 	// TODO: schedule_task_mask unused
 	schedule_task_mask = STATE_LOADED | STATE_RUNNING | STATE_WAITING;
-	kernel_tasks_unloaded = KERN_TASK_COUNT;
+	kernel_tasks_unloaded = 0;
 	opcode_TLEV = __opcode("TLEV");
 	opcode_PSH = __opcode("PSH");
 
@@ -2844,6 +3964,9 @@ int main (int argc, char **argv) {
 					   i, t, kernel_cycles_count);
 		}
 	}
+	// Profiling samples on each cycle interrupt, so take enough of them
+	if (kernel_profiling && kernel_ips && !kernel_cycles_force && kernel_cycles_count > kernel_ips / KERNEL_PROF_HZ)
+		kernel_cycles_count = kernel_ips / KERNEL_PROF_HZ;
 	if (!kernel_cycles_force && kernel_cycles_count < KERNEL_CYCLES_MIN)
 		kernel_cycles_count = KERNEL_CYCLES_MIN;
 	if (kernel_verbosity >= VERB_MIN) {
@@ -2867,6 +3990,13 @@ int main (int argc, char **argv) {
 			printf("c4ke: running kernel extensions init for %d extensions...\n", kernel_ext_count);
 		kext_run_all(KEXT_INIT);
 	}
+	// The task profile follows any extension data
+	if (kernel_profiling) {
+		kernel_prof_extdata = kernel_task_extdata_size;
+		kernel_task_extdata_size = kernel_task_extdata_size + sizeof(int) * (KPROF_TABLE + 2 * KERNEL_PROF_SLOTS);
+		if (kernel_verbosity >= VERB_MED)
+			printf("c4ke: profiling tasks, %d addresses each\n", KERNEL_PROF_SLOTS);
+	}
 
 	///
 	// Stage 1: allocate kernel memory
@@ -2880,16 +4010,59 @@ int main (int argc, char **argv) {
 	memset(custom_opcodes, 0, t);
 	if (kernel_verbosity >= VERB_MED)
 		printf("c4ke: allocated %d (0x%x) bytes for custom_opcodes\n", t, t);
+	if (!(fast_opcodes = malloc((t = sizeof(int) * (CO_BASE + CO_MAX))))) {
+		printf("Unable to allocate %d bytes for fast opcode vector\n", t);
+		return -1;
+	}
+	memset(fast_opcodes, 0, t);
+	if (!(kernel_pool_free = malloc((t = sizeof(int) * 2 * POOL_CLASSES)))) {
+		printf("Unable to allocate %d bytes for the task memory pool\n", t);
+		return -1;
+	}
+	memset(kernel_pool_free, 0, t);
+	kernel_pool_count = kernel_pool_free + POOL_CLASSES;
 
-	// TODO: is 1 + kern task count correct? fixes a bad read
-	if (!(kernel_tasks = malloc((t = sizeof(int) * TASK__Sz * (1 + KERN_TASK_COUNT))))) {
-		printf("Unable to allocate %d bytes for %d tasks\n", t, KERN_TASK_COUNT);
+	// Chunk pointers and free slot stack, the task table itself grows on demand
+	if (!(kernel_task_chunks = malloc((t = sizeof(int) * (KERN_TASK_MAX / KERN_TASK_CHUNK + KERN_TASK_MAX))))) {
+		printf("Unable to allocate %d bytes for the task table\n", t);
 		return -2;
 	}
-	memset(kernel_tasks, 0, t);
+	memset(kernel_task_chunks, 0, t);
+	kernel_free_slots = kernel_task_chunks + KERN_TASK_MAX / KERN_TASK_CHUNK;
+	kernel_free_count = kernel_task_slots = 0;
+	if (!(kernel_pid_hash = malloc((t = sizeof(int) * KERN_PID_BUCKETS)))) {
+		printf("Unable to allocate %d bytes for pid lookup\n", t);
+		return -2;
+	}
+	memset(kernel_pid_hash, 0, t);
+	if (!kernel_task_grow()) {
+		printf("Unable to allocate %d tasks\n", KERN_TASK_CHUNK);
+		return -2;
+	}
+	// Slot 0 is the kernel task
+	kernel_tasks = kernel_task_at(kernel_free_slots[--kernel_free_count]);
+	t = sizeof(int) * TASK__Sz * KERN_TASK_CHUNK;
 	if (kernel_verbosity >= VERB_MED)
-		printf("c4ke: allocated %d (0x%x) bytes for kernel tasks, %d tasks max, %d bytes each, %d bytes ext data\n",
-		       t, t, KERN_TASK_COUNT, TASK__Sz * sizeof(int), kernel_task_extdata_size);
+		printf("c4ke: allocated %d (0x%x) bytes for kernel tasks, %d tasks (%d max), %d bytes each, %d bytes ext data\n",
+		       t, t, KERN_TASK_CHUNK, KERN_TASK_MAX, TASK__Sz * sizeof(int), kernel_task_extdata_size);
+	if (!(kernel_modules = malloc((t = sizeof(int) * MODC__Sz * KERNEL_MODULE_CACHE_MAX)))) {
+		printf("Unable to allocate %d bytes for module cache\n", t);
+		return -2;
+	}
+	memset(kernel_modules, 0, t);
+	kernel_module_clock = 0;
+	if (!(kernel_rq_head = malloc((t = sizeof(int) * 3 * KERNEL_PRIO_LEVELS)))) {
+		printf("Unable to allocate %d bytes for run queues\n", t);
+		return -2;
+	}
+	memset(kernel_rq_head, 0, t);
+	kernel_rq_tail = kernel_rq_head + KERNEL_PRIO_LEVELS;
+	kernel_rq_pass = kernel_rq_tail + KERNEL_PRIO_LEVELS;
+	if (!(kernel_timers = malloc((t = sizeof(int) * KERN_TASK_MAX)))) {
+		printf("Unable to allocate %d bytes for timers\n", t);
+		return -2;
+	}
+	kernel_timer_count = 0;
 
 	///
 	// Stage 2: setup opcode handlers
@@ -2926,6 +4099,7 @@ int main (int argc, char **argv) {
 	install_custom_opcode(OP_KERN_TASKS_EXPORT_UPDATE, (int *)&op_kern_tasks_export_update);
 	install_custom_opcode(OP_KERN_TASKS_EXPORT_FREE, (int *)&op_kern_tasks_export_free);
 	install_custom_opcode(OP_KERN_TASKS_RUNNING, (int *)&op_kern_tasks_running);
+	install_custom_opcode(OP_KERN_TASK_PROFILE, (int *)&op_kern_task_profile);
 	install_custom_opcode(OP_USER_START_C4R, (int *)&op_user_start_c4r);
 	install_custom_opcode(OP_USER_PID, (int *)&op_user_pid);
 	install_custom_opcode(OP_USER_PARENT, (int *)&op_user_parent);
@@ -2933,10 +4107,28 @@ int main (int argc, char **argv) {
 	install_custom_opcode(OP_USER_KILL, (int *)&op_user_kill);
 	install_custom_opcode(OP_CURRENTTASK_UPDATE_NAME, (int *)&op_currenttask_update_name);
 	install_custom_opcode(OP_AWAIT_MESSAGE, (int *)&op_await_message);
+	install_custom_opcode(OP_SEND_MESSAGE, (int *)&op_send_message);
+	install_custom_opcode(OP_RECEIVE_MESSAGE, (int *)&op_receive_message);
+	install_custom_opcode(OP_USER_START_C4R_STACK, (int *)&op_user_start_c4r_stack);
 	install_custom_opcode(OP_DEBUG_PRINTSTACK, (int *)&op_debug_printstack);
 	install_custom_opcode(OP_DEBUG_KERNELSTATE, (int *)&op_debug_kernelstate);
 	install_custom_opcode(OP_KERN_REQUEST_EXCLUSIVE, (int *)&op_request_exclusive);
 	install_custom_opcode(OP_KERN_RELEASE_EXCLUSIVE, (int *)&op_release_exclusive);
+	// Cheap queries skip the trap handler entirely
+	install_fast_opcode(OP_C4INFO, (int *)&fop_c4info);
+	install_fast_opcode(OP_TIME, (int *)&fop_time);
+	install_fast_opcode(OP_TASK_CYCLES, (int *)&fop_task_cycles);
+	install_fast_opcode(OP_USER_PID, (int *)&fop_user_pid);
+	install_fast_opcode(OP_USER_PARENT, (int *)&fop_user_parent);
+	install_fast_opcode(OP_KERN_TASK_CURRENT_ID, (int *)&fop_user_pid);
+	install_fast_opcode(OP_KERN_TASK_COUNT, (int *)&fop_kern_task_count);
+	install_fast_opcode(OP_KERN_TASKS_MAX, (int *)&fop_kern_tasks_max);
+	// Opcodes kernel extensions added during init
+	i = 0;
+	while (i < kernel_ext_opcode_count) {
+		install_custom_opcode(OP_EXTENSIONS_START + i, (int *)kernel_ext_opcodes[2 * i + 1]);
+		++i;
+	}
 
 	///
 	// Stage 3: setup tasks
@@ -2957,7 +4149,7 @@ int main (int argc, char **argv) {
 		printf("c4ke: creating kernel task...\n");
 	kernel_task_current = kernel_tasks;
 	kernel_task_current[TASK_ID]     = 0;
-	kernel_task_current[TASK_NICE]   = kernel_task_current[TASK_NICE_BASE] = 0;
+	kernel_task_current[TASK_NICE_BASE] = 0;
 	kernel_task_current[TASK_STATE]  = STATE_LOADED;
 	kernel_task_current[TASK_REG_A]  = 0;
 	kernel_task_current[TASK_REG_BP] = __c4_opcode(OP_PEEK_BP); //0;
@@ -2965,7 +4157,7 @@ int main (int argc, char **argv) {
 	kernel_task_current[TASK_REG_PC] = 0;
 	kernel_task_current[TASK_BASE]   = 0; // no base to free
 	kernel_task_current[TASK_PRIVS]  = PRIV_KERNEL;
-	kernel_task_current[TASK_SIGHANDLERS] = (int)malloc((t = sizeof(int) * SIGH__Sz * SIGNAL_MAX));
+	kernel_task_current[TASK_SIGHANDLERS] = (int)kernel_pool_alloc((t = sizeof(int) * SIGH__Sz * SIGNAL_MAX));
 	if (!kernel_task_current[TASK_SIGHANDLERS]) {
 		printf("c4ke: unable to allocate kernel sig handler\n");
 		return -1;
@@ -2983,8 +4175,8 @@ int main (int argc, char **argv) {
 	kernel_task_current[TASK_TRAPS] = 0;
 	kernel_task_current[TASK_C4R] = 0;
 	kernel_task_current[TASK_MBOX] = kernel_task_current[TASK_MBOX_SZ] = 0;
-	kernel_task_current[TASK_MBOX_COUNT] = 0;
-	kernel_task_current[TASK_NAME]   = (int)k_strcpy_alloc("kernel");
+	kernel_task_current[TASK_MBOX_COUNT] = kernel_task_current[TASK_MBOX_HEAD] = 0;
+	kernel_task_current[TASK_NAME]   = (int)kernel_pool_strcpy("kernel");
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: task name updated\n");
 	if (!kernel_task_current[TASK_NAME]) {
@@ -2995,6 +4187,7 @@ int main (int argc, char **argv) {
 	kernel_task_current[TASK_EXTDATA] = 0;
 	++kernel_tasks_loaded;
 	++kernel_tasks_running;
+	kernel_task_ready(kernel_task_current, 0);
 	if (kernel_verbosity >= VERB_MAX)
 		kernel_print_task(kernel_task_current);
 
@@ -3010,14 +4203,14 @@ int main (int argc, char **argv) {
 	if (kernel_verbosity >= VERB_MAX)
         printf("c4ke: creating idle task..\n");
 	tmp_argv[0] = "idle";
-	if (!(kernel_task_idle = start_task_builtin((int *)&task_idle, 1, tmp_argv, "kernel/idle", PRIV_KERNEL))) {
+	if (!(kernel_task_idle = start_task_builtin((int *)&task_idle, 1, tmp_argv, "kernel/idle", PRIV_KERNEL, 0))) {
 		printf("Unable to create idle task!\n");
 		return -3;
 	}
 	kernel_task_set_sighandlers(kernel_task_idle);
 	if (kernel_verbosity >= VERB_MED)
 		printf("c4ke: kernel_task_idle at 0x%x\n", kernel_task_idle);
-	kernel_task_idle[TASK_NICE] = kernel_task_idle[TASK_NICE_BASE] = 20;
+	kernel_task_renice(kernel_task_idle, 20);
 
 	// Run kernel extension start callbacks
 	// TODO: return value not checked
@@ -3030,20 +4223,20 @@ int main (int argc, char **argv) {
 	// Test tasks, using kernel functions as entry points.
 	if (enable_test_tasks) {
 		tmp_argv[0] = "printloop1";
-		if (!(tsk = start_task_builtin((int *)&task_printloop_1, 1, tmp_argv, "printloop1", PRIV_USER))) {
+		if (!(tsk = start_task_builtin((int *)&task_printloop_1, 1, tmp_argv, "printloop1", PRIV_USER, 0))) {
 			printf("c4ke: Unable to start first printloop\n");
 		} else {
 			if (kernel_verbosity >= VERB_MED)
 				printf("c4ke: task_print_loop_1 started at 0x%x\n", tsk);
-			tsk[TASK_NICE] = tsk[TASK_NICE_BASE] = 20;
+			kernel_task_renice(tsk, 20);
 		}
 		tmp_argv[0] = "printloop2";
-		if (!(tsk = start_task_builtin((int *)&task_printloop_2, 1, tmp_argv, "printloop2", PRIV_USER))) {
+		if (!(tsk = start_task_builtin((int *)&task_printloop_2, 1, tmp_argv, "printloop2", PRIV_USER, 0))) {
 			printf("c4ke: Unable to start second printloop\n");
 		} else {
 			if (kernel_verbosity >= VERB_MED)
 				printf("c4ke: task_print_loop_2 started at 0x%x\n", tsk);
-			tsk[TASK_NICE] = tsk[TASK_NICE_BASE] = 20;
+			kernel_task_renice(tsk, 20);
 		}
 	}
 
@@ -3056,11 +4249,11 @@ int main (int argc, char **argv) {
 	}
     if (kernel_verbosity >= VERB_MED)
         printf("c4ke: kernel_init_argc = %i, kernel_init_argv = 0x%x\n", kernel_init_argc, kernel_init_argv);
-	if (!(kernel_init_task = start_task_builtin((int *)&task_loadc4r, kernel_init_argc, kernel_init_argv, "init", PRIV_KERNEL))) {
+	if (!(kernel_init_task = start_task_builtin((int *)&task_loadc4r, kernel_init_argc, kernel_init_argv, "init", PRIV_KERNEL, 0))) {
 		// Launch emergency shell external
 		printf("c4ke: Unable to start init process, starting emergency shell\n");
 		tmp_argv[0] = "eshell.c4r";
-		if (!(kernel_init_task = start_task_builtin((int *)&task_loadc4r, 1, tmp_argv, "eshell", PRIV_KERNEL))) {
+		if (!(kernel_init_task = start_task_builtin((int *)&task_loadc4r, 1, tmp_argv, "eshell", PRIV_KERNEL, 0))) {
 			printf("c4ke: Unable to start emergency shell\n");
 		}
 		if (kernel_verbosity >= VERB_MED)
@@ -3090,6 +4283,10 @@ int main (int argc, char **argv) {
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: installed trap handler at 0x%lx, previous = 0x%lx\n",
 	           (int *)&trap_handler, last_trap_handler);
+	old_fast_opcodes = __c4_configure(C4KE_CONF_FAST_OPCODES, fast_opcodes);
+	i = kernel_native_setup();
+	if (i && kernel_verbosity >= VERB_MED)
+		printf("c4ke: %d opcodes bound to native handlers\n", i);
 
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: configure signal handlers...\n");
@@ -3154,6 +4351,10 @@ int main (int argc, char **argv) {
 			if (kernel_verbosity >= VERB_MED)
 			printf("c4ke: running kernel extensions shutdown for %d extensions...\n", kernel_ext_count);
 		kext_run_all(KEXT_SHUTDOWN);
+		// Extensions have released everything, don't call them for the tasks below
+		i = 0;
+		while (i < kernel_ext_count)
+			kernel_extensions[KEXT__Sz * i++ + KEXT_TASK_CLEAN] = 0;
 	}
 	if (kernel_verbosity >= VERB_MED)
 		printf("c4ke: halting cycle interrupt...\n");
@@ -3161,14 +4362,20 @@ int main (int argc, char **argv) {
 	if (kernel_verbosity >= VERB_MED)
 		printf("c4ke: cleaning up all tasks...\n");
 	i = 1; // Skip kernel task (cleaned later)
-	while (++i < KERN_TASK_COUNT) {
-		kernel_clean_task(kernel_tasks + (TASK__Sz * i));
+	while (++i < kernel_task_slots) {
+		if (*(tsk = kernel_task_at(i)))
+			kernel_clean_task(tsk);
 	}
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: tasks shutdown\n");
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: cleaning up kernel task\n");
 	kernel_clean_task(kernel_tasks);
+	__c4_configure(C4KE_CONF_FAST_OPCODES, old_fast_opcodes);
+	if (kernel_native_context) {
+		__c4_configure(C4KE_CONF_NATIVE_OPCODE, 0);
+		free(kernel_native_context);
+	}
 	if (last_trap_handler) {
 		if (kernel_verbosity >= VERB_MIN)
 			printf("c4ke: unloading trap handler, restoring 0x%lx\n", last_trap_handler);
@@ -3177,8 +4384,23 @@ int main (int argc, char **argv) {
 	if (kernel_verbosity >= VERB_MAX)
 		printf("c4ke: unloading memory\n");
 	free(custom_opcodes);
-	free(kernel_tasks);
+	free(fast_opcodes);
+	kernel_names_sweep();
+	kernel_pool_drain();
+	free(kernel_pool_free);
+	i = 0;
+	while (i < kernel_task_slots) {
+		free((int *)kernel_task_chunks[i / KERN_TASK_CHUNK]);
+		i = i + KERN_TASK_CHUNK;
+	}
+	free(kernel_task_chunks);
+	free(kernel_pid_hash);
+	kernel_module_drop_all();
+	free(kernel_modules);
+	free(kernel_rq_head);
+	free(kernel_timers);
 	free(kernel_extensions);
+	free(kernel_ext_opcodes);
 	if (old_ih_cycle_handler) {
 		if (kernel_verbosity >= VERB_MED)
 			printf("c4ke: restoring old cycle interrupt handler @ 0x%lx\n", old_ih_cycle_handler);
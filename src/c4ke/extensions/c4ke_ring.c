@@ -0,0 +1,357 @@
+// C4KE Extension: Ring
+// Shared ring buffers for moving bulk data between tasks.
+//
+// One task creates a ring and passes its id to another, which opens it. Words
+// written by one are read by the other in order. A write waits while the ring
+// is full and a read waits while it is empty, and each side wakes the other as
+// it makes room or adds words. Once either side closes the ring, waiting reads
+// and writes return with what they have. Only the two tasks holding a ring can
+// use it, each closes it once, and a task that exits or is killed closes its
+// rings then.
+//
+// Opcodes, found by name through OP_REQUEST_SYMBOL:
+//   OP_RING_CREATE (int words) -> ring id, or 0 on failure. 0 words uses the default size
+//   OP_RING_OPEN   (int id) -> 0, or -1 if there is no such ring or it is already held by two tasks
+//   OP_RING_WRITE  (int id, int *words, int count) -> words written, or -1
+//   OP_RING_READ   (int id, int *words, int count) -> words read, 0 once closed and empty, or -1
+//   OP_RING_CLOSE  (int id) -> 0, or -1
+//
+// With the kernel's -t option a writer and reader task measure the throughput.
+
+#include <c4ke/extension.h>
+
+enum {
+	RING_MAX = 32,           // Rings open at once
+	RING_WORDS = 0x400,      // Default ring size
+	RING_WORDS_MIN = 0x10,   // Sizes are rounded up to a power of 2 within these
+	RING_WORDS_MAX = 0x10000,
+	RING_TEST_WORDS = 0x40000, // Words sent by the throughput test,
+	RING_TEST_BLOCK = 0x100,   // this many at a time
+};
+
+// Ring structure
+enum {
+	RING_BUF,     // int *, the words
+	RING_SIZE,    // int, capacity in words, a power of 2
+	RING_HEAD,    // int, index of the oldest word
+	RING_COUNT,   // int, words waiting to be read
+	RING_REFS,    // int, tasks with the ring open, 0 if the slot is free
+	RING_PID_A,   // int, pid of the task that created the ring, 0 once it closes
+	RING_PID_B,   // int, pid of the task that opened the ring, 0 until then or once it closes
+	RING_CLOSED,  // int, set once either side closes
+	RING_READER,  // int, pid of the task waiting to read, or 0
+	RING_WRITER,  // int, pid of the task waiting to write, or 0
+	RING__Sz
+};
+
+static int *ring_table;
+static int  ring_op_create, ring_op_open, ring_op_write, ring_op_read, ring_op_close;
+
+static int *ring_get (int id) {
+	int *r;
+	if (id < 1 || id > RING_MAX)
+		return 0;
+	r = ring_table + RING__Sz * (id - 1);
+	return r[RING_REFS] ? r : 0;
+}
+
+// @return RING_PID_A or RING_PID_B for the end pid holds, or 0
+static int ring_end (int *r, int pid) {
+	if (r[RING_PID_A] == pid) return RING_PID_A;
+	if (r[RING_PID_B] == pid) return RING_PID_B;
+	return 0;
+}
+
+// Ring id if the current task holds it
+static int *ring_held (int id) {
+	int *r;
+	if ((r = ring_get(id)) && ring_end(r, kernel_task_current[TASK_ID]))
+		return r;
+	return 0;
+}
+
+// Wake the task waiting in a RING_READER or RING_WRITER field, if any.
+// Tasks are kept by pid so that one that exits while waiting is not touched.
+static void ring_wake (int *r, int field) {
+	int *t;
+	if (r[field] && (t = kernel_task_find_pid(r[field])) && t[TASK_WAITSTATE] == WSTATE_EXT)
+		kernel_task_wake(t);
+	r[field] = 0;
+}
+
+// Put the current task to sleep until the other side wakes it.
+// Called and returns inside the critical path.
+static void ring_wait (int *r, int field) {
+	r[field] = kernel_task_current[TASK_ID];
+	*kernel_task_current = *kernel_task_current | STATE_WAITING;
+	kernel_task_current[TASK_WAITSTATE] = WSTATE_EXT;
+	++kernel_tasks_waiting;
+	kernel_task_wait(kernel_task_current);
+	trap_exit();
+	schedule();
+	critical_path_start();
+}
+
+// @return ring id held by pid, or 0 on failure
+static int ring_create (int words, int pid) {
+	int *r, id, size;
+
+	if (words <= 0) words = RING_WORDS;
+	size = RING_WORDS_MIN;
+	while (size < words && size < RING_WORDS_MAX)
+		size = size << 1;
+	id = 0;
+	while (id < RING_MAX && ring_table[RING__Sz * id + RING_REFS])
+		++id;
+	if (id == RING_MAX)
+		return 0;
+	r = ring_table + RING__Sz * id;
+	if (!(r[RING_BUF] = (int)malloc(sizeof(int) * size)))
+		return 0;
+	r[RING_SIZE] = size;
+	r[RING_HEAD] = r[RING_COUNT] = r[RING_CLOSED] = 0;
+	r[RING_READER] = r[RING_WRITER] = 0;
+	r[RING_PID_A] = pid;
+	r[RING_PID_B] = 0;
+	r[RING_REFS] = 1;
+	return id + 1;
+}
+
+// Release the end of the ring in field, RING_PID_A or RING_PID_B
+static void ring_close (int *r, int field) {
+	r[field] = 0;
+	r[RING_CLOSED] = 1;
+	ring_wake(r, RING_READER);
+	ring_wake(r, RING_WRITER);
+	if (!--r[RING_REFS])
+		free((int *)r[RING_BUF]);
+}
+
+static void op_ring_create (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	a = ring_create(sp[1], kernel_task_current[TASK_ID]);
+	trap_exit();
+}
+
+static void op_ring_open (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *r, pid;
+	pid = kernel_task_current[TASK_ID];
+	// Only the first open, while the creator still holds it
+	if ((r = ring_get(sp[1])) && r[RING_PID_A] && !r[RING_PID_B] && !r[RING_CLOSED] &&
+	    r[RING_PID_A] != pid) {
+		r[RING_PID_B] = pid;
+		++r[RING_REFS];
+		a = 0;
+	} else
+		a = -1;
+	trap_exit();
+}
+
+static void op_ring_close (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *r;
+	if ((r = ring_held(sp[1]))) {
+		ring_close(r, ring_end(r, kernel_task_current[TASK_ID]));
+		a = 0;
+	} else
+		a = -1;
+	trap_exit();
+}
+
+// Copies as much as fits each time, waiting for the reader to make room
+// until all count words are written or the ring is closed.
+static void op_ring_write (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *r, *src, left, n, tail, size;
+
+	if (!(r = ring_held(sp[1]))) {
+		a = -1;
+		trap_exit();
+		return;
+	}
+	src = (int *)sp[2];
+	left = sp[3];
+	size = r[RING_SIZE];
+	a = 0;
+	while (left > 0 && !r[RING_CLOSED]) {
+		if (r[RING_COUNT] == size) {
+			ring_wait(r, RING_WRITER);
+		} else {
+			// Up to the free space or the end of the buffer, whichever is first
+			tail = (r[RING_HEAD] + r[RING_COUNT]) & (size - 1);
+			if ((n = size - r[RING_COUNT]) > size - tail) n = size - tail;
+			if (n > left) n = left;
+			memcpy((int *)r[RING_BUF] + tail, src, sizeof(int) * n);
+			r[RING_COUNT] = r[RING_COUNT] + n;
+			src = src + n;
+			left = left - n;
+			a = a + n;
+			ring_wake(r, RING_READER);
+		}
+	}
+	trap_exit();
+}
+
+// Waits for at least one word unless the ring is closed, then copies up to
+// count of the words waiting.
+static void op_ring_read (int trap, int ins, int a, int *bp, int *sp, int *returnpc) {
+	int *r, *dst, left, n, head, size;
+
+	if (!(r = ring_held(sp[1]))) {
+		a = -1;
+		trap_exit();
+		return;
+	}
+	dst = (int *)sp[2];
+	left = sp[3];
+	size = r[RING_SIZE];
+	a = 0;
+	while (left > 0 && (r[RING_COUNT] || (!a && !r[RING_CLOSED]))) {
+		if (!r[RING_COUNT]) {
+			ring_wait(r, RING_READER);
+		} else {
+			head = r[RING_HEAD];
+			if ((n = r[RING_COUNT]) > size - head) n = size - head;
+			if (n > left) n = left;
+			memcpy(dst, (int *)r[RING_BUF] + head, sizeof(int) * n);
+			r[RING_HEAD] = (head + n) & (size - 1);
+			r[RING_COUNT] = r[RING_COUNT] - n;
+			dst = dst + n;
+			left = left - n;
+			a = a + n;
+			ring_wake(r, RING_WRITER);
+		}
+	}
+	trap_exit();
+}
+
+// Close the rings a task still holds when it exits or is killed
+static int ring_task_clean (int *t) {
+	int i, *r, pid, field;
+
+	pid = t[TASK_ID];
+	i = 0;
+	r = ring_table;
+	while (i < RING_MAX) {
+		if (r[RING_REFS] && (field = ring_end(r, pid))) {
+			// Don't wake the task being cleaned
+			if (r[RING_READER] == pid) r[RING_READER] = 0;
+			if (r[RING_WRITER] == pid) r[RING_WRITER] = 0;
+			ring_close(r, field);
+		}
+		r = r + RING__Sz;
+		++i;
+	}
+	return KXERR_NONE;
+}
+
+// Throughput test tasks
+static int ring_test_id;
+
+static int ring_test_writer (int argc, char **argv) {
+	int *block, sent, i;
+
+	if (!(block = malloc(sizeof(int) * RING_TEST_BLOCK))) {
+		printf("ring: writer failed to allocate memory\n");
+		return 1;
+	}
+	i = 0;
+	while (i < RING_TEST_BLOCK) { block[i] = i; ++i; }
+	sent = 0;
+	while (sent < RING_TEST_WORDS) {
+		if ((i = __c4_opcode(RING_TEST_BLOCK, block, ring_test_id, ring_op_write)) <= 0)
+			sent = RING_TEST_WORDS;
+		else
+			sent = sent + i;
+	}
+	__c4_opcode(ring_test_id, ring_op_close);
+	free(block);
+	return 0;
+}
+
+static int ring_test_reader (int argc, char **argv) {
+	int *block, received, bad, n, i, start, ms;
+
+	if (!(block = malloc(sizeof(int) * RING_TEST_BLOCK))) {
+		printf("ring: reader failed to allocate memory\n");
+		return 1;
+	}
+	__c4_opcode(ring_test_id, ring_op_open);
+	start = __time();
+	received = bad = 0;
+	while ((n = __c4_opcode(RING_TEST_BLOCK, block, ring_test_id, ring_op_read)) > 0) {
+		// The writer sends 0 .. RING_TEST_BLOCK - 1 repeatedly
+		i = 0;
+		while (i < n) {
+			if (block[i] != (received + i) % RING_TEST_BLOCK) ++bad;
+			++i;
+		}
+		received = received + n;
+	}
+	ms = __time() - start;
+	__c4_opcode(ring_test_id, ring_op_close);
+	free(block);
+	if (!ms) ms = 1;
+	printf("ring: %d bytes in %dms, %d bytes/s, %d words out of order\n",
+	       received * sizeof(int), ms, received * sizeof(int) * 1000 / ms, bad);
+	return 0;
+}
+
+static int ring_init () {
+	int i;
+
+	if (!(ring_table = malloc((i = sizeof(int) * RING__Sz * RING_MAX)))) {
+		printf("c4ke: ring module failed to allocate memory\n");
+		return KXERR_FAIL;
+	}
+	memset(ring_table, 0, i);
+	if (!(ring_op_create = kext_opcode("OP_RING_CREATE", (int *)&op_ring_create)) ||
+	    !(ring_op_open   = kext_opcode("OP_RING_OPEN", (int *)&op_ring_open)) ||
+	    !(ring_op_write  = kext_opcode("OP_RING_WRITE", (int *)&op_ring_write)) ||
+	    !(ring_op_read   = kext_opcode("OP_RING_READ", (int *)&op_ring_read)) ||
+	    !(ring_op_close  = kext_opcode("OP_RING_CLOSE", (int *)&op_ring_close)))
+		return KXERR_FAIL;
+	return KXERR_NONE;
+}
+
+static int ring_start () {
+	char **tmp_argv;
+	int *writer;
+
+	if (!enable_test_tasks)
+		return KXERR_NONE;
+	if (!(tmp_argv = malloc(sizeof(char **) * 1)))
+		return KXERR_FAIL;
+	// The ring is created for the writer, which runs after this returns
+	*tmp_argv = "ring writer";
+	if (!(writer = start_task_builtin((int *)&ring_test_writer, 1, tmp_argv, "ring: writer", PRIV_USER, 0))) {
+		printf("c4ke: unable to start ring writer\n");
+	} else if (!(ring_test_id = ring_create(0, writer[TASK_ID]))) {
+		printf("c4ke: ring test unable to create a ring\n");
+	} else {
+		*tmp_argv = "ring reader";
+		if (!start_task_builtin((int *)&ring_test_reader, 1, tmp_argv, "ring: reader", PRIV_USER, 0))
+			printf("c4ke: unable to start ring reader\n");
+	}
+	free(tmp_argv);
+	return KXERR_NONE;
+}
+
+static int ring_shutdown () {
+	int i, *r;
+
+	if (kernel_verbosity >= VERB_MAX)
+		printf("c4ke: ring module shutdown\n");
+	i = 0;
+	r = ring_table;
+	while (i < RING_MAX) {
+		if (r[RING_REFS])
+			free((int *)r[RING_BUF]);
+		r = r + RING__Sz;
+		++i;
+	}
+	free(ring_table);
+	return KXERR_NONE;
+}
+
+static int __attribute__((constructor)) ring_constructor () {
+	kext_register("ring", (int *)&ring_init, (int *)&ring_start, (int *)&ring_shutdown);
+	kext_task_clean("ring", (int *)&ring_task_clean);
+}
@@ -57,16 +57,23 @@ int main (int argc, char **argv) {
 	//kill(parent(), SIGUSR2); // report failure
 	//exit(1);                 // fake a crash
 
+	if (!(msg = malloc((i = sizeof(int) * MSG__Sz)))) {
+		printf("vfs%d: memory allocation failure of %d bytes\n", instance, i);
+		return 1;
+	}
+
 	printf("vfs%d: entering message loop...\n", instance);
 	run = 1;
 	while(run) {
 		// wait for a message...
-		if ((msg = await_message(MSG_TIMEOUT))) {
-			printf("vfs%d: got message addr 0x%x\n", instance, msg);
+		if (receive_message(msg, MSG_TIMEOUT)) {
+			message_handler((int *)msg[MSG_SENDER], msg[MSG_SIZE], (char *)msg[MSG_DATA]);
+			free((char *)msg[MSG_DATA]);
 		} else {
 			// printf("vfs%d: message timeout\n", instance);
 		}
 	}
+	free(msg);
 
 	printf("vfs%d: syncing filesystems...\n", instance);
 	//__c4_opcode(500, OP_USER_SLEEP);
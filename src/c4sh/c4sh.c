@@ -142,48 +142,14 @@ static int streq (char *a, char *b) {
 }
 
 ///
-// Memcpy and memmove implementations
+// Memcpy and memmove, argument order kept from the original byte loops.
+// Both use the native intrinsics where available, see u0.h.
 ///
 static void *sh_memcpy (void *source, void *dest, int length) {
-	int   i;
-	int  *is, *id;
-	char *cs, *cd;
-
-	i = 0;
-	if((int)dest   % sizeof(int) == 0 &&
-	   (int)source % sizeof(int) == 0 &&
-	   length % sizeof(int) == 0) {
-		is = source; id = dest;
-		length = length / sizeof(int);
-		while (i < length) { id[i] = is[i]; ++i; }
-	} else {
-		cs = source; cd = dest;
-		while (i < length) { cd[i] = cs[i]; ++i; }
-	}
-
-	return dest;
+	return memcpy(dest, source, length);
 }
 void *sh_memmove (void *source, void *dest, int length) {
-	int   i;
-	int  *is, *id;
-	char *cs, *cd;
-
-	if ((int)dest < (int)source)
-		return sh_memcpy(dest, source, length);
-
-	i = length;
-	if((int)dest   % sizeof(int) == 0 &&
-	   (int)source % sizeof(int) == 0 &&
-	   length % sizeof(int) == 0) {
-		is = source; id = dest;
-		length = length / sizeof(int);
-		while (i > 0) { id[i - 1] = is[i - 1]; --i; }
-	} else {
-		cs = source; cd = dest;
-		while (i > 0) { cd[i - 1] = cs[i - 1]; --i; }
-	}
-
-	return dest;
+	return memmove(dest, source, length);
 }
 
 static void __memcpy_trailing_nul (char *dest, char *src, int sz) {
@@ -213,17 +179,10 @@ static char *env_find (char *name) {
 	return 0;
 }
 
-// TODO: this is incorrect
-// Reproduction of error:
-//   set foo 123
-//   set bar foo
-//   set foo 1
-//   set
-// ^ environment now corrupted
 static void *env_set (char *name, char *value) {
 	char *target;
 	int   target_len, value_len;
-	char *source, *dest, *new_max;
+	char *source, *dest;
 
 	value_len = strlen(value);
 
@@ -234,19 +193,12 @@ static void *env_set (char *name, char *value) {
 		*target++ = '=';
 		env_max = target + value_len + 1;
 	} else {
+		// Move the entries after the old value to follow the new one
 		target_len = strlen(target);
-		if (value_len < target_len) {
-			// truncate: move data after value back
-			source  = target + target_len + 1;
-			dest    = target + value_len + 1;
-			new_max = env_max - (target_len - value_len);
-		} else {
-			// expand: move data after value forward
-			source  = target + value_len + 1;
-			dest    = target + target_len + 1;
-			new_max = env_max + (value_len - target_len);
-		}
-		sh_memmove(source, dest, env_max - dest);
+		source = target + target_len + 1;
+		dest   = target + value_len + 1;
+		sh_memmove(source, dest, env_max - source);
+		env_max = env_max + (value_len - target_len);
 	}
 
 	// copy value over
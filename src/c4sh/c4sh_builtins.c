@@ -14,6 +14,7 @@
 //  - fg
 //  - help
 //  - kill
+//  - prof
 //  - ps
 //  - toggle
 //
@@ -263,6 +264,81 @@ int kill_run (int argc, char **argv) {
 	return CR_OK;
 }
 
+///
+// prof
+//
+// Print the functions processes spend their time in, as sampled by the
+// kernel profiler.
+///
+
+enum {
+	PROF_ELEMENTS = 257, // enough for every address the kernel keeps, and lost samples
+	PROF_TOP = 5,        // functions per process listed,
+	PROF_TOP_PID = 20    // or for a single process
+};
+
+void prof_usage (char *argv0) {
+	printf("Lists the functions each process was most often interrupted in.\n");
+	printf("Requires the kernel to be started with -p, and -g to name functions.\n");
+	printf("Example: prof\n");
+	printf("         prof 3\n");
+}
+
+void prof_print (int *elements, int pid, char *name, int namelen, int top) {
+	int *e, n, i, total, pct;
+
+	if ((n = kern_task_profile(pid, elements, PROF_ELEMENTS)) <= 0)
+		return;
+	total = i = 0;
+	e = elements;
+	while (i++ < n) {
+		total = total + e[KPE_COUNT];
+		e = e + KPE__Sz;
+	}
+	printf("%d %.*s: %d samples\n", pid, namelen, name, total);
+	i = 0;
+	e = elements;
+	while (i++ < n && i <= top) {
+		pct = e[KPE_COUNT] * 1000 / total;
+		printf("  %3d.%d%% %6d  ", pct / 10, pct % 10, e[KPE_COUNT]);
+		if (e[KPE_NAME]) printf("%.*s\n", e[KPE_NAMELEN], (char *)e[KPE_NAME]);
+		else if (e[KPE_ADDRESS]) printf("0x%lx\n", e[KPE_ADDRESS]);
+		else printf("(lost)\n");
+		e = e + KPE__Sz;
+	}
+}
+
+int  prof_run   (int argc, char **argv) {
+	int *elements, *kti, *kte, i, p, found;
+
+	if (!(elements = malloc(sizeof(int) * KPE__Sz * PROF_ELEMENTS))) {
+		printf("c4sh: prof unable to allocate memory\n");
+		return CR_FAIL;
+	}
+	p = found = 0;
+	if (kern_task_profile(pid(), elements, 0) < 0) {
+		printf("c4sh: the kernel is not profiling, start it with -p\n");
+	} else if (argc > 1 && atoi_check(argv[1], &p) != ATOI_OK) {
+		printf("c4sh: unable to understand '%s'\n", argv[1]);
+	} else if ((kti = kern_tasks_export())) {
+		i = 0;
+		kte = (int *)kti[KTI_LIST];
+		while (i++ < kti[KTI_COUNT]) {
+			if (*kte && (!p || kte[KTE_TASK_ID] == p)) {
+				prof_print(elements, kte[KTE_TASK_ID], (char *)kte[KTE_TASK_NAME], kte[KTE_TASK_NAMELEN],
+				           p ? PROF_TOP_PID : PROF_TOP);
+				++found;
+			}
+			kte = kte + KTE__Sz;
+		}
+		kern_tasks_export_free(kti);
+		if (p && !found)
+			printf("c4sh: no process %d\n", p);
+	}
+	free(elements);
+	return CR_OK;
+}
+
 ///
 // ps
 ///
@@ -340,6 +416,13 @@ static int __attribute__((constructor)) c4sh_builtins_init (int *c4r) {
 		(int *)&kill_usage,         // Callback for help kill
 		(int *)&kill_run))          // Callback to run the command
 		printf("c4sh: failed to register builtin 'kill'\n");
+	if (CR_FAIL == c4sh_builtin_register(
+		"prof",                     // Command name
+		"Print the hottest functions of processes", // Short description
+		"[pid]",                    // Short usage
+		(int *)&prof_usage,         // Callback for help prof
+		(int *)&prof_run))          // Callback to run the command
+		printf("c4sh: failed to register builtin 'prof'\n");
 	if (CR_FAIL == c4sh_builtin_register(
 		"ps",                       // Command name
 		"Print process listing",    // Short description
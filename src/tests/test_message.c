@@ -0,0 +1,66 @@
+// C4KE test: message passing
+//
+// Starts a second copy of itself that echoes every message back to its
+// sender, and times a number of round trips. Payloads are handed over rather
+// than copied, so both sides keep passing the same buffer back and forth.
+// An empty message tells the echo process to exit.
+
+#include "u0.c"
+
+enum { ROUNDS = 1000 };
+
+int echo (int *msg) {
+	while (receive_message(msg, TIMEOUT_NEVER)) {
+		if (!msg[MSG_SIZE]) {
+			free((char *)msg[MSG_DATA]);
+			return 0;
+		}
+		if (send_message(msg[MSG_SENDER], msg[MSG_SIZE], (char *)msg[MSG_DATA])) {
+			printf("test_message: echo failed to reply\n");
+			return 1;
+		}
+	}
+	return 2;
+}
+
+int main (int argc, char **argv) {
+	int *msg, child, i, t;
+	char **args, *data;
+
+	msg = malloc(sizeof(int) * MSG__Sz);
+	if (argc > 1)
+		return echo(msg);
+
+	args = malloc(sizeof(char *) * 3);
+	args[0] = "test_message.c4r";
+	args[1] = "echo";
+	args[2] = 0;
+	if (!(child = kern_user_start_c4r(2, args, args[0], PRIV_USER))) {
+		printf("test_message: unable to start echo process\n");
+		return 1;
+	}
+	data = malloc(5);
+	data[0] = 'p'; data[1] = 'i'; data[2] = 'n'; data[3] = 'g'; data[4] = 0;
+
+	t = __time();
+	i = 0;
+	while (i < ROUNDS) {
+		if (send_message(child, 5, data)) {
+			printf("test_message: send failed\n");
+			return 1;
+		}
+		if (!receive_message(msg, 1000) || msg[MSG_SENDER] != child) {
+			printf("test_message: no reply from echo process\n");
+			return 1;
+		}
+		data = (char *)msg[MSG_DATA];
+		++i;
+	}
+	printf("test_message: %d round trips of '%s' in %dms\n", ROUNDS, data, __time() - t);
+
+	send_message(child, 0, data);
+	printf("test_message: echo process exited with %d\n", await_pid(child));
+	free(args);
+	free(msg);
+	return 0;
+}
@@ -0,0 +1,54 @@
+// C4KE test: exit codes of children that are not awaited straight away
+//
+// Starts many copies of itself that exit with a code derived from their pid,
+// and only awaits them once all have been started, newest first. The kernel
+// keeps a bounded number of exit codes per parent, so the newest children
+// must report the right code and the oldest may already have been dropped
+// (-1), but none may report a wrong one.
+
+#include "u0.c"
+
+enum {
+	CHILDREN = 300,
+	NEWEST = 32      // Children awaited first, which must all be found
+};
+
+int main (int argc, char **argv) {
+	int *pids, i, code, found, dropped;
+	char **args;
+
+	if (argc > 1)
+		return pid() % 100 + 1;
+
+	pids = malloc(sizeof(int) * CHILDREN);
+	args = malloc(sizeof(char *) * 3);
+	args[0] = "test_reap.c4r";
+	args[1] = "child";
+	args[2] = 0;
+	i = 0;
+	while (i < CHILDREN) {
+		if (!(pids[i] = kern_user_start_c4r(2, args, args[0], PRIV_USER))) {
+			printf("test_reap: unable to start child %d\n", i);
+			return 1;
+		}
+		++i;
+	}
+	found = dropped = 0;
+	while (i--) {
+		if ((code = await_pid(pids[i])) == -1) {
+			if (i >= CHILDREN - NEWEST) {
+				printf("test_reap: newest child %d lost its exit code\n", pids[i]);
+				return 1;
+			}
+			++dropped;
+		} else if (code != pids[i] % 100 + 1) {
+			printf("test_reap: child %d exited with %d, expected %d\n", pids[i], code, pids[i] % 100 + 1);
+			return 1;
+		} else
+			++found;
+	}
+	printf("test_reap: %d exit codes found, %d dropped\n", found, dropped);
+	free(args);
+	free(pids);
+	return 0;
+}